@@ -1,17 +1,27 @@
 // The main ray tracer.
 
-#include <Fl/fl_ask.h>
-
 #include "RayTracer.h"
+#include "ThreadPool.h"
+#include "SampleCache.h"
 #include "scene/light.h"
 #include "scene/material.h"
 #include "scene/ray.h"
+#include "scene/sampler.h"
+#include "scene/raystats.h"
 #include "fileio/read.h"
 #include "fileio/parse.h"
+#include "fileio/scenecache.h"
 #include <math.h> 
+#include <string.h>
+#include <algorithm>
+#include <atomic>
+#include <iterator>
 
 const double PI = 3.14159265358979323846264338327950288;
 
+// std::min takes it by reference, so it needs a definition of its own
+const int RayTracer::MAX_ADAPTIVE_DEPTH;
+
 double degreeRadian(vec3f v1, vec3f v2) {
 	vec3f v1n = v1.normalize();
 	vec3f v2n = v2.normalize();
@@ -26,57 +36,68 @@ double degreeRadian(vec3f v1, vec3f v2) {
 vec3f RayTracer::trace( Scene *scene, double x, double y )
 {
 	vec3f thresh(scene->getTerimnationThreshold(), scene->getTerimnationThreshold(), scene->getTerimnationThreshold());
-	std::stack<const SceneObject*> objStack;	//empty stack for tracking overlapping objects
-	std::stack<isect> isectStack;	//empty stack for tracking overlapping objects
+	MediumStack media;	//empty stack for tracking overlapping objects
+
+	Sampler& sampler = Sampler::forThread();
+	sampler.nextSample();
 
-	if (m_pUI->getEnableDepthofField()) {
+	if (settings.depthOfField) {
 		ray primRay(vec3f(0, 0, 0), vec3f(0, 0, 0));
 		scene->getCamera()->rayThrough(x, y, primRay);
 		vec3f tracedColor(0.0, 0.0, 0.0);
-		for (int i = 0; i < 100; i++) {	//fire 100 random rays instead of the primary ray
-			double aperture = m_pUI->getAperture();
-			double focalDist = m_pUI->getFocalLength();
+		SampleSequence lens(sampler, effectSamples, 1);
+		for (int i = 0; i < effectSamples; i++) {	//fire effectSamples random rays instead of the primary ray
+			double aperture = settings.aperture;
+			double focalDist = settings.focalLength;
 			vec3f camPosition = scene->getCamera()->getEye();
 			vec3f primDir = primRay.getDirection();
 			vec3f focalPoint = camPosition + focalDist * primDir;
-			vec3f randomPoint = camPosition + ((double(rand()) / double(RAND_MAX)) * aperture) * scene->getCamera()->getv();
+			vec3f randomPoint = camPosition + (lens.get(i, 0) * aperture) * scene->getCamera()->getv();
 			vec3f secondaryDir = (focalPoint - randomPoint).normalize();
 			ray secondaryRay(randomPoint, secondaryDir);
-			tracedColor += traceRay(scene, secondaryRay, thresh, 0,  1.0, isectStack ).clamp();
+			tracedColor += traceRay(scene, secondaryRay, thresh, 0,  1.0, media ).clamp();
 		}
 
-		return tracedColor / 100.0;
+		return tracedColor / effectSamples;
 
 	}
 	else if (scene->getMotionBlur()) {	//Assume that motion blur and DOF will not happen simutaneously
 		//backup the geometries in this scene
-		//for every geometry in scene, translate 100 times
-		//do raytracing 100 times
-		mat4f slightTranslation  ( vec4f(1.0, 0.0, 0.0, 0.005),
-									vec4f(0.0, 1.0, 0.0, 0.005),
-									vec4f(0.0, 0.0, 1.0, 0.005),
-									vec4f(0.0, 0.0, 0.0, 1.0) );
+		//for every geometry in scene, translate effectSamples times along
+		//(0.5, 0.5, 0.5) in all, and do raytracing once per step
+		double step = 0.5 / effectSamples;
+		// the passes of a progressive render each start at a random point
+		// of the first step, so that together they cover the whole path
+		double first = pass > 0 ? sampler.uniform() * step : step;
 
 		vec3f tracedColor(0.0, 0.0, 0.0);
 		
-		//backup the xforms
-		std::vector<mat4f> backupMatrices;
+		//backup the xforms, into a buffer that is kept for the next pixel
+		static thread_local std::vector<mat4f> backupMatrices;
+		backupMatrices.clear();
 		for (list<Geometry*>::iterator itr = scene->beginGeometries(); itr != scene->endGeometries(); itr++) {
 			backupMatrices.push_back((*itr)->getTransformNode()->getXform());
 		}
 
-		for (int i = 0; i < 100; i++) {
+		for (int i = 0; i < effectSamples; i++) {
+			double d = first + i * step;
+			mat4f translation  ( vec4f(1.0, 0.0, 0.0, d),
+								vec4f(0.0, 1.0, 0.0, d),
+								vec4f(0.0, 0.0, 1.0, d),
+								vec4f(0.0, 0.0, 0.0, 1.0) );
+
 			//update the position of all objects
+			int counter = 0;
 			for (list<Geometry*>::iterator itr = scene->beginGeometries(); itr != scene->endGeometries(); itr++) {
-				mat4f backup = (*itr)->getTransformNode()->getXform();
-				(*itr)->getTransformNode()->setXform(slightTranslation * backup);
+				(*itr)->getTransformNode()->setXform(translation * backupMatrices[counter]);
+				counter++;
 			}
 
 
 			//trace a ray normally
 			ray r(vec3f(0, 0, 0), vec3f(0, 0, 0));
 			scene->getCamera()->rayThrough(x, y, r);
-			tracedColor += traceRay(scene, r, thresh, 0,1.0, isectStack).clamp();
+			tracedColor += traceRay(scene, r, thresh, 0,1.0, media).clamp();
 		}
 		//restore the xforms after finishing up this pixel
 		int counter = 0;
@@ -84,7 +105,7 @@ vec3f RayTracer::trace( Scene *scene, double x, double y )
 			(*itr)->getTransformNode()->setXform(backupMatrices[counter]);
 			counter++;
 		}
-		return tracedColor / 100.0;
+		return tracedColor / effectSamples;
 
 
 	}
@@ -93,7 +114,7 @@ vec3f RayTracer::trace( Scene *scene, double x, double y )
 		
 		ray r(vec3f(0, 0, 0), vec3f(0, 0, 0));
 		scene->getCamera()->rayThrough(x, y, r);
-		vec3f tracedColor = traceRay(scene, r, thresh, 0,1.0 ,isectStack).clamp();
+		vec3f tracedColor = traceRay(scene, r, thresh, 0,1.0 ,media).clamp();
 		return tracedColor;
 	}
 
@@ -102,106 +123,142 @@ vec3f RayTracer::trace( Scene *scene, double x, double y )
 // Do recursive ray tracing!  You'll want to insert a lot of code here
 // (or places called from here) to handle reflection, refraction, etc etc.
 vec3f RayTracer::traceRay( Scene *scene, const ray& r, 
-	const vec3f& thresh, int depth,  double currIndex, std::stack<isect> isectStack)
+	const vec3f& thresh, int depth,  double currIndex, MediumStack& media)
 {
 	isect i;
 
-	if( scene->intersect( r, i ) ) {
-		// YOUR CODE HERE
-		
-		// An intersection occured!  We've got work to do.  For now,
-		// this code gets the material for the surface that was intersected,
-		// and asks that material to provide a color for the ray.  
-
-		// This is a great place to insert code for recursive ray tracing.
-		// Instead of just returning the result of shade(), add some
-		// more steps: add in the contributions from reflected and refracted
-		// rays.
-
-		const Material& m = i.getMaterial();
-
-		//Direct component 
-		//vec3f directColor = prod(m.shade(scene, r, i), (vec3f(1.0f, 1.0f, 1.0f) - m.kt));
-		vec3f directColor = m.shade(scene, r, i);
-		vec3f reflecColor = { 0.0f,0.0f,0.0f };
-		vec3f refracColor = { 0.0f, 0.0f, 0.0f };
-
-
-		//reflective component
-		if (directColor.length() >= thresh.length()) {
-			if (scene->getGlossyReflection() && depth<depthLimit) {
-				ray reflecRay(r.at(i.t), (2 * (i.N.dot(-r.getDirection()))*i.N + r.getDirection()).normalize());
-				vec3f primDirection = reflecRay.getDirection();
-				for (int j = 0; j < 100; j++) {
-					vec3f uDistortion = primDirection.cross(i.N).normalize() * (double(rand()) * 0.1 / double(RAND_MAX));
-					vec3f vDistortion = primDirection.cross(uDistortion).normalize() * (double(rand()) * 0.1 / double(RAND_MAX));
-					ray secondaryRay(r.at(i.t), primDirection + uDistortion + vDistortion);
-					reflecColor += prod(traceRay(scene, secondaryRay, thresh, depth + 1,  1.0 ,isectStack), m.kr);
-				}
-				reflecColor /= 100.0;
+	RayStats& stats = RayStats::forThread();
+	if (depth == 0)
+		++stats.primaryRays;
+	else
+		++stats.secondaryRays;
+
+	if( scene->intersect( r, i ) )
+		return shadeHit(scene, r, i, thresh, depth, currIndex, media);
+	else
+		return missColor(scene, r);
+}
+
+// The color of ray r, which hit the scene at i.  shadows is passed on to
+// Material::shade.  media is left as it was found.
+vec3f RayTracer::shadeHit( Scene *scene, const ray& r, const isect& i,
+	const vec3f& thresh, int depth, double currIndex, MediumStack& media,
+	const vec3f* shadows)
+{
+	// YOUR CODE HERE
+	
+	// An intersection occured!  We've got work to do.  For now,
+	// this code gets the material for the surface that was intersected,
+	// and asks that material to provide a color for the ray.  
+
+	// This is a great place to insert code for recursive ray tracing.
+	// Instead of just returning the result of shade(), add some
+	// more steps: add in the contributions from reflected and refracted
+	// rays.
+
+	const Material& m = i.getMaterial();
+
+	//Direct component 
+	//vec3f directColor = prod(m.shade(scene, r, i), (vec3f(1.0f, 1.0f, 1.0f) - m.kt));
+	vec3f directColor = m.shade(scene, r, i, shadows);
+	vec3f reflecColor = { 0.0f,0.0f,0.0f };
+	vec3f refracColor = { 0.0f, 0.0f, 0.0f };
+
+
+	//reflective component
+	if (directColor.length() >= thresh.length()) {
+		if (scene->getGlossyReflection() && depth<depthLimit) {
+			ray reflecRay(r.at(i.t), (2 * (i.N.dot(-r.getDirection()))*i.N + r.getDirection()).normalize());
+			vec3f primDirection = reflecRay.getDirection();
+			SampleSequence lobe(Sampler::forThread(), effectSamples, 2);
+			for (int j = 0; j < effectSamples; j++) {
+				double du, dv;
+				lobe.get2D(j, du, dv);
+				vec3f uDistortion = primDirection.cross(i.N).normalize() * (du * 0.1);
+				vec3f vDistortion = primDirection.cross(uDistortion).normalize() * (dv * 0.1);
+				ray secondaryRay(r.at(i.t), primDirection + uDistortion + vDistortion);
+				reflecColor += prod(traceRay(scene, secondaryRay, thresh, depth + 1,  1.0 ,media), m.kr);
 			}
-			else {
-				ray reflecRay(r.at(i.t), (2 * (i.N.dot(-r.getDirection()))*i.N + r.getDirection()).normalize());
-				if (depth < depthLimit) {
-					reflecColor = prod(traceRay(scene, reflecRay, thresh, depth + 1,1.0 ,isectStack), m.kr);
-				}
+			reflecColor /= effectSamples;
+		}
+		else {
+			ray reflecRay(r.at(i.t), (2 * (i.N.dot(-r.getDirection()))*i.N + r.getDirection()).normalize());
+			if (depth < depthLimit) {
+				reflecColor = prod(traceRay(scene, reflecRay, thresh, depth + 1,1.0 ,media), m.kr);
 			}
+		}
 
 
 
 
-			// Refractive component
-			double indexofNextMedium;
-			if (!isectStack.empty() && isectStack.top().obj == i.obj) {	//leaving this object
-				isectStack.pop();
-				if (isectStack.empty())
-					indexofNextMedium = 1.0;	//back into air, since the only element was poped
-				else
-					indexofNextMedium = isectStack.top().getMaterial().index;
-			}
-			else {	//entering another object
-				isectStack.push(i);
-				indexofNextMedium = m.index;
-			}
-			double mu = currIndex / indexofNextMedium;
-
-			//double mu;
-			//if (fromAir) {	  //Air into object
-			//	mu = 1.0 / m.index;
-			//}
-			//else {	//medium into air
-			//	mu = m.index;
-			//}
-			double criticalSin = 1 / mu;	//sine of critical angle
-			double cosphi = i.N.dot(-r.getDirection());
-			double phi = acos(cosphi);
-			if (criticalSin - sin(phi) > RAY_EPSILON) {	//no TIR
-				double theta = asin(sin(phi) * mu);
-				double costheta = cos(theta);
-				vec3f newDirection = (mu * r.getDirection() - (costheta - mu*cosphi) * i.N).normalize();
-				ray refracRay(r.at(i.t), newDirection);
-				if (depth < depthLimit) {
-					refracColor = prod(traceRay(scene, refracRay, thresh, depth + 1, indexofNextMedium, isectStack	), m.kt);
-				}
+		// Refractive component
+		double indexofNextMedium;
+		bool leaving = !media.empty() && media.topObject() == i.obj;
+		bool entered = false;
+		double leftIndex = 0.0;
+		if (leaving) {	//leaving this object
+			leftIndex = media.topIndex();
+			media.pop();
+			if (media.empty())
+				indexofNextMedium = 1.0;	//back into air, since the only element was poped
+			else
+				indexofNextMedium = media.topIndex();
+		}
+		else {	//entering another object
+			entered = media.push(i.obj, m.index);
+			indexofNextMedium = m.index;
+		}
+		double mu = currIndex / indexofNextMedium;
+
+		//double mu;
+		//if (fromAir) {	  //Air into object
+		//	mu = 1.0 / m.index;
+		//}
+		//else {	//medium into air
+		//	mu = m.index;
+		//}
+		double criticalSin = 1 / mu;	//sine of critical angle
+		// a dot product of float unit vectors can come out just over 1,
+		// where acos gives NaN and the refracted ray would be lost
+		double cosphi = std::min(1.0, i.N.dot(-r.getDirection()));
+		double phi = acos(cosphi);
+		// an angle, not a distance, so not RAY_EPSILON, which the float
+		// build makes larger
+		if (criticalSin - sin(phi) > NORMAL_EPSILON) {	//no TIR
+			double theta = asin(sin(phi) * mu);
+			double costheta = cos(theta);
+			vec3f newDirection = (mu * r.getDirection() - (costheta - mu*cosphi) * i.N).normalize();
+			ray refracRay(r.at(i.t), newDirection);
+			if (depth < depthLimit) {
+				refracColor = prod(traceRay(scene, refracRay, thresh, depth + 1, indexofNextMedium, media	), m.kt);
 			}
 		}
 
-			return directColor + reflecColor + refracColor;
-	
-	} else {
-		// No intersection. Return background color
-		if (this->backgroundImg  && m_pUI->getEnableBackground()) {
-			vec3f camerau = scene->getCamera()->getu();
-			vec3f camerav = scene->getCamera()->getv();
-			double projRayontoU = (r.getDirection() * camerau);
-			double projRayontoV = (r.getDirection() * camerav);
-
-			return getBackgroundColor(projRayontoU + 0.5, projRayontoV + 0.5);
-		}
-		else {
-			return vec3f(0.0f, 0.0, 0.0f);
+		// hand media back the way this ray found them
+		if (leaving)
+			media.push(i.obj, leftIndex);
+		else if (entered)
+			media.pop();
+	}
+
+	return directColor + reflecColor + refracColor;
+}
+
+// The background behind a ray that hit nothing.
+vec3f RayTracer::missColor( Scene *scene, const ray& r )
+{
+	// No intersection. Return background color
+	if (this->backgroundImg  && settings.background) {
+		vec3f camerau = scene->getCamera()->getu();
+		vec3f camerav = scene->getCamera()->getv();
+		double projRayontoU = (r.getDirection() * camerau);
+		double projRayontoV = (r.getDirection() * camerav);
+
+		return getBackgroundColor(projRayontoU + 0.5, projRayontoV + 0.5);
+	}
+	else {
+		return vec3f(0.0f, 0.0, 0.0f);
 
-		}
 	}
 }
 
@@ -214,12 +271,18 @@ RayTracer::RayTracer()
 	m_bSceneLoaded = false;
 	depthLimit = 0;
 	backgroundImg = NULL;
-	m_pUI = NULL;
+	numThreads = 1;
+	pool = NULL;
+	frameIndex = 0;
+	effectSamples = EFFECT_SAMPLES;
+	pass = 0;
+	newSampleEpoch();
 }
 
 
 RayTracer::~RayTracer()
 {
+	delete pool;
 	delete [] buffer;
 	delete scene;
 }
@@ -276,23 +339,101 @@ vec3f RayTracer::getBackgroundColor(double x, double y)
 	}
 }
 
-void RayTracer::setUI(TraceUI * ui)
+void RayTracer::setThreads(int n)
+{
+	if (n < 0)
+		n = 0;
+	if (numThreads != n) {
+		numThreads = n;
+		// the pool is started again with the new size when next needed
+		delete pool;
+		pool = NULL;
+	}
+}
+
+void RayTracer::setFrame(int frame)
+{
+	frameIndex = frame;
+	newSampleEpoch();
+}
+
+int RayTracer::getFrame()
+{
+	return frameIndex;
+}
+
+ThreadPool* RayTracer::getPool()
+{
+	if( getThreads() == 1 )
+		return NULL;
+	if( !pool )
+		pool = new ThreadPool( numThreads );
+	return pool;
+}
+
+int RayTracer::getThreads()
 {
-	m_pUI = ui;
+	return numThreads > 0 ? numThreads : ThreadPool::hardwareThreads();
+}
+
+void RayTracer::setSettings(const RenderSettings& s)
+{
+	settings = s;
+	settings.adaptiveDepth = std::max(0, std::min(settings.adaptiveDepth, MAX_ADAPTIVE_DEPTH));
+	setDepthLimit(settings.depth);
+	newSampleEpoch();
+	if (scene)
+		settings.applyTo(scene);
+}
+
+const RenderSettings& RayTracer::getSettings()
+{
+	return settings;
 }
 
 bool RayTracer::loadScene( char* fn )
 {
 	try
 	{
-		scene = readScene( fn );
+		if( cacheDir.empty() )
+			scene = readScene( fn, getPool() );
+		else
+			scene = readCachedScene( fn, cacheDir, getPool() );
 	}
 	catch( ParseError pe )
 	{
-		fl_alert( "ParseError: %s\n", pe );
+		cerr << "ParseError: " << pe << endl;
 		return false;
 	}
 
+	return sceneReady();
+}
+
+bool RayTracer::loadScene( std::istream& is )
+{
+	try
+	{
+		if( cacheDir.empty() )
+			scene = readScene( is, getPool() );
+		else
+			scene = readCachedScene( is, cacheDir, getPool() );
+	}
+	catch( ParseError pe )
+	{
+		cerr << "ParseError: " << pe << endl;
+		return false;
+	}
+
+	return sceneReady();
+}
+
+void RayTracer::setCacheDir( const std::string& dir )
+{
+	cacheDir = dir;
+}
+
+bool RayTracer::sceneReady()
+{
 	if( !scene )
 		return false;
 	
@@ -300,10 +441,12 @@ bool RayTracer::loadScene( char* fn )
 	buffer_height = (int)(buffer_width / scene->getCamera()->getAspectRatio() + 0.5);
 
 	bufferSize = buffer_width * buffer_height * 3;
+	delete [] buffer;
 	buffer = new unsigned char[ bufferSize ];
 	
 	// separate objects into bounded and unbounded
-	scene->initScene();
+	scene->initScene( getPool() );
+	settings.applyTo(scene);
 	
 	// Add any specialized scene loading code here
 	
@@ -324,6 +467,9 @@ void RayTracer::traceSetup( int w, int h )
 		buffer = new unsigned char[ bufferSize ];
 	}
 	memset( buffer, 0, w*h*3 );
+	pass = 0;
+	// the camera or the scene may have moved since the last trace
+	newSampleEpoch();
 }
 
 void RayTracer::traceLines( int start, int stop )
@@ -335,66 +481,216 @@ void RayTracer::traceLines( int start, int stop )
 	if( stop > buffer_height )
 		stop = buffer_height;
 
-	for( int j = start; j < stop; ++j )
-		for( int i = 0; i < buffer_width; ++i )
-			tracePixel(i,j);
+	for( int j = start; j < stop; j += PACKET_WIDTH )
+		for( int i = 0; i < buffer_width; i += PACKET_WIDTH )
+			tracePacket( i, j, std::min( i + PACKET_WIDTH, buffer_width ),
+				std::min( j + PACKET_WIDTH, stop ) );
 }
 
-vec3f RayTracer::getAdaptivelySupersampledColor(Scene* scene, double x, double y, int depth) {
-	//x and y are the lower-left corner
-	double atomicx = double(1) / (double(buffer_width) * depth);	//grid size (determined in accordance to current depth)
-	double atomicy = double(1) / (double(buffer_height) * depth);
+// Same as traceLines, but the rows are cut into tiles that are traced on
+// all threads.  Every pixel is still written by exactly one tracePixel call,
+// so the image comes out the same as with traceLines.
+void RayTracer::traceTiles( int start, int stop )
+{
+	forEachTile( start, stop, [this]( int x0, int y0, int x1, int y1 ) {
+		for( int j = y0; j < y1; j += PACKET_WIDTH )
+			for( int i = x0; i < x1; i += PACKET_WIDTH )
+				tracePacket( i, j, std::min( i + PACKET_WIDTH, x1 ), std::min( j + PACKET_WIDTH, y1 ) );
+	} );
+}
 
-	
-	vec3f colorLowerLeft = trace(scene, x, y);
-	vec3f colorLowerRight = trace(scene, x + atomicx, y);
-	vec3f colorUpperLeft = trace(scene, x, y + atomicy);
-	vec3f colorUpperRight = trace(scene, x + atomicx, y + atomicy);
-	vec3f colorCentre = trace(scene, x + atomicx / 2, y + atomicy / 2);
-	if (depth <= adaSupLimit) {
-		if ((colorLowerLeft - colorCentre).length() > 0.01)
-			colorLowerLeft = getAdaptivelySupersampledColor(scene, x, y, depth + 1);
-		if ((colorLowerRight - colorCentre).length() > 0.01)
-			colorLowerRight = getAdaptivelySupersampledColor(scene, x + atomicx / 2, y, depth + 1);
-		if ((colorUpperLeft - colorCentre).length() > 0.01)
-			colorUpperLeft = getAdaptivelySupersampledColor(scene, x, y + atomicy / 2, depth + 1);
-		if ((colorUpperRight - colorCentre).length() > 0.01)
-			colorUpperRight = getAdaptivelySupersampledColor(scene, x + atomicx / 2, y + atomicy / 2, depth + 1);
+void RayTracer::forEachTile( int start, int stop, const std::function<void( int, int, int, int )>& f )
+{
+	forEachTile( 0, start, buffer_width, stop, f );
+}
+
+void RayTracer::forEachTile( int x0, int y0, int x1, int y1, const std::function<void( int, int, int, int )>& f )
+{
+	if( !scene )
+		return;
+
+	x0 = std::max( x0, 0 );
+	y0 = std::max( y0, 0 );
+	x1 = std::min( x1, buffer_width );
+	y1 = std::min( y1, buffer_height );
+	if( x0 >= x1 || y0 >= y1 )
+		return;
+
+	int tilesX = (x1 - x0 + TILE_SIZE - 1) / TILE_SIZE;
+	int tilesY = (y1 - y0 + TILE_SIZE - 1) / TILE_SIZE;
+
+	auto tile = [&]( int t ) {
+		int tx0 = x0 + (t % tilesX) * TILE_SIZE;
+		int ty0 = y0 + (t / tilesX) * TILE_SIZE;
+		f( tx0, ty0, std::min( tx0 + TILE_SIZE, x1 ), std::min( ty0 + TILE_SIZE, y1 ) );
+	};
+
+	// motion blur moves the objects around while a pixel is traced, so
+	// those pixels can't be traced side by side
+	if( getThreads() == 1 || scene->getMotionBlur() ) {
+		for( int t = 0; t < tilesX * tilesY; ++t )
+			tile( t );
+		return;
 	}
-	return (colorLowerLeft + colorLowerRight + colorUpperLeft + colorUpperRight) / 4;
+
+	getPool()->run( tilesX * tilesY, tile );
 }
 
-void RayTracer::tracePixel( int i, int j )
+void RayTracer::traceRegion( RenderTile& tile )
 {
-	vec3f col;	//color of this pixel
+	tile.x0 = std::max( tile.x0, 0 );
+	tile.y0 = std::max( tile.y0, 0 );
+	tile.x1 = std::max( std::min( tile.x1, buffer_width ), tile.x0 );
+	tile.y1 = std::max( std::min( tile.y1, buffer_height ), tile.y0 );
+	tile.pixels.assign( tile.width() * tile.height() * 3, 0 );
+
+	RenderTile* t = &tile;
+	forEachTile( tile.x0, tile.y0, tile.x1, tile.y1, [this, t]( int x0, int y0, int x1, int y1 ) {
+		for( int j = y0; j < y1; j += PACKET_WIDTH )
+			for( int i = x0; i < x1; i += PACKET_WIDTH )
+				tracePacket( i, j, std::min( i + PACKET_WIDTH, x1 ), std::min( j + PACKET_WIDTH, y1 ), t );
+	} );
+}
+
+void RayTracer::mergeTile( const RenderTile& tile )
+{
+	// a tile from a frame of another size, or cut short, isn't ours
+	if( tile.x0 < 0 || tile.y0 < 0 || tile.x1 > buffer_width || tile.y1 > buffer_height ||
+		tile.width() <= 0 || tile.height() <= 0 ||
+		tile.pixels.size() != (size_t)(tile.width() * tile.height() * 3) )
+		return;
 
+	size_t row = tile.width() * 3;
+	for( int j = tile.y0; j < tile.y1; ++j )
+		memcpy( buffer + (tile.x0 + j * buffer_width) * 3, &tile.pixels[ (j - tile.y0) * row ], row );
+}
+
+void RayTracer::makeBuckets( int size, std::vector<RenderTile>& buckets )
+{
+	buckets.clear();
+	if( size < 1 )
+		size = TILE_SIZE;
+	for( int y = 0; y < buffer_height; y += size )
+		for( int x = 0; x < buffer_width; x += size )
+			buckets.push_back( RenderTile( x, y, std::min( x + size, buffer_width ),
+				std::min( y + size, buffer_height ) ) );
+}
+
+void RayTracer::newSampleEpoch()
+{
+	// unique over all ray tracers, since the caches belong to the threads
+	static std::atomic<unsigned> epochs( 0 );
+	sampleEpoch = ++epochs;
+}
+
+// The color at point (x, y) of the adaptive lattice, traced only if no
+// earlier cell of this thread has traced it.  The sampler is seeded with
+// the lattice point, so the color is the same whichever cell gets there
+// first, and whichever thread.
+vec3f RayTracer::latticeSample( SampleCache& cache, int x, int y )
+{
+	vec3f col;
+	if( cache.find( x, y, col ) )
+		return col;
+
+	int steps = 1 << settings.adaptiveDepth;
+	Sampler::forThread().beginPixel( x, y, frameIndex );
+	col = trace( scene, double(x) / (double(buffer_width) * steps),
+		double(y) / (double(buffer_height) * steps) );
+	cache.insert( x, y, col );
+	return col;
+}
+
+bool RayTracer::contrasts( const vec3f& a, const vec3f& b ) const
+{
+	if( settings.adaptiveMetric == ADAPTIVE_CONTRAST ) {
+		// Mitchell's contrast, channel by channel, so that the same step
+		// counts for as much in the shadows as in the highlights
+		for( int k = 0; k < 3; ++k ) {
+			double sum = a[k] + b[k];
+			if( sum > 0.0 && fabs( a[k] - b[k] ) / sum > settings.adaptiveThreshold )
+				return true;
+		}
+		return false;
+	}
+	return (a - b).length() > settings.adaptiveThreshold;
+}
+
+// The average color of the cell of the lattice with its lower left corner
+// at (x, y) and size steps to a side.  A corner that contrasts with the
+// cell's centre is replaced by the average of its quarter of the cell,
+// down to cells one step wide.  Neighbouring cells and pixels share their
+// corners and edges, which the cache only lets be traced once.
+vec3f RayTracer::getAdaptivelySupersampledColor( SampleCache& cache, int x, int y, int size )
+{
+	vec3f corners[4] = {
+		latticeSample( cache, x, y ),
+		latticeSample( cache, x + size, y ),
+		latticeSample( cache, x, y + size ),
+		latticeSample( cache, x + size, y + size ),
+	};
+	if( size > 1 ) {
+		int half = size / 2;
+		vec3f centre = latticeSample( cache, x + half, y + half );
+		for( int k = 0; k < 4; ++k )
+			if( contrasts( corners[k], centre ) )
+				corners[k] = getAdaptivelySupersampledColor( cache,
+					x + (k & 1) * half, y + (k >> 1) * half, half );
+	}
+	return (corners[0] + corners[1] + corners[2] + corners[3]) / 4;
+}
+
+void RayTracer::tracePixel( int i, int j )
+{
 	if( !scene )
 		return;
 
+	setPixel( i, j, pixelColor( i, j ) );
+}
+
+vec3f RayTracer::pixelColor( int i, int j )
+{
+	vec3f col;	//color of this pixel
+
 	double x = double(i) / double(buffer_width);	//central x
 	double y = double(j) / double(buffer_height);	//central y
 	double atomicx = double(1) / double(buffer_width);	//corresponding length of one pixel
 	double atomicy = double(1) / double(buffer_height);
+
+	Sampler::forThread().beginPixel(i, j, frameIndex);
 	
-	if (m_pUI->getEnableAntialiasing()) {	//only return color of central x & central y
-		if (m_pUI->getAdaptiveSupersampling()) {
-			col = getAdaptivelySupersampledColor(scene, x, y, 1);	//it's much faster. the effect is similar to non-adaptive supersampling with 4/5 subpixels, which is super expensive
+	if (settings.antialiasing) {	//only return color of central x & central y
+		if (settings.adaptiveSupersampling) {
+			// a cache per thread, started afresh for every new epoch
+			static thread_local SampleCache cache;
+			static thread_local unsigned cacheEpoch = 0;
+			if (cacheEpoch != sampleEpoch) {
+				cache.clear();
+				cacheEpoch = sampleEpoch;
+			}
+			int steps = 1 << settings.adaptiveDepth;
+			col = getAdaptivelySupersampledColor(cache, i * steps, j * steps, steps);	//it's much faster. the effect is similar to non-adaptive supersampling with 4/5 subpixels, which is super expensive
 		}
 		else {		//non-adaptive supersampling
-			int numSubpixels = m_pUI->getNumSubpixels();
+			int numSubpixels = settings.numSubpixels;
 			double startx = x - 0.5 / double(buffer_width);
 			double starty = y - 0.5 / double(buffer_height);
 
 			double xstep = (1.0 / double(buffer_width)) / double(numSubpixels - 1);
 			double ystep = (1.0 / double(buffer_height)) / double(numSubpixels - 1);
 
-			for (int i = 0; i < numSubpixels; i++) {
-				for (int j = 0; j < numSubpixels; j++) {
-					if (m_pUI->getEnableJittering()) {	//random direction witin +- one atomic range
-						double offsetCoeff = ((double)rand() / (RAND_MAX)) * 2 - 1;
-						col = trace(scene, startx + xstep*i + offsetCoeff*atomicx, starty + ystep*j + offsetCoeff*atomicy);//the point to trace is a random point between x,y plus/minus one atomic length
-					}
-					else {//determined direction
+			if (settings.jittering) {	//spread the subpixels over the pixel with the sample pattern
+				int numSamples = numSubpixels*numSubpixels;
+				SampleSequence subpixels(Sampler::forThread(), numSamples, 2);
+				for (int k = 0; k < numSamples; k++) {
+					double u, v;
+					subpixels.get2D(k, u, v);
+					col += trace(scene, startx + u*atomicx, starty + v*atomicy) / numSamples;
+				}
+			}
+			else {
+				for (int i = 0; i < numSubpixels; i++) {
+					for (int j = 0; j < numSubpixels; j++) {	//determined direction
 						col += trace(scene, startx + xstep*i, starty + ystep*j) / (numSubpixels*numSubpixels);
 					}
 				}
@@ -404,9 +700,10 @@ void RayTracer::tracePixel( int i, int j )
 		
 	}
 	else {
-		if (m_pUI->getEnableJittering()) {
-			double offsetCoeff = ((double)rand() / (RAND_MAX)) * 2 - 1;
-			col = trace(scene, x + offsetCoeff*atomicx, y + offsetCoeff*atomicy);//the point to trace is a random point between x,y plus/minus one atomic length
+		if (settings.jittering) {
+			double u = Sampler::forThread().uniform() * 2 - 1;
+			double v = Sampler::forThread().uniform() * 2 - 1;
+			col = trace(scene, x + u*atomicx, y + v*atomicy);//the point to trace is a random point between x,y plus/minus one atomic length
 		}
 		else {
 			col = trace(scene, x, y);
@@ -414,9 +711,205 @@ void RayTracer::tracePixel( int i, int j )
 	}
 
 
-	unsigned char *pixel = this->buffer + ( i + j * buffer_width ) * 3;
+	return col;
+}
+
+void RayTracer::beginProgressive()
+{
+	accum.assign( buffer_width * buffer_height * 3, 0.0f );
+	pass = 0;
+}
 
+void RayTracer::tracePass( int start, int stop )
+{
+	if( !scene )
+		return;
+
+	if( pass == 0 ) {
+		// the preview: one ray per block, through its corner pixel, with a
+		// single ray for each effect
+		effectSamples = 1;
+		forEachTile( start, stop, [this]( int x0, int y0, int x1, int y1 ) {
+			for( int by = y0 - y0 % COARSE_SIZE; by < y1; by += COARSE_SIZE ) {
+				for( int bx = x0 - x0 % COARSE_SIZE; bx < x1; bx += COARSE_SIZE ) {
+					Sampler::forThread().beginPixel( bx, by, frameIndex );
+					vec3f col = trace( scene, double(bx) / double(buffer_width),
+						double(by) / double(buffer_height) );
+
+					for( int j = std::max( by, y0 ); j < std::min( by + COARSE_SIZE, y1 ); ++j )
+						for( int i = bx; i < std::min( bx + COARSE_SIZE, x1 ); ++i )
+							setPixel( i, j, col );
+				}
+			}
+		} );
+	} else {
+		effectSamples = PASS_SAMPLES;
+		forEachTile( start, stop, [this]( int x0, int y0, int x1, int y1 ) {
+			for( int j = y0; j < y1; ++j ) {
+				for( int i = x0; i < x1; ++i ) {
+					vec3f col = passSample( i, j );
+					float* sum = &accum[ (i + j * buffer_width) * 3 ];
+					sum[0] += (float)col[0];
+					sum[1] += (float)col[1];
+					sum[2] += (float)col[2];
+					setPixel( i, j, vec3f( sum[0], sum[1], sum[2] ) / pass );
+				}
+			}
+		} );
+	}
+	effectSamples = EFFECT_SAMPLES;
+}
+
+void RayTracer::endPass()
+{
+	++pass;
+}
+
+int RayTracer::getPasses()
+{
+	return pass;
+}
+
+bool RayTracer::progressiveDone()
+{
+	if( !scene || pass < 2 )
+		return false;
+
+	// with nothing left to chance every pass traces the same rays
+	return !settings.antialiasing && !settings.jittering && !settings.depthOfField &&
+		!scene->getGlossyReflection() && !scene->getMotionBlur() && !scene->getSoftShadow();
+}
+
+// One sample of pixel (i, j) for pass number pass: a single ray through a
+// random point of the pixel when antialiasing, spread as tracePixel spreads
+// its jittered rays otherwise.  Adaptive supersampling is left to the
+// passes adding up.
+vec3f RayTracer::passSample( int i, int j )
+{
+	double x = double(i) / double(buffer_width);
+	double y = double(j) / double(buffer_height);
+	double atomicx = double(1) / double(buffer_width);
+	double atomicy = double(1) / double(buffer_height);
+
+	// two sample numbers per pass: one for the point in the pixel, one
+	// for the camera ray that trace starts
+	Sampler& sampler = Sampler::forThread();
+	sampler.beginPixel( i, j, frameIndex, 2 * pass );
+
+	if( settings.antialiasing ) {
+		double u = sampler.uniform();
+		double v = sampler.uniform();
+		return trace( scene, x + (u - 0.5) * atomicx, y + (v - 0.5) * atomicy );
+	}
+	if( settings.jittering ) {
+		double u = sampler.uniform() * 2 - 1;
+		double v = sampler.uniform() * 2 - 1;
+		return trace( scene, x + u * atomicx, y + v * atomicy );
+	}
+	return trace( scene, x, y );
+}
+
+static void toBytes( unsigned char* pixel, const vec3f& col )
+{
 	pixel[0] = (int)( 255.0 * col[0]);
 	pixel[1] = (int)( 255.0 * col[1]);
 	pixel[2] = (int)( 255.0 * col[2]);
+}
+
+void RayTracer::setPixel( int i, int j, const vec3f& col )
+{
+	toBytes( this->buffer + ( i + j * buffer_width ) * 3, col );
+}
+
+// Traces the pixels [x0, x1) x [y0, y1), no more than PACKET_SIZE of them.
+// When every pixel is one ray through its corner, those rays are
+// intersected as one packet, and so are the shadow rays from their hits to
+// each light; the colors come out the same as from tracePixel.  Anything
+// else goes pixel by pixel.
+void RayTracer::tracePacket( int x0, int y0, int x1, int y1, RenderTile* tile )
+{
+	if( !scene )
+		return;
+
+	auto store = [this, tile]( int i, int j, const vec3f& col ) {
+		if( tile )
+			toBytes( &tile->pixels[ ((i - tile->x0) + (j - tile->y0) * tile->width()) * 3 ], col );
+		else
+			setPixel( i, j, col );
+	};
+
+	int count = (x1 - x0) * (y1 - y0);
+	if (count > PACKET_SIZE || settings.antialiasing || settings.jittering ||
+		settings.depthOfField || scene->getMotionBlur()) {
+		for( int j = y0; j < y1; ++j )
+			for( int i = x0; i < x1; ++i )
+				store( i, j, pixelColor( i, j ) );
+		return;
+	}
+
+	ray r[ PACKET_SIZE ];
+	isect hits[ PACKET_SIZE ];
+	bool found[ PACKET_SIZE ];
+
+	int k = 0;
+	for( int j = y0; j < y1; ++j )
+		for( int i = x0; i < x1; ++i )
+			scene->getCamera()->rayThrough( double(i) / double(buffer_width),
+				double(j) / double(buffer_height), r[k++] );
+	RayStats::forThread().primaryRays += count;
+	scene->intersectPacket( r, count, hits, found );
+
+	// Material::shade traces the shadow rays itself for soft shadows, when
+	// it may skip some of them, and for lights that need the sampler of
+	// the pixel
+	int numLights = std::distance( scene->beginLights(), scene->endLights() );
+	bool packetShadows = !scene->getSoftShadow() && scene->accShadowAttenThresh <= 0.0 &&
+		numLights > 0;
+	for( Scene::cliter j = scene->beginLights(); j != scene->endLights(); ++j )
+		if( (*j)->sampled() )
+			packetShadows = false;
+	// kept from packet to packet, so it is only allocated once per thread
+	static thread_local std::vector<vec3f> shadows;
+	if (packetShadows) {
+		shadows.resize( count * numLights );
+		vec3f P[ PACKET_SIZE ];
+		vec3f atten[ PACKET_SIZE ];
+		int which[ PACKET_SIZE ];
+		int n = 0;
+		for( k = 0; k < count; ++k )
+			if( found[k] ) {
+				P[n] = r[k].at( hits[k].t );
+				which[n++] = k;
+			}
+
+		int l = 0;
+		for( Scene::cliter j = scene->beginLights(); j != scene->endLights(); ++j, ++l ) {
+			(*j)->shadowAttenuation( P, n, atten );
+			for( int m = 0; m < n; ++m )
+				shadows[ which[m] * numLights + l ] = atten[m];
+		}
+	}
+
+	double t = scene->getTerimnationThreshold();
+	vec3f thresh( t, t, t );
+	Sampler& sampler = Sampler::forThread();
+
+	k = 0;
+	for( int j = y0; j < y1; ++j ) {
+		for( int i = x0; i < x1; ++i, ++k ) {
+			// the same sample numbers as tracePixel and trace use
+			sampler.beginPixel( i, j, frameIndex );
+			sampler.nextSample();
+
+			vec3f col;
+			if( found[k] ) {
+				MediumStack media;
+				col = shadeHit( scene, r[k], hits[k], thresh, 0, 1.0, media,
+					packetShadows ? &shadows[ k * numLights ] : NULL );
+			} else {
+				col = missColor( scene, r[k] );
+			}
+			store( i, j, col.clamp() );
+		}
+	}
 }
\ No newline at end of file
@@ -5,9 +5,29 @@
 
 #include "scene/scene.h"
 #include "scene/ray.h"
-#include "ui\TraceUI.h"
-#include <stack>
-class TraceUI;
+#include "scene/medium.h"
+#include "RenderSettings.h"
+#include <vector>
+#include <string>
+#include <istream>
+#include <functional>
+class ThreadPool;
+class SampleCache;
+
+// A rectangle of the frame with pixels of its own, so that any number of
+// them can be traced apart, in any order and on any machine, and be put
+// together afterwards with RayTracer::mergeTile.
+struct RenderTile
+{
+	RenderTile() : x0( 0 ), y0( 0 ), x1( 0 ), y1( 0 ) {}
+	RenderTile( int x0, int y0, int x1, int y1 ) : x0( x0 ), y0( y0 ), x1( x1 ), y1( y1 ) {}
+
+	int width() const { return x1 - x0; }
+	int height() const { return y1 - y0; }
+
+	int x0, y0, x1, y1;					// the pixels [x0, x1) x [y0, y1) of the frame
+	std::vector<unsigned char> pixels;	// 3 bytes a pixel, row y0 first, as in the frame buffer
+};
 
 class RayTracer
 {
@@ -17,25 +37,71 @@ public:
 
     vec3f trace( Scene *scene, double x, double y );
 	vec3f traceRay( Scene *scene, const ray& r, const vec3f& thresh, int depth,
-		double currIndex,std::stack<isect> isectStack);
+		double currIndex, MediumStack& media);
+	vec3f shadeHit( Scene *scene, const ray& r, const isect& i, const vec3f& thresh, int depth,
+		double currIndex, MediumStack& media, const vec3f* shadows = NULL );
+	vec3f missColor( Scene *scene, const ray& r );
 
 
 	void getBuffer( unsigned char *&buf, int &w, int &h );
 	double aspectRatio();
 	void traceSetup( int w, int h );
 	void traceLines( int start = 0, int stop = 10000000 );
-	vec3f getAdaptivelySupersampledColor(Scene * scene, double x, double y, int depth);
+	void traceTiles( int start = 0, int stop = 10000000 );
 	void tracePixel( int i, int j );
+	// tile, when given, gets the pixels instead of the frame buffer
+	void tracePacket( int x0, int y0, int x1, int y1, RenderTile* tile = NULL );
+
+	// Bucket rendering, at the resolution of the last traceSetup.
+	// traceRegion traces the pixels of tile, cut to the frame, into
+	// tile.pixels on all threads, and leaves the frame buffer alone.  A
+	// pixel's color only depends on the pixel, the frame and the
+	// settings, so the tiles come out the same wherever and in whatever
+	// order they are traced, and mergeTile, which copies one into the frame
+	// buffer, puts together the same image as traceTiles whatever order the
+	// tiles arrive in.  makeBuckets cuts the frame into size x size tiles,
+	// row by row from the bottom.
+	void traceRegion( RenderTile& tile );
+	void mergeTile( const RenderTile& tile );
+	void makeBuckets( int size, std::vector<RenderTile>& buckets );
+
+	// Progressive rendering, for a picture that gets better for as long as
+	// one cares to wait.  Call beginProgressive after traceSetup.  Every
+	// pass then traces the rows [start, stop) with one cheap sample per
+	// pixel, adds it into a float buffer and shows the average so far; the
+	// very first pass is a blocky preview instead.  endPass finishes a pass
+	// once all its rows are done.
+	void beginProgressive();
+	void tracePass( int start = 0, int stop = 10000000 );
+	void endPass();
+	int getPasses();	// finished passes, the preview included
+	// True once more passes can't change the picture, because nothing in
+	// it is sampled at random.
+	bool progressiveDone();
 
 	bool loadScene( char* fn );
+	// Same, from the text of a scene file, e.g. one sent over the network
+	bool loadScene( std::istream& is );
+	// Load scenes through the scene cache in dir from now on (see
+	// fileio/scenecache.h); an empty dir turns the cache off, as it is at
+	// first.
+	void setCacheDir( const std::string& dir );
 
 	bool sceneLoaded();
 	Scene* getScene();
 	void setBackgroundImg(unsigned char* img);
 	void setDepthLimit(int depthLim);
+	void setThreads(int n);
+	int getThreads();
+	void setFrame(int frame);	// seeds the samplers, so successive frames get different noise
+	int getFrame();
 
 	vec3f getBackgroundColor(double x, double y);
-	void setUI(TraceUI* ui);
+
+	// Takes effect on the next trace.  The scene options are copied into
+	// the current scene and into every scene loaded later.
+	void setSettings(const RenderSettings& s);
+	const RenderSettings& getSettings();
 private:
 	unsigned char *buffer;
 	int buffer_width, buffer_height;
@@ -46,9 +112,52 @@ private:
 
 	bool m_bSceneLoaded;
 
-	const int adaSupLimit = 6;
+	// Adaptive supersampling traces points of a lattice with
+	// 2^settings.adaptiveDepth steps to a pixel side, and keeps what it
+	// traced in a cache per thread.  Every change that could change the
+	// color at a lattice point moves sampleEpoch on, which empties the caches.
+	static const int MAX_ADAPTIVE_DEPTH = 10;
+	unsigned sampleEpoch;
+	void newSampleEpoch();
+	vec3f latticeSample( SampleCache& cache, int x, int y );
+	vec3f getAdaptivelySupersampledColor( SampleCache& cache, int x, int y, int size );
+	bool contrasts( const vec3f& a, const vec3f& b ) const;
+
+	// traceTiles splits the image into TILE_SIZE x TILE_SIZE tiles and
+	// hands them to the pool
+	static const int TILE_SIZE = 16;
+	// pixels are traced in PACKET_WIDTH x PACKET_WIDTH packets where they can be
+	static const int PACKET_WIDTH = 4;
+	int numThreads;		// 0 means one per core
+	std::string cacheDir;	// empty for no scene cache
+	ThreadPool* pool;
+	// NULL if there is only the one thread, else the pool, started on
+	// first use; it also loads and sets up scenes
+	ThreadPool* getPool();
+	int frameIndex;
+
+	// rays per pixel for depth of field and motion blur, and per hit for
+	// glossy reflection
+	static const int EFFECT_SAMPLES = 100;
+	int effectSamples;
+
+	// progressive rendering: the preview traces one pixel per
+	// COARSE_SIZE x COARSE_SIZE block, a later pass PASS_SAMPLES effect rays
+	static const int COARSE_SIZE = 8;
+	static const int PASS_SAMPLES = 4;
+	std::vector<float> accum;	// sum of the pass samples, 3 floats per pixel
+	int pass;					// the pass being traced
+
+	RenderSettings settings;
 
-	TraceUI* m_pUI;
+	bool sceneReady();		// sets up the scene just read
+	void setPixel( int i, int j, const vec3f& col );
+	vec3f pixelColor( int i, int j );
+	vec3f passSample( int i, int j );
+	// f( x0, y0, x1, y1 ) for every tile of the rows [start, stop), or of
+	// the rectangle [x0, x1) x [y0, y1), on all threads when that's safe
+	void forEachTile( int start, int stop, const std::function<void( int, int, int, int )>& f );
+	void forEachTile( int x0, int y0, int x1, int y1, const std::function<void( int, int, int, int )>& f );
 };
 
 #endif // __RAYTRACER_H__
@@ -0,0 +1,652 @@
+#include "RenderFarm.h"
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#include <process.h>
+#pragma comment( lib, "ws2_32.lib" )
+typedef SOCKET socket_t;
+#define closeSocket closesocket
+#define pollSockets WSAPoll
+#else
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <poll.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <signal.h>
+#include <spawn.h>
+typedef int socket_t;
+#define INVALID_SOCKET (-1)
+#define closeSocket close
+#define pollSockets poll
+extern char** environ;
+#endif
+
+#include <stdio.h>
+#include <string.h>
+#include <algorithm>
+#include <chrono>
+#include <sstream>
+
+#include "scene/sampler.h"
+
+// The protocol: every message is its type and the length of what follows,
+// then that many bytes; all numbers are 32 bits, most significant byte
+// first.  A worker starts with HELLO, the coordinator answers with JOB and
+// then sends BUCKET after BUCKET, each answered with a PIXELS, until DONE.
+enum MessageType
+{
+	MSG_HELLO = 1,		// protocol version, bytes per vreal
+	MSG_JOB,			// width, height, frame, sample pattern, settings, scene
+	MSG_BUCKET,			// x0, y0, x1, y1
+	MSG_PIXELS,			// x0, y0, x1, y1, the pixels of the bucket
+	MSG_DONE
+};
+
+static const uint32_t PROTOCOL_VERSION = 1;
+static const uint32_t MAX_MESSAGE = 1u << 30;
+
+// std::chrono::seconds takes these by reference
+const int RenderCoordinator::WORKER_WAIT;
+const int RenderCoordinator::HELLO_WAIT;
+const int RenderCoordinator::BUCKET_WAIT;
+const int RenderCoordinator::MAX_CONNECTIONS;
+
+static void putU32( std::string& msg, uint32_t v )
+{
+	msg += (char)(v >> 24);
+	msg += (char)(v >> 16);
+	msg += (char)(v >> 8);
+	msg += (char)v;
+}
+
+static void putString( std::string& msg, const std::string& s )
+{
+	putU32( msg, (uint32_t)s.size() );
+	msg += s;
+}
+
+// Reads the message body msg from position at on, false past its end.
+static bool getU32( const std::string& msg, size_t& at, uint32_t& v )
+{
+	if( at + 4 > msg.size() )
+		return false;
+	const unsigned char* p = (const unsigned char*)msg.data() + at;
+	v = ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3];
+	at += 4;
+	return true;
+}
+
+static bool getString( const std::string& msg, size_t& at, std::string& s )
+{
+	uint32_t n;
+	if( !getU32( msg, at, n ) || at + n > msg.size() )
+		return false;
+	s.assign( msg, at, n );
+	at += n;
+	return true;
+}
+
+static std::string message( uint32_t type, const std::string& body )
+{
+	std::string msg;
+	putU32( msg, type );
+	putString( msg, body );
+	return msg;
+}
+
+static bool sendAll( socket_t s, const std::string& data )
+{
+	size_t sent = 0;
+	while( sent < data.size() ) {
+		int n = send( s, data.data() + sent, (int)std::min( data.size() - sent, (size_t)1 << 20 ), 0 );
+		if( n <= 0 )
+			return false;
+		sent += n;
+	}
+	return true;
+}
+
+static bool recvAll( socket_t s, char* data, size_t size )
+{
+	size_t got = 0;
+	while( got < size ) {
+		int n = recv( s, data + got, (int)std::min( size - got, (size_t)1 << 20 ), 0 );
+		if( n <= 0 )
+			return false;
+		got += n;
+	}
+	return true;
+}
+
+static bool recvMessage( socket_t s, uint32_t& type, std::string& body )
+{
+	std::string head( 8, '\0' );
+	size_t at = 0;
+	uint32_t size;
+	if( !recvAll( s, &head[0], 8 ) || !getU32( head, at, type ) || !getU32( head, at, size ) ||
+		size > MAX_MESSAGE )
+		return false;
+	body.resize( size );
+	return size == 0 || recvAll( s, &body[0], size );
+}
+
+static bool startNetwork()
+{
+#ifdef _WIN32
+	static bool started = false;
+	if( !started ) {
+		WSADATA data;
+		if( WSAStartup( MAKEWORD( 2, 2 ), &data ) != 0 )
+			return false;
+		started = true;
+	}
+#else
+	// a worker that goes away shows up as a failed send, not a signal
+	signal( SIGPIPE, SIG_IGN );
+#endif
+	return true;
+}
+
+// Buckets are small, and waiting to fill a packet only slows the round trip.
+static void noDelay( socket_t s )
+{
+	int on = 1;
+	setsockopt( s, IPPROTO_TCP, TCP_NODELAY, (const char*)&on, sizeof( on ) );
+}
+
+static bool noBlocking( socket_t s )
+{
+#ifdef _WIN32
+	u_long on = 1;
+	return ioctlsocket( s, FIONBIO, &on ) == 0;
+#else
+	int flags = fcntl( s, F_GETFL, 0 );
+	return flags != -1 && fcntl( s, F_SETFL, flags | O_NONBLOCK ) == 0;
+#endif
+}
+
+// Whether a send or recv on a socket that doesn't block failed only
+// because it would have had to wait.
+static bool wouldBlock()
+{
+#ifdef _WIN32
+	return WSAGetLastError() == WSAEWOULDBLOCK;
+#else
+	return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+#endif
+}
+
+RenderCoordinator::RenderCoordinator( RayTracer* tracer, const std::string& sceneText )
+	: tracer( tracer ), listener( (intptr_t)INVALID_SOCKET ), port( 0 ), remaining( 0 ),
+	slowest( 0 )
+{
+	unsigned char* buf;
+	int w, h;
+	tracer->getBuffer( buf, w, h );
+
+	std::string body;
+	putU32( body, w );
+	putU32( body, h );
+	putU32( body, tracer->getFrame() );
+	putU32( body, Sampler::getPattern() );
+	putString( body, tracer->getSettings().toString() );
+	putString( body, sceneText );
+	job = message( MSG_JOB, body );
+}
+
+RenderCoordinator::~RenderCoordinator()
+{
+	for( size_t k = 0; k < workers.size(); ++k )
+		closeSocket( (socket_t)workers[k].sock );
+	if( listener != (intptr_t)INVALID_SOCKET )
+		closeSocket( (socket_t)listener );
+
+	for( size_t k = 0; k < children.size(); ++k ) {
+#ifdef _WIN32
+		int status;
+		_cwait( &status, children[k], _WAIT_CHILD );
+#else
+		waitpid( (pid_t)children[k], NULL, 0 );
+#endif
+	}
+}
+
+bool RenderCoordinator::listen( int p, bool anywhere )
+{
+	if( !startNetwork() )
+		return false;
+
+	socket_t s = socket( AF_INET, SOCK_STREAM, 0 );
+	if( s == INVALID_SOCKET )
+		return false;
+
+	int on = 1;
+	setsockopt( s, SOL_SOCKET, SO_REUSEADDR, (const char*)&on, sizeof( on ) );
+
+	sockaddr_in addr;
+	memset( &addr, 0, sizeof( addr ) );
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl( anywhere ? INADDR_ANY : INADDR_LOOPBACK );
+	addr.sin_port = htons( (unsigned short)p );
+	socklen_t len = sizeof( addr );
+	if( bind( s, (sockaddr*)&addr, sizeof( addr ) ) != 0 || ::listen( s, SOMAXCONN ) != 0 ||
+		getsockname( s, (sockaddr*)&addr, &len ) != 0 || !noBlocking( s ) ) {
+		closeSocket( s );
+		return false;
+	}
+
+	listener = (intptr_t)s;
+	port = ntohs( addr.sin_port );
+	return true;
+}
+
+bool RenderCoordinator::spawnWorkers( const char* program, int count, int threads )
+{
+	char address[ 32 ], threadArg[ 16 ];
+	snprintf( address, sizeof( address ), "127.0.0.1:%d", port );
+	snprintf( threadArg, sizeof( threadArg ), "%d", threads );
+
+	for( int k = 0; k < count; ++k ) {
+#ifdef _WIN32
+		intptr_t child = _spawnl( _P_NOWAIT, program, program, "-C", address, "-n", threadArg, NULL );
+		if( child == -1 )
+			return false;
+		children.push_back( child );
+#else
+		char* argv[] = { (char*)program, (char*)"-C", address, (char*)"-n", threadArg, NULL };
+		pid_t child;
+		if( posix_spawnp( &child, program, NULL, NULL, argv, environ ) != 0 )
+			return false;
+		children.push_back( child );
+#endif
+	}
+	return true;
+}
+
+void RenderCoordinator::render( int bucketSize )
+{
+	tracer->makeBuckets( bucketSize, buckets );
+	done.assign( buckets.size(), false );
+	holders.assign( buckets.size(), 0 );
+	todo.clear();
+	for( size_t k = 0; k < buckets.size(); ++k )
+		todo.push_back( (int)k );
+	remaining = (int)buckets.size();
+
+	wallclock::time_point lastWorker = wallclock::now();
+
+	while( remaining > 0 ) {
+		wallclock::time_point now = wallclock::now();
+		for( size_t k = 0; k < workers.size(); ++k ) {
+			if( overdue( workers[k], now ) ) {
+				fprintf( stderr, "worker %s is too slow\n", workers[k].name.c_str() );
+				drop( workers[k] );
+			} else if( workers[k].ready && workers[k].bucket < 0 ) {
+				handOut( workers[k] );
+			}
+		}
+		// drop() leaves closed connections behind, to keep the indices
+		// above stable
+		for( size_t k = 0; k < workers.size(); )
+			if( workers[k].sock == (intptr_t)INVALID_SOCKET )
+				workers.erase( workers.begin() + k );
+			else
+				++k;
+
+		// only a worker that got the job counts; a connection that hasn't
+		// said hello yet may never do so
+		bool working = false;
+		for( size_t k = 0; k < workers.size(); ++k )
+			working = working || workers[k].ready;
+		if( working )
+			lastWorker = now;
+		else if( now - lastWorker > std::chrono::seconds( WORKER_WAIT ) ) {
+			fprintf( stderr, "no workers, tracing the last %d buckets here\n", remaining );
+			for( size_t k = 0; k < buckets.size(); ++k ) {
+				if( done[k] )
+					continue;
+				tracer->traceRegion( buckets[k] );
+				tracer->mergeTile( buckets[k] );
+				done[k] = true;
+			}
+			remaining = 0;
+			break;
+		}
+
+		// poll rather than select, which can't take a socket numbered
+		// FD_SETSIZE or more; entry k + 1 is workers[k]
+		std::vector<pollfd> polled( workers.size() + 1 );
+		polled[0].fd = (socket_t)listener;
+		polled[0].events = POLLIN;
+		for( size_t k = 0; k < workers.size(); ++k ) {
+			polled[k + 1].fd = (socket_t)workers[k].sock;
+			polled[k + 1].events = (short)(POLLIN | (workers[k].out.empty() ? 0 : POLLOUT));
+		}
+
+		// wake up at least once a second to check on the time
+		if( pollSockets( &polled[0], (unsigned long)polled.size(), 1000 ) <= 0 )
+			continue;
+
+		// a closed or failed socket reads as the end of the connection
+		for( size_t k = 0; k + 1 < polled.size(); ++k ) {
+			short events = polled[k + 1].revents;
+			if( workers[k].sock != (intptr_t)INVALID_SOCKET && (events & POLLOUT) )
+				flush( workers[k] );
+			if( workers[k].sock != (intptr_t)INVALID_SOCKET && (events & (POLLIN | POLLHUP | POLLERR)) )
+				receive( workers[k] );
+		}
+		// everything waiting, so a burst of connections doesn't fill the
+		// backlog and hold up a worker behind it
+		if( polled[0].revents & POLLIN )
+			while( accept() )
+				;
+	}
+
+	// as much of the goodbye as goes out right away; a worker that misses
+	// it sees the connection close instead
+	std::string bye = message( MSG_DONE, "" );
+	for( size_t k = 0; k < workers.size(); ++k ) {
+		if( workers[k].sock == (intptr_t)INVALID_SOCKET )
+			continue;
+		if( workers[k].ready )
+			send( workers[k], bye );
+		if( workers[k].sock != (intptr_t)INVALID_SOCKET )
+			closeSocket( (socket_t)workers[k].sock );
+	}
+	workers.clear();
+}
+
+// False if there was no connection waiting.
+bool RenderCoordinator::accept()
+{
+	sockaddr_in addr;
+	socklen_t len = sizeof( addr );
+	socket_t s = ::accept( (socket_t)listener, (sockaddr*)&addr, &len );
+	if( s == INVALID_SOCKET )
+		return false;
+	// more than any farm needs; the rest wait for HELLO_WAIT to clear them
+	if( workers.size() >= (size_t)MAX_CONNECTIONS || !noBlocking( s ) ) {
+		closeSocket( s );
+		return true;
+	}
+	noDelay( s );
+
+	char name[ 64 ];
+	snprintf( name, sizeof( name ), "%s:%d", inet_ntoa( addr.sin_addr ), ntohs( addr.sin_port ) );
+
+	Connection c;
+	c.sock = (intptr_t)s;
+	c.ready = false;
+	c.bucket = -1;
+	c.since = wallclock::now();
+	c.name = name;
+	workers.push_back( c );
+	return true;
+}
+
+// Takes what the socket has, and handles every message that is complete.
+void RenderCoordinator::receive( Connection& c )
+{
+	char data[ 1 << 16 ];
+	int n = recv( (socket_t)c.sock, data, sizeof( data ), 0 );
+	if( n == 0 || (n < 0 && !wouldBlock()) ) {
+		drop( c );
+		return;
+	}
+	if( n > 0 )
+		c.in.append( data, n );
+
+	size_t at = 0;
+	while( c.sock != (intptr_t)INVALID_SOCKET ) {
+		size_t start = at;
+		uint32_t type, size;
+		if( !getU32( c.in, at, type ) || !getU32( c.in, at, size ) ) {
+			at = start;
+			break;
+		}
+		// nothing but a hello before the job, and nothing but the pixels
+		// of its bucket after it, so no one can make us keep much
+		size_t most = 0;
+		if( !c.ready )
+			most = 64;
+		else if( c.bucket >= 0 )
+			most = 16 + (size_t)buckets[ c.bucket ].width() * buckets[ c.bucket ].height() * 3;
+		if( size > most ) {
+			drop( c );
+			return;
+		}
+		if( c.in.size() - at < size ) {
+			at = start;
+			break;
+		}
+		std::string body( c.in, at, size );
+		at += size;
+		handle( c, type, body );
+	}
+	if( c.sock != (intptr_t)INVALID_SOCKET )
+		c.in.erase( 0, at );
+}
+
+void RenderCoordinator::handle( Connection& c, uint32_t type, const std::string& body )
+{
+	size_t at = 0;
+	if( type == MSG_HELLO && !c.ready ) {
+		// the other end has to compute every pixel the same way we would
+		uint32_t version, real;
+		if( !getU32( body, at, version ) || !getU32( body, at, real ) ||
+			version != PROTOCOL_VERSION || real != sizeof( vreal ) ) {
+			fprintf( stderr, "worker %s doesn't match this program\n", c.name.c_str() );
+			drop( c );
+			return;
+		}
+		c.ready = true;
+		fprintf( stderr, "worker %s joined\n", c.name.c_str() );
+		send( c, job );
+	} else if( type == MSG_PIXELS && c.bucket >= 0 ) {
+		RenderTile& b = buckets[ c.bucket ];
+		uint32_t x0, y0, x1, y1;
+		if( !getU32( body, at, x0 ) || !getU32( body, at, y0 ) || !getU32( body, at, x1 ) ||
+			!getU32( body, at, y1 ) || (int)x0 != b.x0 || (int)y0 != b.y0 || (int)x1 != b.x1 ||
+			(int)y1 != b.y1 || body.size() - at != (size_t)(b.width() * b.height() * 3) ) {
+			drop( c );
+			return;
+		}
+		slowest = std::max( slowest, wallclock::now() - c.since );
+		if( !done[ c.bucket ] ) {
+			b.pixels.assign( body.begin() + at, body.end() );
+			tracer->mergeTile( b );
+			std::vector<unsigned char>().swap( b.pixels );
+			done[ c.bucket ] = true;
+			--remaining;
+		}
+		--holders[ c.bucket ];
+		c.bucket = -1;
+	} else {
+		drop( c );
+	}
+}
+
+// Queues msg for c, and sends what the socket takes of it right away.
+void RenderCoordinator::send( Connection& c, const std::string& msg )
+{
+	c.out += msg;
+	flush( c );
+}
+
+void RenderCoordinator::flush( Connection& c )
+{
+	size_t sent = 0;
+	while( sent < c.out.size() ) {
+		int n = ::send( (socket_t)c.sock, c.out.data() + sent,
+			(int)std::min( c.out.size() - sent, (size_t)1 << 20 ), 0 );
+		if( n < 0 && wouldBlock() )
+			break;
+		if( n <= 0 ) {
+			drop( c );
+			return;
+		}
+		sent += n;
+	}
+	c.out.erase( 0, sent );
+}
+
+// Whether c has kept us waiting too long for its hello or its bucket.
+bool RenderCoordinator::overdue( const Connection& c, wallclock::time_point now ) const
+{
+	if( c.sock == (intptr_t)INVALID_SOCKET )
+		return false;
+	if( !c.ready )
+		return now - c.since > std::chrono::seconds( HELLO_WAIT );
+	if( c.bucket >= 0 )
+		return now - c.since > std::max<wallclock::duration>( std::chrono::seconds( BUCKET_WAIT ), 4 * slowest );
+	return false;
+}
+
+// Forget a worker that went away or misbehaved; whatever it was tracing
+// goes back to the front of the line.
+void RenderCoordinator::drop( Connection& c )
+{
+	if( c.ready )
+		fprintf( stderr, "worker %s left\n", c.name.c_str() );
+	if( c.bucket >= 0 ) {
+		if( --holders[ c.bucket ] == 0 && !done[ c.bucket ] )
+			todo.push_front( c.bucket );
+		c.bucket = -1;
+	}
+	closeSocket( (socket_t)c.sock );
+	c.sock = (intptr_t)INVALID_SOCKET;
+	c.ready = false;
+	c.in.clear();
+	c.out.clear();
+}
+
+void RenderCoordinator::handOut( Connection& c )
+{
+	int next = -1;
+	while( !todo.empty() && next < 0 ) {
+		if( !done[ todo.front() ] && holders[ todo.front() ] == 0 )
+			next = todo.front();
+		todo.pop_front();
+	}
+	// nothing new: help with a bucket only one worker has, in case that
+	// one is slow or stuck
+	for( size_t k = 0; k < buckets.size() && next < 0; ++k )
+		if( !done[k] && holders[k] == 1 )
+			next = (int)k;
+	if( next < 0 )
+		return;
+
+	const RenderTile& b = buckets[ next ];
+	std::string body;
+	putU32( body, b.x0 );
+	putU32( body, b.y0 );
+	putU32( body, b.x1 );
+	putU32( body, b.y1 );
+	c.bucket = next;
+	c.since = wallclock::now();
+	++holders[ next ];
+	send( c, message( MSG_BUCKET, body ) );
+}
+
+bool runRenderWorker( const char* host, int port, int threads )
+{
+	if( !startNetwork() )
+		return false;
+
+	char service[ 16 ];
+	snprintf( service, sizeof( service ), "%d", port );
+	addrinfo hints, *found;
+	memset( &hints, 0, sizeof( hints ) );
+	hints.ai_family = AF_INET;
+	hints.ai_socktype = SOCK_STREAM;
+	if( getaddrinfo( host, service, &hints, &found ) != 0 ) {
+		fprintf( stderr, "can't find %s\n", host );
+		return false;
+	}
+
+	socket_t s = socket( found->ai_family, found->ai_socktype, found->ai_protocol );
+	bool connected = s != INVALID_SOCKET && connect( s, found->ai_addr, (int)found->ai_addrlen ) == 0;
+	freeaddrinfo( found );
+	if( !connected ) {
+		fprintf( stderr, "can't connect to %s:%d\n", host, port );
+		if( s != INVALID_SOCKET )
+			closeSocket( s );
+		return false;
+	}
+	noDelay( s );
+
+	std::string hello;
+	putU32( hello, PROTOCOL_VERSION );
+	putU32( hello, sizeof( vreal ) );
+
+	uint32_t type;
+	std::string body;
+	size_t at = 0;
+	uint32_t width, height, frame, pattern;
+	std::string options, sceneText;
+	if( !sendAll( s, message( MSG_HELLO, hello ) ) || !recvMessage( s, type, body ) ||
+		type != MSG_JOB || !getU32( body, at, width ) || !getU32( body, at, height ) ||
+		!getU32( body, at, frame ) || !getU32( body, at, pattern ) ||
+		!getString( body, at, options ) || !getString( body, at, sceneText ) ) {
+		fprintf( stderr, "no job from %s:%d\n", host, port );
+		closeSocket( s );
+		return false;
+	}
+
+	RenderSettings settings;
+	std::istringstream opts( options );
+	std::string opt;
+	while( opts >> opt )
+		settings.parse( opt.c_str() );
+	Sampler::setPattern( (SamplePattern)pattern );
+
+	RayTracer tracer;
+	tracer.setThreads( threads );
+	tracer.setSettings( settings );
+	std::istringstream sceneStream( sceneText );
+	if( !tracer.loadScene( sceneStream ) ) {
+		closeSocket( s );
+		return false;
+	}
+	tracer.setFrame( (int)frame );
+	tracer.traceSetup( (int)width, (int)height );
+
+	bool ok = false;
+	while( recvMessage( s, type, body ) ) {
+		if( type == MSG_DONE ) {
+			ok = true;
+			break;
+		}
+
+		at = 0;
+		uint32_t x0, y0, x1, y1;
+		if( type != MSG_BUCKET || !getU32( body, at, x0 ) || !getU32( body, at, y0 ) ||
+			!getU32( body, at, x1 ) || !getU32( body, at, y1 ) )
+			break;
+
+		RenderTile bucket( (int)x0, (int)y0, (int)x1, (int)y1 );
+		tracer.traceRegion( bucket );
+
+		std::string pixels;
+		putU32( pixels, bucket.x0 );
+		putU32( pixels, bucket.y0 );
+		putU32( pixels, bucket.x1 );
+		putU32( pixels, bucket.y1 );
+		pixels.append( bucket.pixels.begin(), bucket.pixels.end() );
+		if( !sendAll( s, message( MSG_PIXELS, pixels ) ) )
+			break;
+	}
+
+	closeSocket( s );
+	return ok;
+}
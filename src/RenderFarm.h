@@ -0,0 +1,109 @@
+#ifndef __RENDERFARM_H__
+#define __RENDERFARM_H__
+
+// Rendering one frame with several processes, on one machine or over a LAN.
+// The coordinator loads the scene, listens on a TCP port and hands out
+// buckets of the frame (see RayTracer::traceRegion).  A worker is the same
+// program started with -C host:port; it connects, gets the text of the
+// scene and the render settings from the coordinator, and sends back the
+// pixels of every bucket it is given.  There is no password: whoever can
+// reach the port gets the scene and can send pixels, so the coordinator
+// only listens beyond this machine when asked to.
+//
+// A bucket comes out the same whichever process traces it, so the
+// coordinator can be careless about who does what: the buckets of a worker
+// that goes away are handed out again, and once there is nothing new to
+// hand out, idle workers get a second copy of a bucket still being traced,
+// so one slow or hung worker can't hold up the frame.  The first copy back
+// is the one that counts.  A connection that doesn't say hello in time, or
+// sits on a bucket far longer than buckets take, is dropped, so neither can
+// keep the coordinator from tracing the frame itself once it has no
+// workers left.
+
+#include <string>
+#include <vector>
+#include <deque>
+#include <chrono>
+#include <stdint.h>
+
+#include "RayTracer.h"
+
+class RenderCoordinator
+{
+public:
+	// tracer has the scene loaded from sceneText, and is set up with the
+	// settings, frame and size to render
+	RenderCoordinator( RayTracer* tracer, const std::string& sceneText );
+	~RenderCoordinator();
+
+	// Listen on port, 0 for any free one, on every interface if anywhere is
+	// set and otherwise for workers on this machine only.  getPort tells
+	// which port it got.
+	bool listen( int port, bool anywhere = false );
+	int getPort() const { return port; }
+
+	// Start count workers on this machine, as program -C 127.0.0.1:port
+	// -n threads.  They are waited for in the destructor.
+	bool spawnWorkers( const char* program, int count, int threads );
+
+	// Trace the frame into the tracer's buffer, in bucketSize x bucketSize
+	// buckets, and tell the workers to quit.  If no worker has been
+	// connected for WORKER_WAIT seconds, the coordinator traces what is
+	// left itself, so a frame always gets finished.
+	void render( int bucketSize );
+
+	static const int WORKER_WAIT = 30;
+	// seconds a new connection has to say hello in
+	static const int HELLO_WAIT = 10;
+	// seconds a worker has to send a bucket back in, or 4 times as long as
+	// the slowest bucket so far took, whichever is longer
+	static const int BUCKET_WAIT = 120;
+	// connections at once, workers or not; more are closed right away
+	static const int MAX_CONNECTIONS = 256;
+
+private:
+	typedef std::chrono::steady_clock wallclock;
+
+	// The sockets don't block: what comes in is kept until it makes a whole
+	// message, and what can't go out yet waits for the socket to take it.
+	struct Connection
+	{
+		intptr_t	sock;
+		bool		ready;		// said hello and got the job
+		int			bucket;		// the bucket it is tracing, or -1
+		wallclock::time_point since;	// when it connected, or got its bucket
+		std::string	in;			// the start of the next message
+		std::string	out;		// what is still to be sent
+		std::string	name;		// its address, for the log
+	};
+
+	bool accept();
+	void receive( Connection& c );
+	void handle( Connection& c, uint32_t type, const std::string& body );
+	void send( Connection& c, const std::string& msg );
+	void flush( Connection& c );
+	bool overdue( const Connection& c, wallclock::time_point now ) const;
+	void drop( Connection& c );
+	void handOut( Connection& c );
+
+	RayTracer* tracer;
+	std::string job;			// the job message every worker gets on hello
+	intptr_t listener;
+	int port;
+	std::vector<intptr_t> children;
+
+	std::vector<Connection> workers;
+	std::vector<RenderTile> buckets;
+	std::vector<bool> done;
+	std::vector<int> holders;	// workers tracing each bucket
+	std::deque<int> todo;		// buckets nobody is tracing, to hand out first
+	int remaining;
+	wallclock::duration slowest;	// the longest a bucket took to come back
+};
+
+// Connect to the coordinator at host:port and trace buckets for it on
+// threads threads until it is done.  Returns false if it couldn't connect
+// or the coordinator went away in the middle.
+bool runRenderWorker( const char* host, int port, int threads );
+
+#endif // __RENDERFARM_H__
@@ -0,0 +1,180 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "RenderSettings.h"
+#include "scene/scene.h"
+
+RenderSettings::RenderSettings()
+{
+	depth = 0;
+	background = false;
+	antialiasing = false;
+	numSubpixels = 2;
+	jittering = false;
+	adaptiveSupersampling = false;
+	adaptiveDepth = 6;
+	adaptiveMetric = ADAPTIVE_DISTANCE;
+	adaptiveThreshold = 0.01;
+	depthOfField = false;
+	focalLength = 1.0;
+	aperture = 1.0;
+	softShadow = false;
+	softShadowCoeff = 0.9;
+	glossyReflection = false;
+	motionBlur = false;
+	textureMapping = false;
+	bumpMapping = false;
+	constAttenFactor = 1.0;
+	linearAttenFactor = 1.0;
+	quadAttenFactor = 1.0;
+	terminationThreshold = 0.0;
+	ambientLight = 1.0;
+	accShadowAttenThresh = 0.0;
+}
+
+// The table behind set() and printOptions().  Exactly one of the pointers
+// is filled in for every entry.
+struct SettingsOption
+{
+	const char*	name;
+	bool*		b;
+	int*		i;
+	double*		d;
+	const char*	help;
+};
+
+static int settingsOptions( RenderSettings& s, SettingsOption* opts )
+{
+	SettingsOption table[] = {
+		{ "depth",			NULL, &s.depth, NULL,					"recursion depth" },
+		{ "background",		&s.background, NULL, NULL,				"use the background image (0/1)" },
+		{ "aa",				&s.antialiasing, NULL, NULL,			"antialiasing (0/1)" },
+		{ "subpixels",		NULL, &s.numSubpixels, NULL,			"subpixels per side" },
+		{ "jitter",			&s.jittering, NULL, NULL,				"jittered sampling (0/1)" },
+		{ "adaptive",		&s.adaptiveSupersampling, NULL, NULL,	"adaptive supersampling (0/1)" },
+		{ "adaptivedepth",	NULL, &s.adaptiveDepth, NULL,			"adaptive subdivisions of a pixel" },
+		{ "adaptivemetric",	NULL, &s.adaptiveMetric, NULL,			"adaptive metric (0 color distance, 1 contrast)" },
+		{ "adaptivethresh",	NULL, NULL, &s.adaptiveThreshold,		"adaptive split threshold (about 0.1 for contrast)" },
+		{ "dof",			&s.depthOfField, NULL, NULL,			"depth of field (0/1)" },
+		{ "focal",			NULL, NULL, &s.focalLength,				"focal length" },
+		{ "aperture",		NULL, NULL, &s.aperture,				"aperture size" },
+		{ "softshadow",		&s.softShadow, NULL, NULL,				"soft shadows (0/1)" },
+		{ "softshadowcoeff", NULL, NULL, &s.softShadowCoeff,		"soft shadow light size" },
+		{ "glossy",			&s.glossyReflection, NULL, NULL,		"glossy reflection (0/1)" },
+		{ "motionblur",		&s.motionBlur, NULL, NULL,				"motion blur (0/1)" },
+		{ "texture",		&s.textureMapping, NULL, NULL,			"texture mapping (0/1)" },
+		{ "bump",			&s.bumpMapping, NULL, NULL,				"bump mapping (0/1)" },
+		{ "constatten",		NULL, NULL, &s.constAttenFactor,		"constant attenuation factor" },
+		{ "linearatten",	NULL, NULL, &s.linearAttenFactor,		"linear attenuation factor" },
+		{ "quadatten",		NULL, NULL, &s.quadAttenFactor,			"quadratic attenuation factor" },
+		{ "threshold",		NULL, NULL, &s.terminationThreshold,	"ray tree termination threshold" },
+		{ "ambient",		NULL, NULL, &s.ambientLight,			"ambient light intensity" },
+		{ "shadowthresh",	NULL, NULL, &s.accShadowAttenThresh,	"skip shadow rays below this intensity" },
+	};
+
+	int n = sizeof( table ) / sizeof( table[0] );
+	if( opts )
+		for( int k = 0; k < n; ++k )
+			opts[k] = table[k];
+	return n;
+}
+
+bool RenderSettings::set( const char* name, const char* value )
+{
+	SettingsOption opts[ 64 ];
+	int n = settingsOptions( *this, opts );
+
+	for( int k = 0; k < n; ++k ) {
+		if( strcmp( opts[k].name, name ) )
+			continue;
+
+		char* end;
+		if( opts[k].d ) {
+			double v = strtod( value, &end );
+			if( end == value || *end )
+				return false;
+			*opts[k].d = v;
+		} else {
+			long v = strtol( value, &end, 10 );
+			if( end == value || *end )
+				return false;
+			if( opts[k].b )
+				*opts[k].b = v != 0;
+			else
+				*opts[k].i = (int)v;
+		}
+		return true;
+	}
+
+	return false;
+}
+
+bool RenderSettings::parse( const char* option )
+{
+	const char* eq = strchr( option, '=' );
+	if( !eq || eq == option )
+		return false;
+
+	char name[ 64 ];
+	size_t len = eq - option;
+	if( len >= sizeof( name ) )
+		return false;
+	memcpy( name, option, len );
+	name[ len ] = '\0';
+
+	return set( name, eq + 1 );
+}
+
+std::string RenderSettings::toString() const
+{
+	RenderSettings copy( *this );
+	SettingsOption opts[ 64 ];
+	int n = settingsOptions( copy, opts );
+
+	std::string s;
+	char buf[ 128 ];
+	for( int k = 0; k < n; ++k ) {
+		if( opts[k].d )
+			snprintf( buf, sizeof( buf ), "%s=%.17g", opts[k].name, *opts[k].d );
+		else if( opts[k].b )
+			snprintf( buf, sizeof( buf ), "%s=%d", opts[k].name, (int)*opts[k].b );
+		else
+			snprintf( buf, sizeof( buf ), "%s=%d", opts[k].name, *opts[k].i );
+		if( k > 0 )
+			s += ' ';
+		s += buf;
+	}
+	return s;
+}
+
+void RenderSettings::applyTo( Scene* scene ) const
+{
+	scene->constAttenFactor = constAttenFactor;
+	scene->linearAttenFactor = linearAttenFactor;
+	scene->quadAttenFactor = quadAttenFactor;
+	scene->setTerminationThreshold( terminationThreshold );
+	scene->setTextureMapping( textureMapping );
+	scene->setSoftShadow( softShadow );
+	scene->setSoftShadowCoeff( softShadowCoeff );
+	scene->setGlossyReflection( glossyReflection );
+	scene->setMotionBlur( motionBlur );
+	scene->bumpMapping = bumpMapping;
+	scene->ambientLight = vec3f( ambientLight, ambientLight, ambientLight );
+	scene->accShadowAttenThresh = accShadowAttenThresh;
+}
+
+void RenderSettings::printOptions( FILE* f )
+{
+	RenderSettings defaults;
+	SettingsOption opts[ 64 ];
+	int n = settingsOptions( defaults, opts );
+
+	for( int k = 0; k < n; ++k ) {
+		if( opts[k].d )
+			fprintf( f, "    %-16s%s (default %g)\n", opts[k].name, opts[k].help, *opts[k].d );
+		else if( opts[k].b )
+			fprintf( f, "    %-16s%s (default %d)\n", opts[k].name, opts[k].help, (int)*opts[k].b );
+		else
+			fprintf( f, "    %-16s%s (default %d)\n", opts[k].name, opts[k].help, *opts[k].i );
+	}
+}
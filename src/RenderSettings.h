@@ -0,0 +1,71 @@
+#ifndef __RENDERSETTINGS_H__
+#define __RENDERSETTINGS_H__
+
+// Every knob of a render that isn't part of the scene file.  The GUI fills
+// one in from its sliders and buttons; the command line version builds one
+// from -o name=value options.  The defaults are the ones the GUI starts with.
+
+#include <stdio.h>
+#include <string>
+
+class Scene;
+
+// How adaptive supersampling tells that two samples differ
+enum AdaptiveMetric
+{
+	ADAPTIVE_DISTANCE = 0,	// distance between the colors
+	ADAPTIVE_CONTRAST = 1	// largest |a - b| / (a + b) over the channels
+};
+
+struct RenderSettings
+{
+	RenderSettings();
+
+	// Set the option called name from its text value, e.g. ( "aperture", "0.5" ).
+	// Returns false for an unknown name or a malformed value.
+	bool set( const char* name, const char* value );
+	// Same, for a single "name=value" string.
+	bool parse( const char* option );
+	// Every option as "name=value", separated by spaces, for parse to
+	// read back in one at a time; doubles keep all their digits.
+	std::string toString() const;
+
+	// Copy the options the scene looks after itself into scene.
+	void applyTo( Scene* scene ) const;
+
+	// One line per option name, for usage messages.
+	static void printOptions( FILE* f );
+
+	int		depth;					// recursion depth
+
+	bool	background;				// use the background image, if there is one
+
+	bool	antialiasing;
+	int		numSubpixels;			// per side
+	bool	jittering;
+	bool	adaptiveSupersampling;
+	int		adaptiveDepth;			// cells are split down to 1 / 2^adaptiveDepth of a pixel
+	int		adaptiveMetric;			// an AdaptiveMetric
+	double	adaptiveThreshold;		// split a cell where samples differ by more
+
+	bool	depthOfField;
+	double	focalLength;
+	double	aperture;
+
+	bool	softShadow;
+	double	softShadowCoeff;		// size of the area the light is spread over
+	bool	glossyReflection;
+	bool	motionBlur;
+	bool	textureMapping;
+	bool	bumpMapping;
+
+	double	constAttenFactor;
+	double	linearAttenFactor;
+	double	quadAttenFactor;
+
+	double	terminationThreshold;	// adaptive termination of the ray tree
+	double	ambientLight;			// same intensity on all three channels
+	double	accShadowAttenThresh;	// skip the shadow rays of lights darker than this
+};
+
+#endif // __RENDERSETTINGS_H__
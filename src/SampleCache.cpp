@@ -0,0 +1,60 @@
+#include "SampleCache.h"
+
+void SampleCache::clear()
+{
+	used = 0;
+	if( ++generation == 0 ) {
+		// after 2^32 clears the old entries could pass for new ones
+		for( size_t k = 0; k < table.size(); ++k )
+			table[k].generation = 0;
+		generation = 1;
+	}
+}
+
+size_t SampleCache::slot( uint64_t k ) const
+{
+	// Fibonacci hashing; the top bits are the well mixed ones
+	k *= 0x9E3779B97F4A7C15ULL;
+	return (size_t)(k >> 32) & (table.size() - 1);
+}
+
+bool SampleCache::find( int x, int y, vec3f& col ) const
+{
+	if( table.empty() )
+		return false;
+
+	uint64_t k = key( x, y );
+	for( size_t s = slot( k ); table[s].generation == generation; s = (s + 1) & (table.size() - 1) ) {
+		if( table[s].key == k ) {
+			col = table[s].color;
+			return true;
+		}
+	}
+	return false;
+}
+
+void SampleCache::insert( int x, int y, const vec3f& col )
+{
+	if( table.empty() ) {
+		table.resize( 2 * MAX_ENTRIES );
+		for( size_t k = 0; k < table.size(); ++k )
+			table[k].generation = 0;
+		generation = 1;
+	}
+	if( used == MAX_ENTRIES )
+		clear();
+
+	uint64_t k = key( x, y );
+	size_t s = slot( k );
+	while( table[s].generation == generation ) {
+		if( table[s].key == k ) {
+			table[s].color = col;
+			return;
+		}
+		s = (s + 1) & (table.size() - 1);
+	}
+	table[s].key = k;
+	table[s].generation = generation;
+	table[s].color = col;
+	++used;
+}
@@ -0,0 +1,48 @@
+#ifndef __SAMPLECACHE_H__
+#define __SAMPLECACHE_H__
+
+// The colors adaptive supersampling has traced, by point of its image-plane
+// lattice, so a corner that neighbouring pixels and sub-cells share is only
+// traced once.  An open-addressing hash table, emptied by moving on to a
+// new generation, so a render thread can keep one for good without
+// allocating as it goes.
+
+#include <stdint.h>
+#include <vector>
+
+#include "vecmath/vecmath.h"
+
+class SampleCache
+{
+public:
+	SampleCache() : generation( 1 ), used( 0 ) {}
+
+	// Forget everything.
+	void clear();
+
+	// The color at lattice point (x, y), if it is there.
+	bool find( int x, int y, vec3f& col ) const;
+	// Keep col as the color at (x, y).  Once the table holds MAX_ENTRIES
+	// it starts over, so it never grows past that; the lattice is walked
+	// in an order that soon leaves old points behind anyway.
+	void insert( int x, int y, const vec3f& col );
+
+	static const size_t MAX_ENTRIES = 1 << 14;
+
+private:
+	struct Entry
+	{
+		uint64_t key;
+		uint32_t generation;	// the entry is empty unless this is the current one
+		vec3f color;
+	};
+
+	static uint64_t key( int x, int y ) { return ((uint64_t)(uint32_t)x << 32) | (uint32_t)y; }
+	size_t slot( uint64_t k ) const;
+
+	std::vector<Entry> table;	// twice MAX_ENTRIES, allocated on the first insert
+	uint32_t generation;
+	size_t used;
+};
+
+#endif // __SAMPLECACHE_H__
@@ -0,0 +1,251 @@
+#include <cmath>
+#include <float.h>
+
+#include "Heightfield.h"
+
+Heightfield::Heightfield( Scene *scene, Material *mat, unsigned char *intensity,
+	unsigned char *color, int width, int height )
+	: MaterialSceneObject( scene, mat ), width( width ), height( height ),
+	minHeight( 0.0f ), maxHeight( 0.0f ), heightStep( 0.0f ), blocksX( 0 ), blocksY( 0 )
+{
+	if( !intensity || width < 2 || height < 2 )
+		return;
+
+	// two passes, for the range and then the steps, so the heights are
+	// never held as floats
+	minHeight = FLT_MAX;
+	maxHeight = -FLT_MAX;
+	for( int y = 0; y < height; ++y ) {
+		for( int x = 0; x < width; ++x ) {
+			float z = (float)scene->getPixelIntensity( intensity, width, height, x, y );
+			minHeight = std::min( minHeight, z );
+			maxHeight = std::max( maxHeight, z );
+		}
+	}
+	heightStep = (maxHeight - minHeight) / 65535.0f;
+	heights.resize( (size_t)width * height );
+	for( int y = 0; y < height; ++y ) {
+		for( int x = 0; x < width; ++x ) {
+			float z = (float)scene->getPixelIntensity( intensity, width, height, x, y );
+			heights[ (size_t)y * width + x ] = heightStep > 0.0f ?
+				(uint16_t)((z - minHeight) / heightStep + 0.5f) : 0;
+		}
+	}
+
+	if( color )
+		colors.assign( color, color + (size_t)width * height * 3 );
+
+	// block (bx, by) has the squares from (bx, by) * BLOCK_SIZE on, and so
+	// the samples up to one further
+	blocksX = (width - 2) / BLOCK_SIZE + 1;
+	blocksY = (height - 2) / BLOCK_SIZE + 1;
+	blockMin.resize( blocksX * blocksY );
+	blockMax.resize( blocksX * blocksY );
+	for( int by = 0; by < blocksY; ++by ) {
+		for( int bx = 0; bx < blocksX; ++bx ) {
+			uint16_t lo = 0xffff, hi = 0;
+			int y1 = std::min( (by + 1) * BLOCK_SIZE, height - 1 );
+			int x1 = std::min( (bx + 1) * BLOCK_SIZE, width - 1 );
+			for( int y = by * BLOCK_SIZE; y <= y1; ++y ) {
+				for( int x = bx * BLOCK_SIZE; x <= x1; ++x ) {
+					lo = std::min( lo, heights[ (size_t)y * width + x ] );
+					hi = std::max( hi, heights[ (size_t)y * width + x ] );
+				}
+			}
+			blockMin[ by * blocksX + bx ] = lo;
+			blockMax[ by * blocksX + bx ] = hi;
+		}
+	}
+}
+
+BoundingBox Heightfield::ComputeLocalBoundingBox()
+{
+	BoundingBox localbounds;
+	if( heights.empty() )
+		return localbounds;
+
+	localbounds.min = vec3f( -1.0, -1.0, minHeight - RAY_EPSILON );
+	localbounds.max = vec3f( 2.0 * (width - 1) / width - 1.0, 2.0 * (height - 1) / height - 1.0,
+		maxHeight + RAY_EPSILON );
+	return localbounds;
+}
+
+vec3f Heightfield::sample( int x, int y ) const
+{
+	return vec3f( 2.0 * x / width - 1.0, 2.0 * y / height - 1.0, level( heights[ (size_t)y * width + x ] ) );
+}
+
+vec3f Heightfield::color( int x, int y ) const
+{
+	const unsigned char *c = &colors[ ((size_t)y * width + x) * 3 ];
+	return vec3f( c[0] / 255.0f, c[1] / 255.0f, c[2] / 255.0f );
+}
+
+// Steps through the squares of side size that a ray crosses between t0 and
+// t1, in order, within the squares [loX, hiX] x [loY, hiY].  o and d are
+// the ray in units of the grid.
+class GridWalk
+{
+public:
+	GridWalk( const double *o, const double *d, double t0, double t1, int size,
+		int loX, int loY, int hiX, int hiY )
+		: t( t0 ), end( t1 ), done( false )
+	{
+		int lo[2] = { loX, loY };
+		int hi[2] = { hiX, hiY };
+		for( int k = 0; k < 2; ++k ) {
+			int c = (int)floor( (o[k] + d[k] * t0) / size );
+			cell[k] = std::max( lo[k], std::min( hi[k], c ) );
+			limit[k] = d[k] > 0.0 ? hi[k] : lo[k];
+			if( d[k] > 0.0 ) {
+				step[k] = 1;
+				next[k] = ((cell[k] + 1) * size - o[k]) / d[k];
+				delta[k] = size / d[k];
+			} else if( d[k] < 0.0 ) {
+				step[k] = -1;
+				next[k] = (cell[k] * size - o[k]) / d[k];
+				delta[k] = -size / d[k];
+			} else {
+				step[k] = 0;
+				next[k] = DBL_MAX;
+				delta[k] = 0.0;
+			}
+		}
+	}
+
+	// The next square, and the stretch of the ray in it
+	bool nextSquare( int& x, int& y, double& tEnter, double& tExit )
+	{
+		if( done )
+			return false;
+		x = cell[0];
+		y = cell[1];
+		tEnter = t;
+
+		int k = next[0] < next[1] ? 0 : 1;
+		if( next[k] >= end || cell[k] == limit[k] ) {
+			tExit = end;
+			done = true;
+		} else {
+			tExit = next[k];
+			cell[k] += step[k];
+			next[k] += delta[k];
+		}
+		t = tExit;
+		return true;
+	}
+
+private:
+	int cell[2], step[2], limit[2];
+	double next[2], delta[2];
+	double t, end;
+	bool done;
+};
+
+// The two triangles of square (x, y); t is lowered to a hit closer than it.
+bool Heightfield::intersectSquare( const ray& r, int x, int y, double& t, isect& i ) const
+{
+	vec3f p = r.getPosition();
+	vec3f d = r.getDirection();
+	vec3f a = sample( x, y );
+	vec3f c = sample( x + 1, y + 1 );
+	int corners[2][2] = { { x, y + 1 }, { x + 1, y } };
+
+	bool have_one = false;
+	for( int k = 0; k < 2; ++k ) {
+		vec3f b = sample( corners[k][0], corners[k][1] );
+		vec3f e1 = b - a;
+		vec3f e2 = c - a;
+		vec3f q = d.cross( e2 );
+		double det = e1 * q;
+		if( fabs( det ) < NORMAL_EPSILON * (e1.cross( e2 )).length() )
+			continue;
+
+		vec3f s = p - a;
+		double u = (s * q) / det;
+		if( u < 0.0 || u > 1.0 )
+			continue;
+		vec3f sc = s.cross( e1 );
+		double v = (d * sc) / det;
+		if( v < 0.0 || u + v > 1.0 )
+			continue;
+		double tHit = (e2 * sc) / det;
+		if( tHit <= RAY_EPSILON || tHit >= t )
+			continue;
+
+		t = tHit;
+		have_one = true;
+
+		// two-sided, like a square: the normal faces the ray
+		vec3f n = e1.cross( e2 ).normalize();
+		i.setN( n * d > 0.0 ? -n : n );
+		if( colors.empty() ) {
+			i.clearMaterials();
+		} else {
+			i.setDiffuse( (1.0 - u - v) * color( x, y ) + u * color( corners[k][0], corners[k][1] )
+				+ v * color( x + 1, y + 1 ) );
+		}
+	}
+	return have_one;
+}
+
+bool Heightfield::intersectLocal( const ray& r, isect& i ) const
+{
+	if( heights.empty() )
+		return false;
+
+	// the ray in units of the grid, where sample (x, y) lies at (x, y); t
+	// stays the same
+	vec3f p = r.getPosition();
+	vec3f d = r.getDirection();
+	double o[3] = { (p[0] + 1.0) * 0.5 * width, (p[1] + 1.0) * 0.5 * height, p[2] };
+	double dir[3] = { d[0] * 0.5 * width, d[1] * 0.5 * height, d[2] };
+
+	// the stretch of the ray over the squares, between the lowest and the
+	// highest sample
+	double lo[3] = { 0.0, 0.0, minHeight - RAY_EPSILON };
+	double hi[3] = { width - 1.0, height - 1.0, maxHeight + RAY_EPSILON };
+	double t0 = 0.0, t1 = DBL_MAX;
+	for( int k = 0; k < 3; ++k ) {
+		if( dir[k] == 0.0 ) {
+			if( o[k] < lo[k] || o[k] > hi[k] )
+				return false;
+			continue;
+		}
+		double ta = (lo[k] - o[k]) / dir[k];
+		double tb = (hi[k] - o[k]) / dir[k];
+		if( ta > tb )
+			std::swap( ta, tb );
+		t0 = std::max( t0, ta );
+		t1 = std::min( t1, tb );
+		if( t0 > t1 )
+			return false;
+	}
+
+	double t = DBL_MAX;
+	int bx, by;
+	double ta, tb;
+	GridWalk blocks( o, dir, t0, t1, BLOCK_SIZE, 0, 0, blocksX - 1, blocksY - 1 );
+	while( blocks.nextSquare( bx, by, ta, tb ) ) {
+		double za = o[2] + dir[2] * ta;
+		double zb = o[2] + dir[2] * tb;
+		if( std::max( za, zb ) < level( blockMin[ by * blocksX + bx ] ) - RAY_EPSILON ||
+			std::min( za, zb ) > level( blockMax[ by * blocksX + bx ] ) + RAY_EPSILON )
+			continue;
+
+		int x, y;
+		double sa, sb;
+		GridWalk squares( o, dir, ta, tb, 1, bx * BLOCK_SIZE, by * BLOCK_SIZE,
+			std::min( (bx + 1) * BLOCK_SIZE, width - 1 ) - 1,
+			std::min( (by + 1) * BLOCK_SIZE, height - 1 ) - 1 );
+		while( squares.nextSquare( x, y, sa, sb ) ) {
+			// the squares come in order, so the first hit is the closest
+			if( intersectSquare( r, x, y, t, i ) ) {
+				i.obj = this;
+				i.setT( t );
+				return true;
+			}
+		}
+	}
+	return false;
+}
@@ -0,0 +1,53 @@
+#ifndef __HEIGHTFIELD_H__
+#define __HEIGHTFIELD_H__
+
+#include <vector>
+#include <stdint.h>
+
+#include "../scene/scene.h"
+
+// A terrain given by an image: sample (x, y) of a width x height image
+// lies at (2x/width - 1, 2y/height - 1, intensity of pixel (x, y)), and
+// every square of four neighbouring samples is cut into two triangles
+// along its diagonal from (x, y) to (x+1, y+1).  The surface takes its
+// diffuse color from a second image of the same size, interpolated over
+// each triangle, and the rest of its material from mat.
+//
+// Only the heights and the colors are kept, not a mesh, in 5 bytes a
+// sample: the heights as 16-bit steps between the lowest and the highest,
+// finer than RAY_EPSILON, and the colors as they are.  A ray walks the
+// squares it crosses in order, like a line drawn on the image, and stops
+// at the first one it hits.  The squares are grouped in blocks of
+// BLOCK_SIZE x BLOCK_SIZE that know their lowest and highest sample, so
+// the walk skips the blocks it passes above or below.
+class Heightfield
+	: public MaterialSceneObject
+{
+public:
+	// The images hold 3 bytes per pixel; color may be NULL, for mat's kd.
+	// Both are copied.
+	Heightfield( Scene *scene, Material *mat, unsigned char *intensity,
+		unsigned char *color, int width, int height );
+
+	virtual bool intersectLocal( const ray& r, isect& i ) const;
+	virtual bool hasBoundingBoxCapability() const { return true; }
+	virtual BoundingBox ComputeLocalBoundingBox();
+
+	static const int BLOCK_SIZE = 8;
+
+private:
+	vec3f sample( int x, int y ) const;
+	vec3f color( int x, int y ) const;
+	float level( uint16_t step ) const { return minHeight + step * heightStep; }
+	bool intersectSquare( const ray& r, int x, int y, double& t, isect& i ) const;
+
+	int width, height;					// samples; there are one fewer squares each way
+	std::vector<uint16_t> heights;		// width * height, row by row, in steps
+	std::vector<unsigned char> colors;	// 3 bytes per sample, or none
+	float minHeight, maxHeight, heightStep;
+	int blocksX, blocksY;
+	std::vector<uint16_t> blockMin;		// per block, of the samples of its squares
+	std::vector<uint16_t> blockMax;
+};
+
+#endif // __HEIGHTFIELD_H__
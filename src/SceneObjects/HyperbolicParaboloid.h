@@ -9,12 +9,23 @@ class HyperbolicParaboloid
 {
 public:
 	HyperbolicParaboloid(Scene *scene, Material *mat)
-		: MaterialSceneObject(scene, mat)
+		: MaterialSceneObject(scene, mat), clipped(false)
 	{
 	}
 
 	virtual bool intersectLocal(const ray& r, isect& i) const;
-	virtual bool hasBoundingBoxCapability() const { return true; }
+	// the surface is infinite, so unless it is clipped it has no box the
+	// BVH could cull against
+	virtual bool hasBoundingBoxCapability() const { return clipped; }
+
+	// Keep only the part of the surface inside this local box.  Call it
+	// before the object is added to the scene.
+	void setClipBounds(const vec3f& min, const vec3f& max)
+	{
+		clipBounds.min = min;
+		clipBounds.max = max;
+		clipped = true;
+	}
 
 	virtual bool getLocalUV(const ray& r, const isect& i, double& u, double& v) const;	// returns true only if this sceneobject supports texture mapping
 
@@ -22,10 +33,17 @@ public:
 
 	virtual BoundingBox ComputeLocalBoundingBox()
 	{
+		if (clipped)
+			return clipBounds;
+
 		BoundingBox localbounds;
 		localbounds.min = vec3f(-1.0f, -1.0f, -1.0f);
 		localbounds.max = vec3f(1.0f, 1.0f, 1.0f);
 		return localbounds;
 	}
+
+protected:
+	bool clipped;
+	BoundingBox clipBounds;
 };
 #endif // __HyperbolicParaboloid_H__
@@ -19,23 +19,15 @@ bool Hyperboloid::intersectLocal(const ray & r, isect & i) const
 
 	discriminant = sqrt(discriminant);
 	double t2 = (-B + discriminant) / (2*A);	//a=1, since direction is normalized
+	double t1 = (-B - discriminant) / (2 * A);	//a=1, since direction is normalized
 
-	if (t2 <= RAY_EPSILON) {	//larger root
+	if (!nearestQuadricRoot(r, t1, t2, clipped ? &clipBounds : NULL, i.t)) {
 		return false;
 	}
 
 	i.obj = this;
-
-	double t1 = (-B - discriminant) / (2 * A);	//a=1, since direction is normalized
-
-	if (t1 > RAY_EPSILON) {
-		i.t = t1;
-		i.N = vec3f(2 * r.at(t1)[0], 2 * r.at(t1)[1], -2 * r.at(t1)[2]).normalize();
-	}
-	else {
-		i.t = t2;
-		i.N = vec3f(2 * r.at(t2)[0], 2 * r.at(t2)[1], -2 * r.at(t2)[2]).normalize();
-	}
+	vec3f P = r.at(i.t);
+	i.N = vec3f(2 * P[0], 2 * P[1], -2 * P[2]).normalize();
 
 	//flip normal if necessary
 	if (r.getDirection().dot(i.N) > 0)
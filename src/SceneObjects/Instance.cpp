@@ -0,0 +1,12 @@
+#include "Instance.h"
+
+bool Instance::intersectLocal( const ray& r, isect& i ) const
+{
+	if( !prototype->intersectLocal( r, i ) )
+		return false;
+
+	// the hit is on this instance, for its material and for telling
+	// instances apart, e.g. when tracking the media a ray is inside of
+	i.obj = this;
+	return true;
+}
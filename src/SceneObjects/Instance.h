@@ -0,0 +1,41 @@
+#ifndef __INSTANCE_H__
+#define __INSTANCE_H__
+
+#include "../scene/scene.h"
+
+// One placement of a shared object: a mesh given once in a `mesh` block and
+// placed any number of times with `instance`.  The instance has its own
+// transform and may have its own material; the geometry, and the mesh's BVH
+// over its faces, belong to the prototype, which the scene owns.  Since the
+// instance's local space is the prototype's, a ray transformed into it can
+// be handed straight to the prototype.  The scene BVH over the instances is
+// the top level of the hierarchy, the mesh's own BVH the bottom one.
+class Instance
+	: public MaterialSceneObject
+{
+public:
+	// mat may be NULL, to use the prototype's material
+	Instance( Scene *scene, SceneObject *prototype, Material *mat )
+		: MaterialSceneObject( scene, mat ), prototype( prototype )
+	{
+	}
+
+	virtual const Material& getMaterial() const
+		{ return material ? *material : prototype->getMaterial(); }
+
+	virtual bool intersectLocal( const ray& r, isect& i ) const;
+	virtual bool hasBoundingBoxCapability() const
+		{ return prototype->hasBoundingBoxCapability(); }
+	virtual bool getLocalUV( const ray& r, const isect& i, double& u, double& v ) const
+		{ return prototype->getLocalUV( r, i, u, v ); }
+
+	// The prototype sits at the root of the transform tree, so its bounds
+	// are its local ones; see Scene::addPrototype.
+	virtual BoundingBox ComputeLocalBoundingBox()
+		{ return prototype->getBoundingBox(); }
+
+private:
+	const SceneObject *prototype;
+};
+
+#endif // __INSTANCE_H__
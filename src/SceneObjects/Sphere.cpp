@@ -9,7 +9,12 @@ bool Sphere::intersectLocal( const ray& r, isect& i ) const
 {
 	vec3f v = -r.getPosition();	//link between ray origin and center of sphere.
 	double b = v.dot(r.getDirection());	
-	double discriminant = b*b - v.dot(v) + 1;	//Discriminant = b^2 - 4*c, where c = (v^2-1)
+	// b^2 - (v^2-1) is 1 less the squared distance of the center from the
+	// ray; taking that distance directly keeps the precision b^2 - v^2
+	// loses to cancellation when the ray starts far away, as it does in
+	// the float build
+	vec3f perp = v - b * r.getDirection();
+	double discriminant = 1.0 - perp.dot(perp);
 
 	if( discriminant < 0.0 ) {
 		return false;
@@ -41,51 +46,29 @@ bool Sphere::intersectLocal( const ray& r, isect& i ) const
 
 bool Sphere::getLocalUV(const ray & r, const isect & i, double & u, double & v) const
 {
-	
-	// Transform the ray into the object's local coordinate space
-	vec3f pos = transform->globalToLocalCoords(r.getPosition());
-	vec3f dir = transform->globalToLocalCoords(r.getPosition() + r.getDirection()) - pos;
-	double length = dir.length();
-	dir /= length;
-
-	ray localRay(pos, dir);
-	isect icopy = i;
-	if (intersectLocal(localRay, icopy)) {	//send this iscet point to the intersect local function.
-										// Transform the intersection point & normal returned back into global space.
-		
-										
-		vec3f sn = localRay.at(icopy.t);
-		vec3f sp = { 0.0f, 0.0f, 1.0f };
-		vec3f se = { -1.0f, 0.0f, 0.0f };
-		double fai = acos(-sn*sp);
-		v = fai / 3.14159265359;
-		if (abs(v) < RAY_EPSILON || abs(v - 1) < RAY_EPSILON)
-			u = 0;
-		else {
-			double mini = min( 1.0, (se*sn) / sin(fai) );
-			if (mini > 1.0)
-				mini = 1.0;
-			if (mini < -1.0)
-				mini = -1.0;
-			//double theta = acos(min(1.0, (se*sn) / sin(fai))) / (2 * 3.14159265359);	//is the problem due to floating point > 1?
-			double theta = acos(mini) / (2 * 3.14159265359);	//is the problem due to floating point > 1?
-			if ((sp.cross(se))  *sn > RAY_EPSILON)
-				u = theta;
-			else
-				u = 1 - theta;
-		}
-		
-		
-										
-		//i.N = transform->localToGlobalCoordsNormal(i.N);
-		//i.t /= length;
-
-		return true;
-	}
+	// the hit point in the sphere's own space, kept by Geometry::intersect
+	vec3f sn = i.localPoint();
+	vec3f sp = { 0.0f, 0.0f, 1.0f };
+	vec3f se = { -1.0f, 0.0f, 0.0f };
+	double fai = acos(-sn*sp);
+	v = fai / 3.14159265359;
+	if (abs(v) < RAY_EPSILON || abs(v - 1) < RAY_EPSILON)
+		u = 0;
 	else {
-		return false;
+		double mini = min( 1.0, (se*sn) / sin(fai) );
+		if (mini > 1.0)
+			mini = 1.0;
+		if (mini < -1.0)
+			mini = -1.0;
+		//double theta = acos(min(1.0, (se*sn) / sin(fai))) / (2 * 3.14159265359);	//is the problem due to floating point > 1?
+		double theta = acos(mini) / (2 * 3.14159265359);	//is the problem due to floating point > 1?
+		if ((sp.cross(se))  *sn > RAY_EPSILON)
+			u = theta;
+		else
+			u = 1 - theta;
 	}
-	
+
+	return true;
 }
 
 
@@ -40,36 +40,17 @@ bool Square::intersectLocal( const ray& r, isect& i ) const
 
 bool Square::getLocalUV(const ray & r, const isect & i, double & u, double & v) const
 {
-
-	// Transform the ray into the object's local coordinate space
-	vec3f pos = transform->globalToLocalCoords(r.getPosition());
-	vec3f dir = transform->globalToLocalCoords(r.getPosition() + r.getDirection()) - pos;
-	double length = dir.length();
-	dir /= length;
-
-	ray localRay(pos, dir);
-	isect icopy = i;
-	if (intersectLocal(localRay, icopy)) {
-		vec3f localIscePoint = localRay.at(icopy.t);
-		u = localIscePoint[0] + 0.5;
-		v = localIscePoint[1] + 0.5;
-		return true;
-	}
-	return false;
-
+	// the hit point in the square's own space, kept by Geometry::intersect
+	vec3f localIscePoint = i.localPoint();
+	u = localIscePoint[0] + 0.5;
+	v = localIscePoint[1] + 0.5;
+	return true;
 }
 
 
 
 bool Square::preturbNormal(const ray & r, isect & i, const double & u, const double & v, unsigned char * preturbImg, const int & imgWidth, const int & imgHeight, Scene* scene) const
 {
-	// Transform the ray into the object's local coordinate space
-	vec3f pos = transform->globalToLocalCoords(r.getPosition());
-	vec3f dir = transform->globalToLocalCoords(r.getPosition() + r.getDirection()) - pos;
-	double length = dir.length();
-	dir /= length;
-
-	ray localRay(pos, dir);
 	if (preturbImg) {
 		int pixelx = min(imgWidth - 1, int(u*double(imgWidth)));
 		int pixely = min(imgHeight - 1, int(v*double(imgHeight)));
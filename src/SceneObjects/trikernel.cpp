@@ -0,0 +1,337 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "trikernel.h"
+#include "../scene/ray.h"
+
+#if defined(__x86_64__) || defined(__i386__) || defined(_M_X64) || defined(_M_IX86)
+#define RAY_X86
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+#endif
+
+// gcc and clang only emit SSE/AVX instructions in functions that ask for
+// them; MSVC takes the intrinsics anywhere.
+#if defined(RAY_X86) && (defined(__GNUC__) || defined(__clang__))
+#define RAY_TARGET(isa) __attribute__((target(isa)))
+#else
+#define RAY_TARGET(isa)
+#endif
+
+static const float TRI_RAY_EPSILON = (float)RAY_EPSILON;
+static const float TRI_NORMAL_EPSILON = (float)NORMAL_EPSILON;
+
+void setTriangle( TriangleBlock& b, int k, int face,
+	const float* a, const float* bv, const float* c )
+{
+	b.face[k] = face;
+	if( face < 0 ) {
+		for( int j = 0; j < 3; ++j )
+			b.v0[j][k] = b.e1[j][k] = b.e2[j][k] = 0.0f;
+		b.area2[k] = 0.0f;
+		return;
+	}
+
+	double e1[3], e2[3];
+	for( int j = 0; j < 3; ++j ) {
+		e1[j] = (double)bv[j] - a[j];
+		e2[j] = (double)c[j] - a[j];
+		b.v0[j][k] = a[j];
+		b.e1[j][k] = (float)e1[j];
+		b.e2[j][k] = (float)e2[j];
+	}
+	vec3f n = vec3f( e1[0], e1[1], e1[2] ).cross( vec3f( e2[0], e2[1], e2[2] ) );
+	b.area2[k] = (float)n.length();
+}
+
+// Out of the lanes in mask, the one with the smallest t; ties go to the
+// lower lane, like the scalar loop.
+static int closestLane( int mask, const float* t, const float* u, const float* v,
+	float& tOut, float& uOut, float& vOut )
+{
+	int lane = -1;
+	for( int k = 0; mask; ++k, mask >>= 1 ) {
+		if( (mask & 1) && (lane < 0 || t[k] < tOut) ) {
+			lane = k;
+			tOut = t[k];
+			uOut = u[k];
+			vOut = v[k];
+		}
+	}
+	return lane;
+}
+
+static int testScalar( const TriangleBlock& b, const TriangleRay& r,
+	float tMax, float& tOut, float& uOut, float& vOut )
+{
+	int lane = -1;
+	for( int k = 0; k < TRI_BLOCK_SIZE; ++k ) {
+		if( b.face[k] < 0 )
+			continue;
+
+		float px = r.d[1]*b.e2[2][k] - r.d[2]*b.e2[1][k];
+		float py = r.d[2]*b.e2[0][k] - r.d[0]*b.e2[2][k];
+		float pz = r.d[0]*b.e2[1][k] - r.d[1]*b.e2[0][k];
+		float det = b.e1[0][k]*px + b.e1[1][k]*py + b.e1[2][k]*pz;
+
+		// det is -(d . n) |n|, so this keeps the front faces that aren't
+		// seen edge on, and drops the degenerate ones
+		if( !(det > 0.0f && det >= TRI_NORMAL_EPSILON * b.area2[k]) )
+			continue;
+		float inv = 1.0f / det;
+
+		float sx = r.o[0] - b.v0[0][k];
+		float sy = r.o[1] - b.v0[1][k];
+		float sz = r.o[2] - b.v0[2][k];
+		float u = (sx*px + sy*py + sz*pz) * inv;
+		if( u < 0.0f )
+			continue;
+
+		float qx = sy*b.e1[2][k] - sz*b.e1[1][k];
+		float qy = sz*b.e1[0][k] - sx*b.e1[2][k];
+		float qz = sx*b.e1[1][k] - sy*b.e1[0][k];
+		float v = (r.d[0]*qx + r.d[1]*qy + r.d[2]*qz) * inv;
+		if( v < 0.0f || u + v > 1.0f )
+			continue;
+
+		float t = (b.e2[0][k]*qx + b.e2[1][k]*qy + b.e2[2][k]*qz) * inv;
+		if( t < TRI_RAY_EPSILON || !(t < tMax) )
+			continue;
+
+		tMax = t;
+		tOut = t;
+		uOut = u;
+		vOut = v;
+		lane = k;
+	}
+	return lane;
+}
+
+#ifdef RAY_X86
+
+// The same test as testScalar on lanes [base, base + 4).  Returns the mask
+// of the lanes that hit and stores their t, u and v.
+RAY_TARGET("sse2")
+static int testSSE4( const TriangleBlock& b, const TriangleRay& r, int base,
+	float tMax, float* tLanes, float* uLanes, float* vLanes )
+{
+	__m128 dx = _mm_set1_ps( r.d[0] );
+	__m128 dy = _mm_set1_ps( r.d[1] );
+	__m128 dz = _mm_set1_ps( r.d[2] );
+	__m128 e1x = _mm_loadu_ps( b.e1[0] + base );
+	__m128 e1y = _mm_loadu_ps( b.e1[1] + base );
+	__m128 e1z = _mm_loadu_ps( b.e1[2] + base );
+	__m128 e2x = _mm_loadu_ps( b.e2[0] + base );
+	__m128 e2y = _mm_loadu_ps( b.e2[1] + base );
+	__m128 e2z = _mm_loadu_ps( b.e2[2] + base );
+	__m128 zero = _mm_setzero_ps();
+
+	__m128 px = _mm_sub_ps( _mm_mul_ps( dy, e2z ), _mm_mul_ps( dz, e2y ) );
+	__m128 py = _mm_sub_ps( _mm_mul_ps( dz, e2x ), _mm_mul_ps( dx, e2z ) );
+	__m128 pz = _mm_sub_ps( _mm_mul_ps( dx, e2y ), _mm_mul_ps( dy, e2x ) );
+	__m128 det = _mm_add_ps( _mm_add_ps( _mm_mul_ps( e1x, px ), _mm_mul_ps( e1y, py ) ),
+		_mm_mul_ps( e1z, pz ) );
+
+	__m128 valid = _mm_and_ps( _mm_cmpgt_ps( det, zero ),
+		_mm_cmpge_ps( det, _mm_mul_ps( _mm_set1_ps( TRI_NORMAL_EPSILON ),
+			_mm_loadu_ps( b.area2 + base ) ) ) );
+	if( !_mm_movemask_ps( valid ) )
+		return 0;
+	__m128 inv = _mm_div_ps( _mm_set1_ps( 1.0f ), det );
+
+	__m128 sx = _mm_sub_ps( _mm_set1_ps( r.o[0] ), _mm_loadu_ps( b.v0[0] + base ) );
+	__m128 sy = _mm_sub_ps( _mm_set1_ps( r.o[1] ), _mm_loadu_ps( b.v0[1] + base ) );
+	__m128 sz = _mm_sub_ps( _mm_set1_ps( r.o[2] ), _mm_loadu_ps( b.v0[2] + base ) );
+	__m128 u = _mm_mul_ps( _mm_add_ps( _mm_add_ps( _mm_mul_ps( sx, px ), _mm_mul_ps( sy, py ) ),
+		_mm_mul_ps( sz, pz ) ), inv );
+
+	__m128 qx = _mm_sub_ps( _mm_mul_ps( sy, e1z ), _mm_mul_ps( sz, e1y ) );
+	__m128 qy = _mm_sub_ps( _mm_mul_ps( sz, e1x ), _mm_mul_ps( sx, e1z ) );
+	__m128 qz = _mm_sub_ps( _mm_mul_ps( sx, e1y ), _mm_mul_ps( sy, e1x ) );
+	__m128 v = _mm_mul_ps( _mm_add_ps( _mm_add_ps( _mm_mul_ps( dx, qx ), _mm_mul_ps( dy, qy ) ),
+		_mm_mul_ps( dz, qz ) ), inv );
+	__m128 t = _mm_mul_ps( _mm_add_ps( _mm_add_ps( _mm_mul_ps( e2x, qx ), _mm_mul_ps( e2y, qy ) ),
+		_mm_mul_ps( e2z, qz ) ), inv );
+
+	valid = _mm_and_ps( valid, _mm_cmpge_ps( u, zero ) );
+	valid = _mm_and_ps( valid, _mm_cmpge_ps( v, zero ) );
+	valid = _mm_and_ps( valid, _mm_cmple_ps( _mm_add_ps( u, v ), _mm_set1_ps( 1.0f ) ) );
+	valid = _mm_and_ps( valid, _mm_cmpge_ps( t, _mm_set1_ps( TRI_RAY_EPSILON ) ) );
+	valid = _mm_and_ps( valid, _mm_cmplt_ps( t, _mm_set1_ps( tMax ) ) );
+
+	_mm_storeu_ps( tLanes, t );
+	_mm_storeu_ps( uLanes, u );
+	_mm_storeu_ps( vLanes, v );
+	return _mm_movemask_ps( valid );
+}
+
+RAY_TARGET("sse2")
+static int testSSE( const TriangleBlock& b, const TriangleRay& r,
+	float tMax, float& tOut, float& uOut, float& vOut )
+{
+	float t[ TRI_BLOCK_SIZE ], u[ TRI_BLOCK_SIZE ], v[ TRI_BLOCK_SIZE ];
+	int mask = testSSE4( b, r, 0, tMax, t, u, v );
+	// lanes are filled in order, so an empty lane 4 means an empty half
+	if( b.face[4] >= 0 )
+		mask |= testSSE4( b, r, 4, tMax, t + 4, u + 4, v + 4 ) << 4;
+	if( !mask )
+		return -1;
+	return closestLane( mask, t, u, v, tOut, uOut, vOut );
+}
+
+RAY_TARGET("avx")
+static int testAVX( const TriangleBlock& b, const TriangleRay& r,
+	float tMax, float& tOut, float& uOut, float& vOut )
+{
+	__m256 dx = _mm256_set1_ps( r.d[0] );
+	__m256 dy = _mm256_set1_ps( r.d[1] );
+	__m256 dz = _mm256_set1_ps( r.d[2] );
+	__m256 e1x = _mm256_loadu_ps( b.e1[0] );
+	__m256 e1y = _mm256_loadu_ps( b.e1[1] );
+	__m256 e1z = _mm256_loadu_ps( b.e1[2] );
+	__m256 e2x = _mm256_loadu_ps( b.e2[0] );
+	__m256 e2y = _mm256_loadu_ps( b.e2[1] );
+	__m256 e2z = _mm256_loadu_ps( b.e2[2] );
+	__m256 zero = _mm256_setzero_ps();
+
+	__m256 px = _mm256_sub_ps( _mm256_mul_ps( dy, e2z ), _mm256_mul_ps( dz, e2y ) );
+	__m256 py = _mm256_sub_ps( _mm256_mul_ps( dz, e2x ), _mm256_mul_ps( dx, e2z ) );
+	__m256 pz = _mm256_sub_ps( _mm256_mul_ps( dx, e2y ), _mm256_mul_ps( dy, e2x ) );
+	__m256 det = _mm256_add_ps( _mm256_add_ps( _mm256_mul_ps( e1x, px ), _mm256_mul_ps( e1y, py ) ),
+		_mm256_mul_ps( e1z, pz ) );
+
+	__m256 valid = _mm256_and_ps( _mm256_cmp_ps( det, zero, _CMP_GT_OQ ),
+		_mm256_cmp_ps( det, _mm256_mul_ps( _mm256_set1_ps( TRI_NORMAL_EPSILON ),
+			_mm256_loadu_ps( b.area2 ) ), _CMP_GE_OQ ) );
+	if( !_mm256_movemask_ps( valid ) )
+		return -1;
+	__m256 inv = _mm256_div_ps( _mm256_set1_ps( 1.0f ), det );
+
+	__m256 sx = _mm256_sub_ps( _mm256_set1_ps( r.o[0] ), _mm256_loadu_ps( b.v0[0] ) );
+	__m256 sy = _mm256_sub_ps( _mm256_set1_ps( r.o[1] ), _mm256_loadu_ps( b.v0[1] ) );
+	__m256 sz = _mm256_sub_ps( _mm256_set1_ps( r.o[2] ), _mm256_loadu_ps( b.v0[2] ) );
+	__m256 u = _mm256_mul_ps( _mm256_add_ps( _mm256_add_ps( _mm256_mul_ps( sx, px ),
+		_mm256_mul_ps( sy, py ) ), _mm256_mul_ps( sz, pz ) ), inv );
+
+	__m256 qx = _mm256_sub_ps( _mm256_mul_ps( sy, e1z ), _mm256_mul_ps( sz, e1y ) );
+	__m256 qy = _mm256_sub_ps( _mm256_mul_ps( sz, e1x ), _mm256_mul_ps( sx, e1z ) );
+	__m256 qz = _mm256_sub_ps( _mm256_mul_ps( sx, e1y ), _mm256_mul_ps( sy, e1x ) );
+	__m256 v = _mm256_mul_ps( _mm256_add_ps( _mm256_add_ps( _mm256_mul_ps( dx, qx ),
+		_mm256_mul_ps( dy, qy ) ), _mm256_mul_ps( dz, qz ) ), inv );
+	__m256 t = _mm256_mul_ps( _mm256_add_ps( _mm256_add_ps( _mm256_mul_ps( e2x, qx ),
+		_mm256_mul_ps( e2y, qy ) ), _mm256_mul_ps( e2z, qz ) ), inv );
+
+	valid = _mm256_and_ps( valid, _mm256_cmp_ps( u, zero, _CMP_GE_OQ ) );
+	valid = _mm256_and_ps( valid, _mm256_cmp_ps( v, zero, _CMP_GE_OQ ) );
+	valid = _mm256_and_ps( valid, _mm256_cmp_ps( _mm256_add_ps( u, v ),
+		_mm256_set1_ps( 1.0f ), _CMP_LE_OQ ) );
+	valid = _mm256_and_ps( valid, _mm256_cmp_ps( t, _mm256_set1_ps( TRI_RAY_EPSILON ), _CMP_GE_OQ ) );
+	valid = _mm256_and_ps( valid, _mm256_cmp_ps( t, _mm256_set1_ps( tMax ), _CMP_LT_OQ ) );
+
+	int mask = _mm256_movemask_ps( valid );
+	if( !mask )
+		return -1;
+
+	float tl[ TRI_BLOCK_SIZE ], ul[ TRI_BLOCK_SIZE ], vl[ TRI_BLOCK_SIZE ];
+	_mm256_storeu_ps( tl, t );
+	_mm256_storeu_ps( ul, u );
+	_mm256_storeu_ps( vl, v );
+	return closestLane( mask, tl, ul, vl, tOut, uOut, vOut );
+}
+
+static bool cpuHasSSE2()
+{
+#if defined(__x86_64__) || defined(_M_X64)
+	return true;
+#elif defined(_MSC_VER)
+	int info[4];
+	__cpuid( info, 1 );
+	return (info[3] & (1 << 26)) != 0;
+#else
+	return __builtin_cpu_supports( "sse2" );
+#endif
+}
+
+// AVX needs the OS to save the ymm registers too, which is what xgetbv says.
+static bool cpuHasAVX()
+{
+#ifdef _MSC_VER
+	int info[4];
+	__cpuid( info, 1 );
+	bool osxsave = (info[2] & (1 << 27)) != 0;
+	bool avx = (info[2] & (1 << 28)) != 0;
+	return osxsave && avx && (_xgetbv( 0 ) & 6) == 6;
+#else
+	return __builtin_cpu_supports( "avx" );
+#endif
+}
+
+#endif // RAY_X86
+
+static bool supported( TriangleKernel k )
+{
+	switch( k ) {
+	case TRI_KERNEL_SCALAR:
+		return true;
+#ifdef RAY_X86
+	case TRI_KERNEL_SSE:
+		return cpuHasSSE2();
+	case TRI_KERNEL_AVX:
+		return cpuHasAVX();
+#endif
+	default:
+		return false;
+	}
+}
+
+static TriangleKernel pickKernel()
+{
+	const char* want = getenv( "RAY_TRIANGLE_KERNEL" );
+	if( want ) {
+		for( int k = TRI_KERNEL_SCALAR; k <= TRI_KERNEL_AVX; ++k ) {
+			if( strcmp( want, triangleKernelName( (TriangleKernel)k ) ) == 0 &&
+				supported( (TriangleKernel)k ) )
+				return (TriangleKernel)k;
+		}
+	}
+
+	if( supported( TRI_KERNEL_AVX ) )
+		return TRI_KERNEL_AVX;
+	if( supported( TRI_KERNEL_SSE ) )
+		return TRI_KERNEL_SSE;
+	return TRI_KERNEL_SCALAR;
+}
+
+TriangleKernel triangleKernel()
+{
+	static TriangleKernel kernel = pickKernel();
+	return kernel;
+}
+
+const char* triangleKernelName( TriangleKernel k )
+{
+	switch( k ) {
+	case TRI_KERNEL_SSE:	return "sse";
+	case TRI_KERNEL_AVX:	return "avx";
+	default:				return "scalar";
+	}
+}
+
+static TriangleBlockTest pickTest()
+{
+	switch( triangleKernel() ) {
+#ifdef RAY_X86
+	case TRI_KERNEL_SSE:	return testSSE;
+	case TRI_KERNEL_AVX:	return testAVX;
+#endif
+	default:				return testScalar;
+	}
+}
+
+TriangleBlockTest triangleBlockTest()
+{
+	static TriangleBlockTest test = pickTest();
+	return test;
+}
@@ -0,0 +1,59 @@
+//
+// trikernel.h
+//
+// Ray/triangle intersection for eight triangles at a time.  The triangles
+// of a mesh BVH leaf are packed into TriangleBlocks, one coordinate per
+// array, so the Moller-Trumbore test can run on all of them in SIMD
+// registers: one AVX pass or two SSE passes, picked at startup from what
+// the CPU supports.  The scalar loop does the same test lane by lane and
+// is used everywhere else.
+//
+
+#ifndef __TRIKERNEL_H__
+#define __TRIKERNEL_H__
+
+// Triangles per block.
+const int TRI_BLOCK_SIZE = 8;
+
+// Structure of arrays: for lane k the triangle is v0 + u*e1 + v*e2.  area2
+// is |e1 x e2|, twice the area; the kernels need it to cull back faces the
+// same way the scalar code always did.  Unused lanes have face -1 and all
+// zeros, which no test accepts.
+struct TriangleBlock
+{
+	float	v0[3][ TRI_BLOCK_SIZE ];
+	float	e1[3][ TRI_BLOCK_SIZE ];
+	float	e2[3][ TRI_BLOCK_SIZE ];
+	float	area2[ TRI_BLOCK_SIZE ];
+	int		face[ TRI_BLOCK_SIZE ];
+};
+
+// Ray in the form the kernels want it.
+struct TriangleRay
+{
+	float	o[3];
+	float	d[3];
+};
+
+// Closest front facing hit in the block with RAY_EPSILON <= t < tMax.
+// Returns its lane, with t and the barycentric coordinates u (of e1) and
+// v (of e2), or -1 if there is none.
+typedef int (*TriangleBlockTest)( const TriangleBlock& b, const TriangleRay& r,
+	float tMax, float& t, float& u, float& v );
+
+enum TriangleKernel { TRI_KERNEL_SCALAR, TRI_KERNEL_SSE, TRI_KERNEL_AVX };
+
+// The fastest kernel this CPU runs.  Setting RAY_TRIANGLE_KERNEL to scalar,
+// sse or avx in the environment asks for a slower one instead, for
+// comparisons.
+TriangleKernel triangleKernel();
+const char* triangleKernelName( TriangleKernel k );
+
+// The test for triangleKernel(), looked up once.
+TriangleBlockTest triangleBlockTest();
+
+// Fill lane k of b, or clear it if face < 0.
+void setTriangle( TriangleBlock& b, int k, int face,
+	const float* a, const float* bv, const float* c );
+
+#endif // __TRIKERNEL_H__
@@ -1,6 +1,9 @@
 #include <cmath>
 #include <float.h>
+#include <cstring>
 #include "trimesh.h"
+#include "../scene/raystats.h"
+#include "../ThreadPool.h"
 
 Trimesh::~Trimesh()
 {
@@ -13,7 +16,9 @@ Trimesh::~Trimesh()
 // must add vertices, normals, and materials IN ORDER
 void Trimesh::addVertex( const vec3f &v )
 {
-    vertices.push_back( v );
+    positions.push_back( (float)v[0] );
+    positions.push_back( (float)v[1] );
+    positions.push_back( (float)v[2] );
 }
 
 void Trimesh::addMaterial( Material *m )
@@ -23,12 +28,21 @@ void Trimesh::addMaterial( Material *m )
 
 void Trimesh::addNormal( const vec3f &n )
 {
-    normals.push_back( n );
+    normals.push_back( (float)n[0] );
+    normals.push_back( (float)n[1] );
+    normals.push_back( (float)n[2] );
 }
 
-vector<TrimeshFace*> Trimesh::getFaces()
+void Trimesh::viewArrays( const float *p, int numVertices, const int *ids,
+                          int numFaces, const float *n )
 {
-	return this->faces;
+    positions.view( p, 3 * numVertices );
+    indices.view( ids, 3 * numFaces );
+    if( n )
+        normals.view( n, 3 * numVertices );
+    else
+        normals.view( 0, 0 );
+    haveTree = false;
 }
 
 bool Trimesh::getLocalUV(const ray & r, const isect & i, double & u, double & v) const
@@ -39,15 +53,15 @@ bool Trimesh::getLocalUV(const ray & r, const isect & i, double & u, double & v)
 // Returns false if the vertices a,b,c don't all exist
 bool Trimesh::addFace( int a, int b, int c )
 {
-    int vcnt = vertices.size();	//vertices count
+    int vcnt = numVertices();	//vertices count
 
-    if( a >= vcnt || b >= vcnt || c >= vcnt )
+    if( a < 0 || b < 0 || c < 0 || a >= vcnt || b >= vcnt || c >= vcnt )
         return false;
 
-    TrimeshFace *newFace = new TrimeshFace( scene, new Material(*this->material), this, a, b, c );
-    newFace->setTransform(this->transform);
-    faces.push_back( newFace );
-    scene->add(newFace);
+    indices.push_back( a );
+    indices.push_back( b );
+    indices.push_back( c );
+    haveTree = false;
     return true;
 }
 
@@ -55,155 +69,262 @@ char* Trimesh::doubleCheck()
 // Check to make sure that if we have per-vertex materials or normals
 // they are the right number.
 {
-    if( materials.size() && materials.size() != vertices.size() )
+    if( materials.size() && (int)materials.size() != numVertices() )
         return "Bad Trimesh: Wrong number of materials.";
-    if( normals.size() && normals.size() != vertices.size() )
+    if( normals.size() && normals.size() != positions.size() )
         return "Bad Trimesh: Wrong number of normals.";
 
     return 0;
 }
 
 bool Trimesh::doubleCheckTrueorFalse() {
-	if (materials.size() && materials.size() != vertices.size())
-		return false;
-	if (normals.size() && normals.size() != vertices.size())
-		return false;
-
-	return true;
-}
-
-// Intersect ray r with the triangle abc.  If it hits returns true,
-// and put the parameter in t and the barycentric coordinates of the
-// intersection in bary.
-// Uses the algorithm and notation from _Graphic Gems 5_, p. 232.
-//
-// Calculates and returns the normal of the triangle too.
-bool TrimeshFace::intersectLocal( const ray& r, isect& i ) const
-{
-    const vec3f& a = parent->vertices[ids[0]];		//vertex a
-    const vec3f& b = parent->vertices[ids[1]];		//vertex b
-    const vec3f& c = parent->vertices[ids[2]];		//vertex c
-    
-    vec3f bary;
-    float t;
-    vec3f n;
-    
-    vec3f p = r.getPosition();
-    vec3f v = r.getDirection();
-    
-    vec3f ab = b - a;
-    vec3f ac = c - a;
-    vec3f ap = p - a;
-    
-	vec3f cv=ab.cross(ac);
-
-	// there exists some bad triangles such that two vertices coincide
-	// check this before normalize
-	if (cv.iszero()) return false;
-    n = (cv).normalize();
-	
-    double vdotn = v*n;
-    if( -vdotn < NORMAL_EPSILON )
-        return false;
-    
-    t = - (ap*n)/vdotn;
-    
-    if( t < RAY_EPSILON )
-        return false;
+	return doubleCheck() == 0;
+}
+
+// Faces per piece of the parallel loops over a mesh
+static const int MESH_GRAIN = 1 << 13;
 
-    // find k where k is the index of the component
-    // of normal vector with greatest absolute value
-    float greatestMag = FLT_MIN;
-    int k = -1;
-    for( int j = 0; j < 3; ++j )
+BoundingBox Trimesh::buildTree( const float *positions, const int *indices,
+                                int numFaces, BVH &bvh, ThreadPool *pool )
+{
+    BoundingBox localbounds;
+    if( numFaces == 0 )
     {
-        float val = n[j];
-        if( val < 0 )
-            val *= -1;
-        if( val > greatestMag )
+        bvh.clear();
+        return localbounds;
+    }
+
+    vector<BoundingBox> boxes( numFaces );
+    ThreadPool::forRange( pool, numFaces, MESH_GRAIN, [&]( int begin, int end ) {
+        for( int f = begin; f < end; ++f )
         {
-            k = j;
-            greatestMag = val;
+            const float *p[3];
+            for( int k = 0; k < 3; ++k )
+                p[k] = &positions[ 3 * indices[3*f+k] ];
+            vec3f a( p[0][0], p[0][1], p[0][2] );
+            vec3f b( p[1][0], p[1][1], p[1][2] );
+            vec3f c( p[2][0], p[2][1], p[2][2] );
+            boxes[f].min = minimum( minimum( a, b ), c );
+            boxes[f].max = maximum( maximum( a, b ), c );
         }
+    } );
+
+    localbounds.min = boxes[0].min;
+    localbounds.max = boxes[0].max;
+    for( int f = 1; f < numFaces; ++f )
+    {
+        localbounds.min = minimum( localbounds.min, boxes[f].min );
+        localbounds.max = maximum( localbounds.max, boxes[f].max );
     }
 
-    vec3f am = ap + t * v;
-    
-	bary[1] = (am.cross(ac))[k]/(ab.cross(ac))[k];
-    bary[2] = (ab.cross(am))[k]/(ab.cross(ac))[k];
-    bary[0] = 1-bary[1]-bary[2];
-    if( bary[0] < 0 || bary[1] < 0 || bary[1] > 1 || bary[2] < 0 || bary[2] > 1 )
-        return false;
+    bvh.build( boxes, TRI_BLOCK_SIZE, pool );
+    return localbounds;
+}
 
-    // if we get this far, we have an intersection.  Fill in the info.
-    i.setT( t );
-    if(parent->normals.size())
-    {
-        // use interpolated normals
-        i.setN( (bary[0] * parent->normals[ids[0]]
-                 + bary[1] * parent->normals[ids[1]]
-                 + bary[2] * parent->normals[ids[2]]).normalize() );
-    } else {
-        i.setN( n );           // use face normal
+bool Trimesh::useTree( const BVHNode *nodes, int numNodes, const int *primitives,
+                       const vec3f &bmin, const vec3f &bmax )
+{
+    haveTree = numFaces() > 0 &&
+        bvh.assign( nodes, numNodes, primitives, numFaces(), TRI_BLOCK_SIZE );
+    treeBounds.min = bmin;
+    treeBounds.max = bmax;
+    return haveTree;
+}
 
-		
-    }
+BoundingBox Trimesh::ComputeLocalBoundingBox()
+{
+    ThreadPool *pool = scene->getThreadPool();
+    BoundingBox localbounds;
+    if( haveTree )
+        localbounds = treeBounds;
+    else
+        localbounds = buildTree( positions.data(), indices.data(), numFaces(), bvh, pool );
 
+    if( !bvh.empty() )
+        buildBlocks( pool );
+    return localbounds;
+}
 
-	////FLIP THE NORMAL IF NECESSARY
-	//if (r.getDirection().dot(i.N) > 0)
-	//	i.N *= -1.0;
+// Packs the faces of every BVH leaf into consecutive blocks.
+void Trimesh::buildBlocks( ThreadPool *pool )
+{
+    const vector<BVHNode>& nodes = bvh.getNodes();
+    const vector<int>& prims = bvh.getPrimitives();
 
+    blockTest = triangleBlockTest();
+    leafBlocks.assign( nodes.size(), -1 );
+    vector<int> leaves;
+    int nblocks = 0;
+    for( size_t n = 0; n < nodes.size(); ++n )
+    {
+        int count = nodes[n].count;
+        if( count == 0 )
+            continue;
 
-    i.obj = this;
+        leaves.push_back( n );
+        leafBlocks[n] = nblocks;
+        nblocks += (count + TRI_BLOCK_SIZE - 1) / TRI_BLOCK_SIZE;
+    }
+
+    blocks.assign( nblocks, TriangleBlock() );
+    ThreadPool::forRange( pool, leaves.size(), MESH_GRAIN / TRI_BLOCK_SIZE, [&]( int begin, int end ) {
+        for( int l = begin; l < end; ++l )
+        {
+            const BVHNode& node = nodes[ leaves[l] ];
+            TriangleBlock *block = &blocks[ leafBlocks[ leaves[l] ] ];
+            int padded = (node.count + TRI_BLOCK_SIZE - 1) / TRI_BLOCK_SIZE * TRI_BLOCK_SIZE;
+            for( int k = 0; k < padded; ++k )
+            {
+                int lane = k % TRI_BLOCK_SIZE;
+                if( k < node.count )
+                {
+                    int f = prims[ node.offset + k ];
+                    const int *ids = &indices[ 3 * f ];
+                    setTriangle( block[ k / TRI_BLOCK_SIZE ], lane, f, &positions[ 3 * ids[0] ],
+                                 &positions[ 3 * ids[1] ], &positions[ 3 * ids[2] ] );
+                } else {
+                    setTriangle( block[ k / TRI_BLOCK_SIZE ], lane, -1, 0, 0, 0 );
+                }
+            }
+        }
+    } );
+}
+
+bool Trimesh::intersectLeaf( int node, const TriangleRay& r, double& tMax,
+                             int& face, float& u, float& v, int& tests ) const
+{
+    int count = bvh.getNodes()[ node ].count;
+    int first = leafBlocks[ node ];
+    int last = first + (count + TRI_BLOCK_SIZE - 1) / TRI_BLOCK_SIZE;
+    tests += count;
 
-    // linearly interpolate materials
-    if( parent->materials.size() )
+    bool have_one = false;
+    for( int b = first; b < last; ++b )
     {
-        Material *m = new Material();
-        for( int jj = 0; jj < 3; ++jj )
-            (*m) += bary[jj] * (*parent->materials[ ids[jj] ]);
-        i.setMaterial( m );
+        float t;
+        float tf = tMax < FLT_MAX ? (float)tMax : FLT_MAX;
+        int lane = blockTest( blocks[b], r, tf, t, u, v );
+        if( lane >= 0 )
+        {
+            tMax = t;
+            face = blocks[b].face[ lane ];
+            have_one = true;
+        }
     }
-    
-    return true;
+    return have_one;
 }
 
-bool TrimeshFace::getLocalUV(const ray & r, const isect & i, double & u, double & v) const
+// BVH callback for Trimesh::intersectLocal: keeps the closest face hit.
+class ClosestFaceHit
 {
-	return false;
+public:
+	ClosestFaceHit( const Trimesh& mesh, const ray& r )
+		: face( -1 ), tests( 0 ), mesh( mesh )
+	{
+		vec3f p = r.getPosition();
+		vec3f d = r.getDirection();
+		for( int k = 0; k < 3; ++k ) {
+			tr.o[k] = (float)p[k];
+			tr.d[k] = (float)d[k];
+		}
+	}
+
+	bool operator()( int node, double& tMax )
+	{
+		return mesh.intersectLeaf( node, tr, tMax, face, u, v, tests );
+	}
+
+	int face;		// closest face so far, -1 for none
+	int tests;		// faces tried
+	float u, v;		// barycentric coordinates of the hit
+
+private:
+	const Trimesh& mesh;
+	TriangleRay tr;
+};
+
+bool Trimesh::intersectLocal( const ray& r, isect& i ) const
+{
+    ClosestFaceHit hit( *this, r );
+    double t = 1.0e308;
+    bool found = bvh.traverse( r, t, hit );
+    RayStats::forThread().intersectionTests += hit.tests;
+    if( !found )
+        return false;
+
+    const int *ids = &indices[ 3 * hit.face ];
+    vec3f bary( 1.0 - hit.u - hit.v, hit.u, hit.v );
+
+    // if we get this far, we have an intersection.  Fill in the info.
+    i.setT( t );
+    if( normals.size() )
+    {
+        // use interpolated normals
+        i.setN( (bary[0] * getNormal( ids[0] )
+                 + bary[1] * getNormal( ids[1] )
+                 + bary[2] * getNormal( ids[2] )).normalize() );
+    } else {
+        // use face normal
+        vec3f a = getVertex( ids[0] );
+        i.setN( ((getVertex( ids[1] ) - a).cross( getVertex( ids[2] ) - a )).normalize() );
+    }
+
+    i.obj = this;
+
+    // linearly interpolate materials, once someone asks for them
+    if( materials.size() )
+        i.setMaterials( materials[ ids[0] ], materials[ ids[1] ], materials[ ids[2] ], bary );
+    else
+        i.clearMaterials();
+
+    return true;
 }
 
 void Trimesh::generateNormals()
 // Once you've loaded all the verts and faces, we can generate per
 // vertex normals by averaging the normals of the neighboring faces.
+// The faces of every vertex are listed first, so the vertices can be
+// done in parallel and still add their faces up in the same order.
 {
-    int cnt = vertices.size();
-    normals.resize( cnt );
-    int *numFaces = new int[ cnt ]; // the number of faces assoc. with each vertex
-    memset( numFaces, 0, sizeof(int)*cnt );
-    
-    for( Faces::iterator fi = faces.begin(); fi != faces.end(); ++fi )
-    {
-        vec3f a = vertices[(**fi)[0]];
-        vec3f b = vertices[(**fi)[1]];
-        vec3f c = vertices[(**fi)[2]];
-        
-        vec3f faceNormal = ((b-a).cross(c-a)).normalize();
-        
-        for( int i = 0; i < 3; ++i )
+    int cnt = numVertices();
+    int nfaces = numFaces();
+    ThreadPool *pool = scene->getThreadPool();
+
+    vector<vec3f> faceNormals( nfaces );
+    ThreadPool::forRange( pool, nfaces, MESH_GRAIN, [&]( int begin, int end ) {
+        for( int f = begin; f < end; ++f )
         {
-            normals[(**fi)[i]] += faceNormal;
-            ++numFaces[(**fi)[i]];
+            vec3f a = getVertex( indices[3*f] );
+            vec3f b = getVertex( indices[3*f+1] );
+            vec3f c = getVertex( indices[3*f+2] );
+            faceNormals[f] = ((b-a).cross(c-a)).normalize();
         }
-    }
+    } );
 
-    for( int i = 0; i < cnt; ++i )
-    {
-        if( numFaces[i] )
-            normals[i]  /= numFaces[i];
-    }
+    // the faces of vertex v are vertexFaces[firstFace[v], firstFace[v+1])
+    vector<int> firstFace( cnt + 1, 0 );
+    for( size_t k = 0; k < indices.size(); ++k )
+        ++firstFace[ indices[k] + 1 ];
+    for( int v = 0; v < cnt; ++v )
+        firstFace[v + 1] += firstFace[v];
+    vector<int> vertexFaces( indices.size() );
+    vector<int> filled( firstFace.begin(), firstFace.end() - 1 );
+    for( size_t k = 0; k < indices.size(); ++k )
+        vertexFaces[ filled[ indices[k] ]++ ] = k / 3;
 
-    delete [] numFaces;
+    vector<float> result( 3 * cnt );
+    ThreadPool::forRange( pool, cnt, MESH_GRAIN, [&]( int begin, int end ) {
+        for( int v = begin; v < end; ++v )
+        {
+            vec3f sum;
+            int n = firstFace[v + 1] - firstFace[v];
+            for( int k = firstFace[v]; k < firstFace[v + 1]; ++k )
+                sum += faceNormals[ vertexFaces[k] ];
+            if( n )
+                sum /= n;
+            for( int i = 0; i < 3; ++i )
+                result[3*v+i] = (float)sum[i];
+        }
+    } );
+    normals.adopt( result );
 }
-
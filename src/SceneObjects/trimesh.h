@@ -7,84 +7,156 @@
 #include "../scene/ray.h"
 #include "../scene/material.h"
 #include "../scene/scene.h"
-class TrimeshFace;
+#include "../scene/bvh.h"
+#include "trikernel.h"
 
+// An array of a mesh: either its own, or a view of one that lives
+// elsewhere, e.g. in a memory-mapped binary scene, which must outlive it.
+// Changing a view makes it an array of its own first.
+template <typename T>
+class MeshArray
+{
+public:
+    MeshArray() : ptr( 0 ), count( 0 ) {}
+    MeshArray( const MeshArray& a ) : store( a.store ), ptr( a.ptr ), count( a.count )
+    {
+        if( a.ptr == a.store.data() )
+            ptr = store.data();
+    }
+
+    size_t size() const { return count; }
+    bool empty() const { return count == 0; }
+    const T& operator[]( size_t k ) const { return ptr[k]; }
+    const T* data() const { return ptr; }
+
+    void push_back( const T& v )
+    {
+        own();
+        store.push_back( v );
+        sync();
+    }
+    // take over the contents of v, leaving it empty
+    void adopt( vector<T>& v )
+    {
+        store.clear();
+        store.swap( v );
+        sync();
+    }
+    void view( const T* data, size_t n )
+    {
+        vector<T>().swap( store );
+        ptr = data;
+        count = n;
+    }
+
+private:
+    MeshArray& operator=( const MeshArray& );
+
+    void own()
+    {
+        if( ptr != store.data() )
+            store.assign( ptr, ptr + count );
+    }
+    void sync()
+    {
+        ptr = store.data();
+        count = store.size();
+    }
+
+    vector<T> store;
+    const T* ptr;
+    size_t count;
+};
+
+// A triangle mesh stored as flat arrays: positions and normals as float
+// triples, faces as index triples.  The mesh is one object in the scene;
+// a ray is transformed into its space once and then walks the mesh's own
+// BVH over the triangles.  The triangles of every BVH leaf are also kept
+// in TriangleBlocks, so a leaf is tested eight faces at a time (see
+// trikernel.h).  All faces share the mesh's material.
 class Trimesh : public MaterialSceneObject
 {
-    friend class TrimeshFace;
-    typedef vector<vec3f> Normals;
-    typedef vector<vec3f> Vertices;
-    typedef vector<TrimeshFace*> Faces;
     typedef vector<Material*> Materials;
-    Vertices vertices;	//vector of all vertices
-    Faces faces;	//vector of TrimeshFace* s
-    Normals normals;	//vector of normals
-    Materials materials;	//vector of Material* s
+    MeshArray<float> positions;	//3 floats per vertex
+    MeshArray<float> normals;	//3 floats per vertex, or empty
+    MeshArray<int> indices;	//3 vertex ids per face
+    Materials materials;	//vector of Material* s, one per vertex or none
+    BVH bvh;	//over the faces, in local coordinates
+    vector<TriangleBlock> blocks;	//the faces of every leaf, in leaf order
+    vector<int> leafBlocks;	//per BVH node: first block of a leaf, -1 for interior nodes
+    TriangleBlockTest blockTest;
+    bool haveTree;	//bvh was handed over by useTree
+    BoundingBox treeBounds;	//and these are the bounds of the faces
 public:
     Trimesh( Scene *scene, Material *mat, TransformNode *transform )
-        : MaterialSceneObject(scene, mat)
+        : MaterialSceneObject(scene, mat), blockTest( 0 ), haveTree( false )
     {
         this->transform = transform;
     }
 
     ~Trimesh();
-    
+
     // must add vertices, normals, and materials IN ORDER
     void addVertex( const vec3f & );	//vertices first
     void addMaterial( Material *m );	//materials second
     void addNormal( const vec3f & );	//normals third
-	
-	vector<TrimeshFace*> getFaces();
-	
-	virtual bool getLocalUV(const ray& r, const isect& i, double& u, double& v) const;	// returns true only if this sceneobject supports texture mapping
 
+    // Use the arrays where they are instead, e.g. in a mapped binary
+    // scene; they must stay there for as long as the mesh does.  normals
+    // may be NULL.  The faces are not checked.
+    void viewArrays( const float *positions, int numVertices, const int *indices,
+                     int numFaces, const float *normals );
 
-    bool addFace( int a, int b, int c );
+    // Use this BVH over the faces instead of building one, e.g. the one a
+    // binary scene keeps with the arrays; bmin and bmax are the bounds of
+    // the faces.  Returns false if it is no tree over the faces.  Call it
+    // after the faces are in.
+    bool useTree( const BVHNode *nodes, int numNodes, const int *primitives,
+                  const vec3f &bmin, const vec3f &bmax );
 
-    char *doubleCheck();
+    // The BVH every mesh builds over its faces, and the bounds of the faces.
+    static BoundingBox buildTree( const float *positions, const int *indices,
+                                  int numFaces, BVH &bvh, ThreadPool *pool );
 
-	bool doubleCheckTrueorFalse();	//my version of doubleCheck. I think it's better.
-    
-    void generateNormals();
-};
+    int numVertices() const { return positions.size() / 3; }
+    int numFaces() const { return indices.size() / 3; }
 
-class TrimeshFace : public MaterialSceneObject
-{
-    Trimesh *parent;
-    int ids[3];
-public:
-    TrimeshFace( Scene *scene, Material *mat, Trimesh *parent, int a, int b, int c)
-        : MaterialSceneObject( scene, mat )
+    vec3f getVertex( int v ) const
     {
-        this->parent = parent;
-        ids[0] = a;
-        ids[1] = b;
-        ids[2] = c;
+        return vec3f( positions[3*v], positions[3*v+1], positions[3*v+2] );
     }
-
-    int operator[]( int i ) const
+    vec3f getNormal( int v ) const
     {
-        return ids[i];
+        return vec3f( normals[3*v], normals[3*v+1], normals[3*v+2] );
     }
 
-    virtual bool intersectLocal( const ray& r, isect& i ) const;
+	virtual bool getLocalUV(const ray& r, const isect& i, double& u, double& v) const;	// returns true only if this sceneobject supports texture mapping
+
+    bool addFace( int a, int b, int c );
+
+    char *doubleCheck();
+
+	bool doubleCheckTrueorFalse();	//my version of doubleCheck. I think it's better.
 
+    void generateNormals();
+
+    virtual bool intersectLocal( const ray& r, isect& i ) const;
     virtual bool hasBoundingBoxCapability() const { return true; }
-	virtual bool getLocalUV(const ray& r, const isect& i, double& u, double& v) const;	// returns true only if this sceneobject supports texture mapping
 
-      
-    virtual BoundingBox ComputeLocalBoundingBox()
-    {
-        BoundingBox localbounds;
-        localbounds.max = maximum( parent->vertices[ids[0]], parent->vertices[ids[1]]);
-		localbounds.min = minimum( parent->vertices[ids[0]], parent->vertices[ids[1]]);
-        
-        localbounds.max = maximum( parent->vertices[ids[2]], localbounds.max);
-		localbounds.min = minimum( parent->vertices[ids[2]], localbounds.min);
-        return localbounds;
-    }
-    
-};
+    // Called by Scene::initScene once the mesh is complete; also builds the
+    // BVH and the blocks over the faces, so don't add faces after that.
+    // Runs on the scene's thread pool, if it has one, as does
+    // generateNormals.
+    virtual BoundingBox ComputeLocalBoundingBox();
+
+    // Intersect the local ray r with the faces of BVH leaf node.  On a hit
+    // closer than tMax, tMax, the face and its barycentric coordinates u
+    // and v are updated.  tests counts the faces tried.
+    bool intersectLeaf( int node, const TriangleRay& r, double& tMax,
+                        int& face, float& u, float& v, int& tests ) const;
 
+private:
+    void buildBlocks( ThreadPool *pool );
+};
 
 #endif // TRIMESH_H__
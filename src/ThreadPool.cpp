@@ -0,0 +1,160 @@
+#include "ThreadPool.h"
+
+// the pool the current thread works for, if any, and its number there
+static thread_local ThreadPool* workerPool = NULL;
+static thread_local int workerId = -1;
+
+int ThreadPool::hardwareThreads()
+{
+	int n = (int)std::thread::hardware_concurrency();
+	return n > 0 ? n : 1;
+}
+
+ThreadPool::ThreadPool( int numThreads )
+	: generation( 0 ), quit( false )
+{
+	numWorkers = numThreads > 0 ? numThreads : hardwareThreads();
+
+	for( int i = 0; i < numWorkers; ++i )
+		workers.push_back( new Worker );
+	for( int i = 0; i < numWorkers; ++i )
+		threads.push_back( std::thread( &ThreadPool::workerLoop, this, i ) );
+}
+
+ThreadPool::~ThreadPool()
+{
+	{
+		std::unique_lock<std::mutex> guard( jobLock );
+		quit = true;
+	}
+	jobReady.notify_all();
+
+	for( size_t i = 0; i < threads.size(); ++i )
+		threads[i].join();
+	for( size_t i = 0; i < workers.size(); ++i )
+		delete workers[i];
+}
+
+void ThreadPool::run( int count, const std::function<void(int)>& task )
+{
+	if( count <= 0 )
+		return;
+
+	Job job;
+	job.task = &task;
+	job.pending = count;
+
+	// deal the indices out in contiguous runs, one per worker
+	for( int w = 0; w < numWorkers; ++w ) {
+		int begin = (int)( (long long)count * w / numWorkers );
+		int end = (int)( (long long)count * (w + 1) / numWorkers );
+		std::unique_lock<std::mutex> guard( workers[w]->lock );
+		for( int i = begin; i < end; ++i ) {
+			Task t = { &job, i };
+			workers[w]->tasks.push_back( t );
+		}
+	}
+
+	{
+		std::unique_lock<std::mutex> guard( jobLock );
+		++generation;
+	}
+	jobReady.notify_all();
+
+	if( workerPool == this ) {
+		// called from a task: work on whatever is queued until the job is
+		// done, rather than tie up this thread waiting
+		int self = workerId;
+		Task t;
+		while( job.pending > 0 ) {
+			if( popTask( self, t ) )
+				execute( t );
+			else
+				std::this_thread::yield();
+		}
+		return;
+	}
+
+	std::unique_lock<std::mutex> guard( jobLock );
+	while( job.pending > 0 )
+		jobDone.wait( guard );
+}
+
+void ThreadPool::forRange( ThreadPool* pool, int count, int grain,
+	const std::function<void(int, int)>& body )
+{
+	if( count <= 0 )
+		return;
+	if( grain < 1 )
+		grain = 1;
+
+	int pieces = (count + grain - 1) / grain;
+	if( !pool || pieces == 1 ) {
+		for( int p = 0; p < pieces; ++p )
+			body( p * grain, p == pieces - 1 ? count : (p + 1) * grain );
+		return;
+	}
+
+	pool->run( pieces, [&]( int p ) {
+		body( p * grain, p == pieces - 1 ? count : (p + 1) * grain );
+	} );
+}
+
+// Take the next task for worker id: its own queue first, then steal.
+bool ThreadPool::popTask( int id, Task& task )
+{
+	{
+		std::unique_lock<std::mutex> guard( workers[id]->lock );
+		if( !workers[id]->tasks.empty() ) {
+			task = workers[id]->tasks.front();
+			workers[id]->tasks.pop_front();
+			return true;
+		}
+	}
+
+	for( int k = 1; k < numWorkers; ++k ) {
+		Worker* victim = workers[ (id + k) % numWorkers ];
+		std::unique_lock<std::mutex> guard( victim->lock );
+		if( !victim->tasks.empty() ) {
+			task = victim->tasks.back();
+			victim->tasks.pop_back();
+			return true;
+		}
+	}
+
+	return false;
+}
+
+void ThreadPool::execute( const Task& task )
+{
+	(*task.job->task)( task.index );
+
+	// the job lives in its run(), which may return as soon as pending is
+	// 0, so it mustn't be touched after that
+	if( --task.job->pending == 0 ) {
+		std::unique_lock<std::mutex> guard( jobLock );
+		jobDone.notify_all();
+	}
+}
+
+void ThreadPool::workerLoop( int id )
+{
+	workerPool = this;
+	workerId = id;
+	unsigned int seen = 0;
+
+	while( true ) {
+		{
+			std::unique_lock<std::mutex> guard( jobLock );
+			while( !quit && generation == seen )
+				jobReady.wait( guard );
+			if( quit )
+				return;
+			seen = generation;
+		}
+
+		Task task;
+		while( popTask( id, task ) )
+			execute( task );
+	}
+}
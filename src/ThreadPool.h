@@ -0,0 +1,78 @@
+#ifndef __THREADPOOL_H__
+#define __THREADPOOL_H__
+
+// A small work-stealing thread pool.  Every worker owns a queue of tasks;
+// it takes work from the front of its own queue and, once that runs dry,
+// steals from the back of another worker's queue.  The threads are started
+// once and sleep between jobs.
+//
+// A task may run() a job of its own on the same pool, e.g. a mesh that
+// builds its BVH in parallel while the scene sets up its objects in
+// parallel.  The worker then helps with the tasks until its job is done,
+// instead of blocking one of the threads.
+
+#include <vector>
+#include <deque>
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+
+class ThreadPool
+{
+public:
+	// numThreads <= 0 means one thread per hardware core.
+	ThreadPool( int numThreads );
+	~ThreadPool();
+
+	int size() const { return numWorkers; }
+
+	// Run task( i ) for every i in [0, count) and return once all of them
+	// have finished.  Tasks are handed out in contiguous runs, so neighbouring
+	// indices tend to end up on the same thread.
+	void run( int count, const std::function<void(int)>& task );
+
+	// body( begin, end ) for pieces of [0, count) of grain indices each, on
+	// pool, or right here if pool is NULL.  The pieces are the same for any
+	// number of threads, so a result put together piece by piece is too.
+	static void forRange( ThreadPool* pool, int count, int grain,
+		const std::function<void(int, int)>& body );
+
+	static int hardwareThreads();
+
+private:
+	struct Job
+	{
+		const std::function<void(int)>* task;
+		std::atomic<int> pending;		// tasks not finished yet
+	};
+
+	struct Task
+	{
+		Job*	job;
+		int		index;
+	};
+
+	struct Worker
+	{
+		std::mutex			lock;
+		std::deque<Task>	tasks;
+	};
+
+	void workerLoop( int id );
+	bool popTask( int id, Task& task );
+	void execute( const Task& task );
+
+	int numWorkers;
+	std::vector<Worker*> workers;
+	std::vector<std::thread> threads;
+
+	std::mutex jobLock;
+	std::condition_variable jobReady;
+	std::condition_variable jobDone;
+	unsigned int generation;		// bumped for every run(), wakes the workers
+	bool quit;
+};
+
+#endif // __THREADPOOL_H__
@@ -0,0 +1,369 @@
+//
+// benchmark.cpp
+//
+// Renders a fixed set of the sample scenes at fixed settings and reports,
+// per scene, the wall time, the rays shot, rays per second, intersection
+// tests per ray, heap allocations per ray and the most heap the scene had
+// in use at once, as JSON.  Given the JSON of an earlier run (-b), it also
+// flags the scenes that got slower or started doing more intersection tests
+// or allocations per ray, and exits with 1 if any did.
+//
+// bench/baseline.json is the output of a default run.  The times in it only
+// mean something on the machine that wrote it, so rewrite it (-o) on your
+// own machine before comparing; the ray and test counts don't depend on it.
+//
+// usage: ray-bench [-w <#>] [-n <#>] [-i <#>] [-d <dir>] [-b baseline.json]
+//                  [-x <tolerance>] [-o out.json]
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <chrono>
+#include <string>
+#include <vector>
+#include <fstream>
+#include <sstream>
+#include <atomic>
+#include <new>
+
+#include "RayTracer.h"
+#include "scene/raystats.h"
+
+extern int getopt(int argc, char **argv, char *optstring);
+extern char* optarg;
+extern int optind, opterr, optopt;
+
+#ifndef RAY_SAMPLES_DIR
+#define RAY_SAMPLES_DIR "simpleSamples"
+#endif
+
+// One benchmark case: a scene file and the render options it is run with.
+struct BenchCase
+{
+	const char* name;		// reported name, unique
+	const char* file;		// in the samples directory
+	const char* options;	// space separated name=value pairs for RenderSettings
+};
+
+static const BenchCase cases[] = {
+	{ "box",				"box.ray",							"depth=2" },
+	{ "cone",				"cone.ray",							"depth=2" },
+	{ "cylinder",			"cylinder.ray",						"depth=2" },
+	{ "cube_trimesh",		"cube.ray",							"depth=2" },
+	{ "recurse_depth",		"recurse_depth.ray",				"depth=5" },
+	{ "box_cyl_reflect",	"box_cyl_reflect.ray",				"depth=3" },
+	{ "transp_shadow",		"box_cyl_transp_shadow.ray",		"depth=3" },
+	{ "sphere_refract",		"sphere_refract.ray",				"depth=5" },
+	{ "overlapping",		"Test_Overlapping_Objects.ray",		"depth=3" },
+	{ "antialiasing",		"box_cyl_reflect.ray",				"depth=3 aa=1 subpixels=3" },
+	{ "adaptive_aa",		"box_cyl_reflect.ray",				"depth=3 aa=1 adaptive=1" },
+	{ "soft_shadow",		"cylinder_test_soft_shadow.ray",	"depth=1 softshadow=1" },
+	{ "area_lights",		"area_lights.ray",					"depth=1" },
+	{ "depth_of_field",		"sphere_test_depthofField.ray",		"depth=1 dof=1 focal=2 aperture=0.5" },
+	{ "glossy",				"test_Glossy_Refection.ray",		"depth=1 glossy=1" },
+};
+
+// Every operator new of the process, on any thread, is counted here; this
+// file replaces the global one.  Rendering should do next to none: a
+// handful per frame for the thread pool and the first packet of a thread,
+// none per ray.
+static std::atomic<unsigned long long> heapAllocations( 0 );
+
+// The bytes held through operator new, and the most held at once since
+// runCase last lowered it to what was held then.  Each block carries its
+// size in front of it, so delete knows what it gives back; the header is
+// 16 bytes so the block stays aligned for the SSE vectors.
+static std::atomic<size_t> heapInUse( 0 );
+static std::atomic<size_t> heapPeak( 0 );
+static const size_t HEAP_HEADER = 16;
+
+void* operator new( size_t size )
+{
+	heapAllocations.fetch_add( 1, std::memory_order_relaxed );
+	char* p = (char*)malloc( HEAP_HEADER + size );
+	if( !p )
+		throw std::bad_alloc();
+	*(size_t*)p = size;
+
+	size_t inUse = heapInUse.fetch_add( size, std::memory_order_relaxed ) + size;
+	size_t peak = heapPeak.load( std::memory_order_relaxed );
+	while( inUse > peak && !heapPeak.compare_exchange_weak( peak, inUse, std::memory_order_relaxed ) )
+		;
+	return p + HEAP_HEADER;
+}
+
+void* operator new[]( size_t size )
+{
+	return operator new( size );
+}
+
+void operator delete( void* p ) noexcept
+{
+	if( !p )
+		return;
+	char* block = (char*)p - HEAP_HEADER;
+	heapInUse.fetch_sub( *(size_t*)block, std::memory_order_relaxed );
+	free( block );
+}
+
+void operator delete[]( void* p ) noexcept
+{
+	operator delete( p );
+}
+
+void operator delete( void* p, size_t ) noexcept
+{
+	operator delete( p );
+}
+
+void operator delete[]( void* p, size_t ) noexcept
+{
+	operator delete( p );
+}
+
+struct BenchResult
+{
+	std::string name;
+	double wallTime;			// seconds, best of the iterations
+	RayStats rays;				// of one iteration
+	double raysPerSec;
+	double testsPerRay;
+	unsigned long long allocations;	// of one iteration
+	double allocationsPerRay;
+	long peakHeapKB;			// most held at once, loading and rendering
+};
+
+static bool applyOptions( RenderSettings& s, const char* options )
+{
+	std::istringstream is( options );
+	std::string opt;
+	while( is >> opt )
+		if( !s.parse( opt.c_str() ) )
+			return false;
+	return true;
+}
+
+static bool runCase( const BenchCase& c, const std::string& dir, int width, int threads,
+	int iterations, BenchResult& result )
+{
+	RenderSettings settings;
+	if( !applyOptions( settings, c.options ) ) {
+		fprintf( stderr, "%s: bad options \"%s\"\n", c.name, c.options );
+		return false;
+	}
+
+	// only this case's own heap counts, not what the earlier ones left
+	size_t heapBefore = heapInUse.load();
+	heapPeak.store( heapBefore );
+
+	std::string path = dir + "/" + c.file;
+	std::vector<char> fn( path.begin(), path.end() );
+	fn.push_back( '\0' );
+
+	RayTracer tracer;
+	tracer.setThreads( threads );
+	tracer.setSettings( settings );
+	if( !tracer.loadScene( &fn[0] ) ) {
+		fprintf( stderr, "%s: couldn't load %s\n", c.name, path.c_str() );
+		return false;
+	}
+
+	int height = (int)( width / tracer.aspectRatio() + 0.5 );
+	tracer.traceSetup( width, height );
+
+	result.name = c.name;
+	result.wallTime = 0.0;
+	for( int it = 0; it < iterations; ++it ) {
+		tracer.traceSetup( width, height );
+		RayStats::reset();
+
+		unsigned long long allocsBefore = heapAllocations.load();
+		std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+		tracer.traceTiles( 0, height );
+		std::chrono::steady_clock::time_point end = std::chrono::steady_clock::now();
+		result.allocations = heapAllocations.load() - allocsBefore;
+
+		double t = std::chrono::duration<double>( end - start ).count();
+		if( it == 0 || t < result.wallTime )
+			result.wallTime = t;
+		result.rays = RayStats::total();
+	}
+
+	unsigned long long rays = result.rays.totalRays();
+	result.raysPerSec = result.wallTime > 0.0 ? rays / result.wallTime : 0.0;
+	result.testsPerRay = rays ? (double)result.rays.intersectionTests / rays : 0.0;
+	result.allocationsPerRay = rays ? (double)result.allocations / rays : 0.0;
+	result.peakHeapKB = (long)((heapPeak.load() - heapBefore) / 1024);
+	return true;
+}
+
+static void writeJSON( FILE* f, const std::vector<BenchResult>& results, int width, int threads )
+{
+	fprintf( f, "{\n" );
+	fprintf( f, "  \"width\": %d,\n", width );
+	fprintf( f, "  \"threads\": %d,\n", threads );
+#ifdef RAY_SIMD_VECMATH
+	fprintf( f, "  \"vecmath\": \"float-sse\",\n" );
+#else
+	fprintf( f, "  \"vecmath\": \"double\",\n" );
+#endif
+	fprintf( f, "  \"scenes\": [\n" );
+	for( size_t i = 0; i < results.size(); ++i ) {
+		const BenchResult& r = results[i];
+		fprintf( f, "    {\n" );
+		fprintf( f, "      \"scene\": \"%s\",\n", r.name.c_str() );
+		fprintf( f, "      \"wall_time\": %.6f,\n", r.wallTime );
+		fprintf( f, "      \"primary_rays\": %llu,\n", r.rays.primaryRays );
+		fprintf( f, "      \"secondary_rays\": %llu,\n", r.rays.secondaryRays );
+		fprintf( f, "      \"shadow_rays\": %llu,\n", r.rays.shadowRays );
+		fprintf( f, "      \"intersection_tests\": %llu,\n", r.rays.intersectionTests );
+		fprintf( f, "      \"rays_per_sec\": %.1f,\n", r.raysPerSec );
+		fprintf( f, "      \"intersection_tests_per_ray\": %.4f,\n", r.testsPerRay );
+		fprintf( f, "      \"heap_allocations\": %llu,\n", r.allocations );
+		fprintf( f, "      \"heap_allocations_per_ray\": %.6f,\n", r.allocationsPerRay );
+		fprintf( f, "      \"peak_heap_kb\": %ld\n", r.peakHeapKB );
+		fprintf( f, "    }%s\n", i + 1 < results.size() ? "," : "" );
+	}
+	fprintf( f, "  ]\n" );
+	fprintf( f, "}\n" );
+}
+
+// Just enough JSON reading for files written by writeJSON: find the object
+// of the named scene and pull a number out of it.
+static bool findSceneNumber( const std::string& json, const std::string& scene,
+	const char* key, double& value )
+{
+	std::string tag = "\"scene\": \"" + scene + "\"";
+	size_t begin = json.find( tag );
+	if( begin == std::string::npos )
+		return false;
+	size_t end = json.find( '}', begin );
+
+	std::string k = std::string( "\"" ) + key + "\":";
+	size_t at = json.find( k, begin );
+	if( at == std::string::npos || at > end )
+		return false;
+
+	value = strtod( json.c_str() + at + k.size(), NULL );
+	return true;
+}
+
+// Returns the number of regressions.
+static int compareBaseline( const std::string& json, const std::vector<BenchResult>& results,
+	double tolerance )
+{
+	int regressions = 0;
+
+	fprintf( stderr, "%-18s %12s %12s %8s %10s %10s\n",
+		"scene", "time", "baseline", "change", "tests/ray", "baseline" );
+
+	for( size_t i = 0; i < results.size(); ++i ) {
+		const BenchResult& r = results[i];
+		double baseTime, baseTests, baseAllocs;
+		if( !findSceneNumber( json, r.name, "wall_time", baseTime ) ||
+			!findSceneNumber( json, r.name, "intersection_tests_per_ray", baseTests ) ) {
+			fprintf( stderr, "%-18s %12.4f %12s\n", r.name.c_str(), r.wallTime, "(new)" );
+			continue;
+		}
+
+		double change = baseTime > 0.0 ? r.wallTime / baseTime - 1.0 : 0.0;
+		const char* verdict = "";
+		if( change > tolerance ) {
+			verdict = "  SLOWER";
+			++regressions;
+		} else if( r.testsPerRay > baseTests * (1.0 + tolerance) + 1e-9 ) {
+			verdict = "  MORE TESTS";
+			++regressions;
+		} else if( findSceneNumber( json, r.name, "heap_allocations_per_ray", baseAllocs ) &&
+			r.allocationsPerRay > baseAllocs * (1.0 + tolerance) + 1e-3 ) {
+			verdict = "  MORE ALLOCS";
+			++regressions;
+		}
+
+		fprintf( stderr, "%-18s %12.4f %12.4f %+7.1f%% %10.3f %10.3f%s\n", r.name.c_str(),
+			r.wallTime, baseTime, change * 100.0, r.testsPerRay, baseTests, verdict );
+	}
+
+	return regressions;
+}
+
+static void usage( const char* progname )
+{
+	fprintf( stderr, "usage: %s [options]\n", progname );
+	fprintf( stderr, "  -w <#>      image width (default 150)\n" );
+	fprintf( stderr, "  -n <#>      render threads (default 1, 0 = one per core)\n" );
+	fprintf( stderr, "  -i <#>      iterations per scene, the fastest one counts (default 3)\n" );
+	fprintf( stderr, "  -d <dir>    directory of the sample scenes (default %s)\n", RAY_SAMPLES_DIR );
+	fprintf( stderr, "  -b <file>   compare against this earlier output\n" );
+	fprintf( stderr, "  -x <#>      allowed slowdown against the baseline (default 0.10)\n" );
+	fprintf( stderr, "  -o <file>   write the JSON here instead of to stdout\n" );
+}
+
+int main( int argc, char **argv )
+{
+	int width = 150;
+	int threads = 1;
+	int iterations = 3;
+	double tolerance = 0.10;
+	std::string dir = RAY_SAMPLES_DIR;
+	const char* baselineName = NULL;
+	const char* outName = NULL;
+
+	int c;
+	while( (c = getopt( argc, argv, (char*)"w:n:i:d:b:x:o:" )) != EOF ) {
+		switch( c ) {
+		case 'w': width = atoi( optarg ); break;
+		case 'n': threads = atoi( optarg ); break;
+		case 'i': iterations = atoi( optarg ); break;
+		case 'd': dir = optarg; break;
+		case 'b': baselineName = optarg; break;
+		case 'x': tolerance = atof( optarg ); break;
+		case 'o': outName = optarg; break;
+		default:
+			usage( argv[0] );
+			return 2;
+		}
+	}
+	if( width <= 0 || iterations <= 0 ) {
+		usage( argv[0] );
+		return 2;
+	}
+
+	std::vector<BenchResult> results;
+	int n = sizeof( cases ) / sizeof( cases[0] );
+	for( int i = 0; i < n; ++i ) {
+		BenchResult r;
+		if( !runCase( cases[i], dir, width, threads, iterations, r ) )
+			return 2;
+		fprintf( stderr, "%-18s %8.4f s %12.0f rays/s\n", r.name.c_str(), r.wallTime, r.raysPerSec );
+		results.push_back( r );
+	}
+
+	FILE* out = stdout;
+	if( outName && !(out = fopen( outName, "w" )) ) {
+		fprintf( stderr, "couldn't write %s\n", outName );
+		return 2;
+	}
+	writeJSON( out, results, width, threads );
+	if( out != stdout )
+		fclose( out );
+
+	if( baselineName ) {
+		std::ifstream ifs( baselineName );
+		if( !ifs ) {
+			fprintf( stderr, "couldn't read baseline %s\n", baselineName );
+			return 2;
+		}
+		std::stringstream ss;
+		ss << ifs.rdbuf();
+
+		int regressions = compareBaseline( ss.str(), results, tolerance );
+		if( regressions ) {
+			fprintf( stderr, "%d regression(s) against %s\n", regressions, baselineName );
+			return 1;
+		}
+	}
+
+	return 0;
+}
@@ -0,0 +1,51 @@
+//
+// convert.cpp
+//
+// Turns a .ray file into a binary scene (see fileio/binscene.h), which
+// ray-cli and the GUI load like any other scene file, only with the meshes
+// mapped straight from the file instead of parsed, and their BVHs already
+// built.
+//
+// usage: ray-convert input.ray output.rayb
+//
+
+#include <stdio.h>
+#include <fstream>
+
+#include "fileio/binscene.h"
+#include "fileio/parse.h"
+#include "ThreadPool.h"
+
+int main( int argc, char **argv )
+{
+	if( argc != 3 ) {
+		fprintf( stderr, "usage: %s input.ray output.rayb\n", argv[0] );
+		return 1;
+	}
+
+	std::ifstream in( argv[1] );
+	if( !in ) {
+		fprintf( stderr, "can't read %s\n", argv[1] );
+		return 1;
+	}
+	std::ofstream out( argv[2], std::ios::binary );
+	if( !out ) {
+		fprintf( stderr, "can't write %s\n", argv[2] );
+		return 1;
+	}
+
+	try {
+		ThreadPool pool( ThreadPool::hardwareThreads() );
+		writeBinaryScene( in, out, &pool );
+	} catch( ParseError& pe ) {
+		cerr << "Parse error: " << pe << endl;
+		return 1;
+	}
+
+	out.close();
+	if( !out ) {
+		fprintf( stderr, "couldn't write all of %s\n", argv[2] );
+		return 1;
+	}
+	return 0;
+}
@@ -0,0 +1,406 @@
+#include <limits.h>
+#include <stdio.h>
+#include <string.h>
+#include <sstream>
+#include <vector>
+
+#include "binscene.h"
+#include "parse.h"
+#include "read.h"
+#include "../SceneObjects/trimesh.h"
+
+BinaryScene::BinaryScene( const std::string& filename )
+{
+	if( !file.open( filename ) )
+		throw ParseError( string( "Can't map binary scene " ) + filename );
+	check();
+}
+
+BinaryScene::BinaryScene( std::istream& is )
+{
+	std::ostringstream bytes;
+	bytes << is.rdbuf();
+	std::string data = bytes.str();
+	file.adopt( data );
+	check();
+}
+
+bool BinaryScene::isBinary( const char* head, size_t size )
+{
+	return size >= 8 && !memcmp( head, BINARY_SCENE_MAGIC, 8 );
+}
+
+// true if [offset, offset + count * size) lies inside a file of length bytes
+static bool inside( uint64_t offset, uint64_t count, uint64_t size, size_t length )
+{
+	return offset <= length && count <= (length - offset) / size;
+}
+
+void BinaryScene::check()
+{
+	if( file.size() < sizeof( header ) || !isBinary( file.data(), file.size() ) )
+		throw ParseError( "Not a binary scene." );
+	memcpy( &header, file.data(), sizeof( header ) );
+
+	if( header.byteOrder != BINARY_SCENE_BYTE_ORDER )
+		throw ParseError( "Binary scene written with the other byte order." );
+	if( header.version < 1 || header.version > BINARY_SCENE_VERSION )
+		throw ParseError( "Unknown binary scene version." );
+	if( !inside( header.textOffset, header.textSize, 1, file.size() ) ||
+		!inside( header.meshOffset, header.meshCount, sizeof( BinaryMesh ), file.size() ) ||
+		(header.version >= 2 && !inside( header.meshOffset + header.meshCount * sizeof( BinaryMesh ),
+			header.meshCount, sizeof( BinaryMeshTree ), file.size() )) )
+		throw ParseError( "Binary scene is cut short." );
+}
+
+void BinaryScene::readMesh( int n, BinaryMesh& m ) const
+{
+	if( n < 0 || n >= numMeshes() )
+		throw ParseError( "Bad mesh number in binary scene." );
+	memcpy( &m, file.data() + header.meshOffset + n * sizeof( BinaryMesh ), sizeof( m ) );
+}
+
+std::string BinaryScene::getText() const
+{
+	return std::string( file.data() + header.textOffset, (size_t)header.textSize );
+}
+
+void BinaryScene::getMesh( int n, const float*& positions, int& numVertices,
+	const int*& indices, int& numFaces, const float*& normals ) const
+{
+	BinaryMesh m;
+	readMesh( n, m );
+
+	// the arrays are used where they are, so they have to be aligned
+	if( m.numVertices > INT_MAX / 3 || m.numFaces > INT_MAX / 3 ||
+		m.positions % 4 || m.indices % 4 || m.normals % 4 ||
+		!inside( m.positions, 3 * (uint64_t)m.numVertices, sizeof( float ), file.size() ) ||
+		!inside( m.indices, 3 * (uint64_t)m.numFaces, sizeof( int ), file.size() ) ||
+		(m.normals && !inside( m.normals, 3 * (uint64_t)m.numVertices, sizeof( float ), file.size() )) )
+		throw ParseError( "Bad mesh in binary scene." );
+
+	positions = (const float*)(file.data() + m.positions);
+	indices = (const int*)(file.data() + m.indices);
+	normals = m.normals ? (const float*)(file.data() + m.normals) : NULL;
+	numVertices = (int)m.numVertices;
+	numFaces = (int)m.numFaces;
+
+	for( int k = 0; k < 3 * numFaces; ++k )
+		if( indices[k] < 0 || indices[k] >= numVertices )
+			throw ParseError( "Bad face in trimesh." );
+}
+
+bool BinaryScene::getTree( int n, const BVHNode*& nodes, int& numNodes, const int*& primitives,
+	int& leafBatch, vec3f& bmin, vec3f& bmax ) const
+{
+	BinaryMesh m;
+	readMesh( n, m );
+	if( header.version < 2 )
+		return false;
+
+	BinaryMeshTree t;
+	memcpy( &t, file.data() + header.meshOffset + header.meshCount * sizeof( BinaryMesh )
+		+ n * sizeof( BinaryMeshTree ), sizeof( t ) );
+	if( !t.nodes )
+		return false;
+	if( t.numNodes > INT_MAX || t.nodes % 4 || t.primitives % 4 ||
+		!inside( t.nodes, t.numNodes, sizeof( BVHNode ), file.size() ) ||
+		!inside( t.primitives, m.numFaces, sizeof( int ), file.size() ) )
+		throw ParseError( "Bad mesh tree in binary scene." );
+
+	nodes = (const BVHNode*)(file.data() + t.nodes);
+	primitives = (const int*)(file.data() + t.primitives);
+	numNodes = (int)t.numNodes;
+	leafBatch = (int)t.leafBatch;
+	bmin = vec3f( t.bmin[0], t.bmin[1], t.bmin[2] );
+	bmax = vec3f( t.bmax[0], t.bmax[1], t.bmax[2] );
+	return true;
+}
+
+// The arrays of one trimesh, on their way into the file
+struct MeshArrays
+{
+	std::vector<float> positions;
+	std::vector<int> indices;
+	std::vector<float> normals;
+	std::vector<BVHNode> nodes;		// its tree, if it has faces
+	std::vector<int> primitives;
+	float bmin[3], bmax[3];
+};
+
+// Build the tree of m, the same one Trimesh would.
+static void buildTree( MeshArrays& m, ThreadPool* pool )
+{
+	int numFaces = (int)(m.indices.size() / 3);
+	if( numFaces == 0 )
+		return;
+
+	BVH bvh;
+	BoundingBox bounds = Trimesh::buildTree( &m.positions[0], &m.indices[0], numFaces, bvh, pool );
+	m.nodes = bvh.getNodes();
+	m.primitives = bvh.getPrimitives();
+	for( int k = 0; k < 3; ++k ) {
+		m.bmin[k] = (float)bounds.min[k];
+		m.bmax[k] = (float)bounds.max[k];
+	}
+}
+
+static void appendVec( std::vector<float>& v, const double *row, size_t n )
+{
+	if( n != 3 )
+		throw ParseError( "Bad tuple size." );
+	for( int k = 0; k < 3; ++k )
+		v.push_back( (float)row[k] );
+}
+
+// The rows of the tuple of number tuples obj, one at a time
+class Rows
+{
+public:
+	Rows( Obj *obj )
+		: packed( obj->getPacked() ), tuple( packed ? NULL : &obj->getTuple() ), r( 0 ) {}
+
+	bool next( const double*& row, size_t& n )
+	{
+		if( packed ) {
+			if( r == packed->numRows() )
+				return false;
+			row = packed->row( r );
+			n = packed->rowSize( r++ );
+			return true;
+		}
+		if( r == tuple->size() )
+			return false;
+		const mytuple& t = (*tuple)[ r++ ]->getTuple();
+		numbers.clear();
+		for( mytuple::const_iterator i = t.begin(); i != t.end(); ++i )
+			numbers.push_back( (*i)->getScalar() );
+		row = numbers.empty() ? NULL : &numbers[0];
+		n = numbers.size();
+		return true;
+	}
+
+private:
+	const PackedTupleObj *packed;
+	const mytuple *tuple;	// NULL if packed
+	size_t r;
+	std::vector<double> numbers;
+};
+
+// Same as readTrimesh does with the fields of a trimesh
+static void extractMesh( const dict& d, MeshArrays& m )
+{
+	dict::const_iterator points = d.find( "points" ), faces = d.find( "faces" );
+	if( faces == d.end() )
+		throw ParseError( "Object contains no field named \"faces\"" );
+
+	const double *row;
+	size_t n;
+	Rows p( points->second );
+	while( p.next( row, n ) )
+		appendVec( m.positions, row, n );
+	int numVertices = (int)(m.positions.size() / 3);
+
+	Rows f( faces->second );
+	while( f.next( row, n ) ) {
+		if( n < 3 )
+			throw ParseError( "Faces must have at least 3 vertices." );
+
+		int a = (int)row[0];
+		int b = (int)row[1];
+		for( size_t k = 2; k < n; ++k ) {
+			int c = (int)row[k];
+			if( a < 0 || b < 0 || c < 0 || a >= numVertices || b >= numVertices || c >= numVertices )
+				throw ParseError( "Bad face in trimesh." );
+			m.indices.push_back( a );
+			m.indices.push_back( b );
+			m.indices.push_back( c );
+			b = c;
+		}
+	}
+
+	dict::const_iterator normals = d.find( "normals" );
+	if( normals != d.end() ) {
+		Rows nr( normals->second );
+		while( nr.next( row, n ) )
+			appendVec( m.normals, row, n );
+		if( m.normals.size() != m.positions.size() )
+			throw ParseError( "Bad Trimesh: Wrong number of normals." );
+	}
+}
+
+// Print obj back out as .ray text, with the arrays of every trimesh moved
+// to meshes.  Obj::printOn can't leave the arrays out, and it rounds the
+// numbers to six digits.
+static void writeObj( std::ostream& os, Obj *obj, std::vector<MeshArrays>& meshes, int depth )
+{
+	string type = obj->getTypeName();
+	if( type == "scalar" ) {
+		// every digit, and no '+' in the exponent, which the parser can't read
+		char buf[ 32 ];
+		snprintf( buf, sizeof( buf ), "%.17g", obj->getScalar() );
+		for( const char* c = buf; *c; ++c )
+			if( *c != '+' )
+				os << *c;
+	} else if( type == "bool" ) {
+		os << (obj->getBoolean() ? "true" : "false");
+	} else if( type == "id" ) {
+		os << obj->getID();
+	} else if( type == "string" ) {
+		os << '"' << obj->getString() << '"';
+	} else if( type == "tuple" ) {
+		const mytuple& t = obj->getTuple();
+		os << '(';
+		for( size_t k = 0; k < t.size(); ++k ) {
+			if( k )
+				os << ", ";
+			writeObj( os, t[k], meshes, depth );
+		}
+		os << ')';
+	} else if( type == "dict" ) {
+		const dict& d = obj->getDict();
+		os << "{\n";
+		for( dict::const_iterator i = d.begin(); i != d.end(); ++i ) {
+			os << string( depth + 1, '\t' ) << i->first << " = ";
+			writeObj( os, i->second, meshes, depth + 1 );
+			os << ";\n";
+		}
+		os << string( depth, '\t' ) << '}';
+	} else if( type == "named" ) {
+		string name = obj->getName();
+		Obj *child = obj->getChild();
+		os << name << ' ';
+
+		bool mesh = name == "trimesh" || name == "polymesh" || name == "mesh";
+		if( !mesh || child->getTypeName() != "dict" || !child->getDict().count( "points" ) ) {
+			writeObj( os, child, meshes, depth );
+			return;
+		}
+
+		meshes.push_back( MeshArrays() );
+		extractMesh( child->getDict(), meshes.back() );
+
+		const dict& d = child->getDict();
+		os << "{\n";
+		for( dict::const_iterator i = d.begin(); i != d.end(); ++i ) {
+			if( i->first == "points" || i->first == "faces" || i->first == "normals" )
+				continue;
+			os << string( depth + 1, '\t' ) << i->first << " = ";
+			writeObj( os, i->second, meshes, depth + 1 );
+			os << ";\n";
+		}
+		os << string( depth + 1, '\t' ) << "data = " << meshes.size() - 1 << ";\n"
+			<< string( depth, '\t' ) << '}';
+	}
+}
+
+static uint64_t align16( uint64_t offset )
+{
+	return (offset + 15) & ~(uint64_t)15;
+}
+
+template <typename T>
+static void writeArray( std::ostream& out, uint64_t& at, const std::vector<T>& v )
+{
+	static const char zeros[ 16 ] = { 0 };
+	uint64_t start = align16( at );
+	out.write( zeros, (std::streamsize)(start - at) );
+	if( !v.empty() )
+		out.write( (const char*)&v[0], (std::streamsize)(v.size() * sizeof( T )) );
+	at = start + v.size() * sizeof( T );
+}
+
+static void writeBinaryScene( ParseInput& parseIn, std::ostream& out, ThreadPool* pool )
+{
+	readSceneHeader( parseIn );
+
+	std::ostringstream text;
+	text << "SBT-raytracer 1.0\n\n";
+	std::vector<MeshArrays> meshes;
+	while( Obj *obj = readFile( parseIn ) ) {
+		try {
+			writeObj( text, obj, meshes, 0 );
+		} catch( ... ) {
+			delete obj;
+			throw;
+		}
+		text << "\n\n";
+		delete obj;
+	}
+	std::string body = text.str();
+	for( size_t k = 0; k < meshes.size(); ++k )
+		buildTree( meshes[k], pool );
+
+	BinarySceneHeader header;
+	memset( &header, 0, sizeof( header ) );
+	memcpy( header.magic, BINARY_SCENE_MAGIC, 8 );
+	header.byteOrder = BINARY_SCENE_BYTE_ORDER;
+	header.version = BINARY_SCENE_VERSION;
+	header.textOffset = sizeof( header );
+	header.textSize = body.size();
+	header.meshOffset = align16( header.textOffset + header.textSize );
+	header.meshCount = (uint32_t)meshes.size();
+
+	// the arrays follow the tables, in the order writeArray puts them
+	std::vector<BinaryMesh> table( meshes.size() );
+	std::vector<BinaryMeshTree> trees( meshes.size() );
+	uint64_t at = header.meshOffset + meshes.size() * (sizeof( BinaryMesh ) + sizeof( BinaryMeshTree ));
+	for( size_t k = 0; k < meshes.size(); ++k ) {
+		BinaryMesh& m = table[k];
+		BinaryMeshTree& t = trees[k];
+		m.numVertices = (uint32_t)(meshes[k].positions.size() / 3);
+		m.numFaces = (uint32_t)(meshes[k].indices.size() / 3);
+		m.positions = at = align16( at );
+		at += meshes[k].positions.size() * sizeof( float );
+		m.indices = at = align16( at );
+		at += meshes[k].indices.size() * sizeof( int );
+		m.normals = 0;
+		if( !meshes[k].normals.empty() ) {
+			m.normals = at = align16( at );
+			at += meshes[k].normals.size() * sizeof( float );
+		}
+		memset( &t, 0, sizeof( t ) );
+		if( !meshes[k].nodes.empty() ) {
+			t.nodes = at = align16( at );
+			at += meshes[k].nodes.size() * sizeof( BVHNode );
+			t.primitives = at = align16( at );
+			at += meshes[k].primitives.size() * sizeof( int );
+			t.numNodes = (uint32_t)meshes[k].nodes.size();
+			t.leafBatch = TRI_BLOCK_SIZE;
+			memcpy( t.bmin, meshes[k].bmin, sizeof( t.bmin ) );
+			memcpy( t.bmax, meshes[k].bmax, sizeof( t.bmax ) );
+		}
+	}
+
+	out.write( (const char*)&header, sizeof( header ) );
+	out.write( body.data(), (std::streamsize)body.size() );
+	at = header.textOffset + header.textSize;
+	writeArray( out, at, std::vector<char>() );
+	if( !table.empty() ) {
+		out.write( (const char*)&table[0], (std::streamsize)(table.size() * sizeof( BinaryMesh )) );
+		out.write( (const char*)&trees[0], (std::streamsize)(trees.size() * sizeof( BinaryMeshTree )) );
+	}
+	at += table.size() * (sizeof( BinaryMesh ) + sizeof( BinaryMeshTree ));
+	for( size_t k = 0; k < meshes.size(); ++k ) {
+		writeArray( out, at, meshes[k].positions );
+		writeArray( out, at, meshes[k].indices );
+		if( !meshes[k].normals.empty() )
+			writeArray( out, at, meshes[k].normals );
+		if( !meshes[k].nodes.empty() ) {
+			writeArray( out, at, meshes[k].nodes );
+			writeArray( out, at, meshes[k].primitives );
+		}
+	}
+}
+
+void writeBinaryScene( std::istream& in, std::ostream& out, ThreadPool* pool )
+{
+	ParseInput parseIn( in );
+	writeBinaryScene( parseIn, out, pool );
+}
+
+void writeBinaryScene( const char* text, size_t size, std::ostream& out, ThreadPool* pool )
+{
+	ParseInput parseIn( text, size );
+	writeBinaryScene( parseIn, out, pool );
+}
@@ -0,0 +1,112 @@
+#ifndef __BINSCENE_H__
+#define __BINSCENE_H__
+
+// The binary scene format, .rayb.  It is the text of a .ray file with the
+// points, faces and normals of every trimesh taken out and stored as
+// arrays instead, that a loaded mesh uses where they lie in the file.
+// The file is memory-mapped, and since version 2 it also holds the BVH of
+// every mesh, so loading a big mesh costs little more than copying its
+// tree; the text that is left is small and goes through the usual parser.
+// A trimesh or mesh in the text has the field data = <n>, the number of
+// its arrays in the mesh table.
+//
+// Layout, in the byte order of the machine that wrote it (a reader with
+// the other byte order turns the file down):
+//
+//   BinarySceneHeader
+//   the scene text
+//   BinaryMesh, one per mesh
+//   BinaryMeshTree, one per mesh (version 2 on)
+//   the arrays, each 16-byte aligned: per mesh 3 floats per vertex, 3 ints
+//   per triangle (polygons are cut into fans, as the text reader does),
+//   3 floats per vertex normal, if the mesh gave normals, and then the
+//   BVHNodes and the face numbers in leaf order of its tree
+
+#include <string>
+#include <iostream>
+#include <stdint.h>
+
+#include "mappedfile.h"
+#include "../scene/bvh.h"
+
+class ThreadPool;
+
+struct BinarySceneHeader
+{
+	char		magic[8];		// BINARY_SCENE_MAGIC
+	uint32_t	byteOrder;		// BINARY_SCENE_BYTE_ORDER as written
+	uint32_t	version;
+	uint64_t	textOffset;
+	uint64_t	textSize;
+	uint64_t	meshOffset;
+	uint32_t	meshCount;
+	uint32_t	reserved;
+};
+
+struct BinaryMesh
+{
+	uint64_t	positions;		// file offsets of the arrays
+	uint64_t	indices;
+	uint64_t	normals;		// 0 for none
+	uint32_t	numVertices;
+	uint32_t	numFaces;
+};
+
+// The BVH of a mesh, as Trimesh builds it over the faces
+struct BinaryMeshTree
+{
+	uint64_t	nodes;			// file offsets of the arrays, 0 for no tree
+	uint64_t	primitives;		// numFaces of them
+	uint32_t	numNodes;
+	uint32_t	leafBatch;		// faces tested at once it was built for
+	float		bmin[3];		// bounds of the faces
+	float		bmax[3];
+};
+
+// Not text, so no .ray file starts like this, and a transfer in text mode
+// shows up as a broken magic number.
+#define BINARY_SCENE_MAGIC "\x89RAYB\r\n\x1a"
+static const uint32_t BINARY_SCENE_BYTE_ORDER = 0x01020304;
+static const uint32_t BINARY_SCENE_VERSION = 2;	// version 1 has no trees
+
+// An open .rayb file.  The scene read from it keeps it, since its meshes
+// point into it.
+class BinaryScene
+{
+public:
+	// Throw ParseError if the data is no binary scene, or a broken one.
+	explicit BinaryScene( const std::string& filename );
+	explicit BinaryScene( std::istream& is );	// reads it all into memory
+
+	// true if the first bytes of a file are those of a binary scene
+	static bool isBinary( const char* head, size_t size );
+
+	std::string getText() const;
+
+	int numMeshes() const { return header.meshCount; }
+	// The arrays of mesh n, checked to be inside the file and the faces to
+	// refer to existing vertices.  normals is NULL if the mesh has none.
+	void getMesh( int n, const float*& positions, int& numVertices,
+		const int*& indices, int& numFaces, const float*& normals ) const;
+	// The tree of mesh n, checked to be inside the file, but not whether
+	// it is a tree; false if there is none.
+	bool getTree( int n, const BVHNode*& nodes, int& numNodes, const int*& primitives,
+		int& leafBatch, vec3f& bmin, vec3f& bmax ) const;
+
+private:
+	void check();
+	void readMesh( int n, BinaryMesh& m ) const;
+
+	MappedFile file;
+	BinarySceneHeader header;
+};
+
+// Convert the .ray text in in to a binary scene in out, which must be
+// opened in binary mode.  Throws ParseError for a bad .ray file.  The
+// trees of the meshes are built on pool, if there is one.
+void writeBinaryScene( std::istream& in, std::ostream& out, ThreadPool* pool = NULL );
+// Same, with the text in memory
+void writeBinaryScene( const char* text, size_t size, std::ostream& out,
+	ThreadPool* pool = NULL );
+
+#endif // __BINSCENE_H__
@@ -0,0 +1,99 @@
+#include "mappedfile.h"
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+MappedFile::MappedFile()
+	: base( NULL ), length( 0 ), mapped( false )
+#ifdef _WIN32
+	, fileHandle( NULL ), mapHandle( NULL )
+#endif
+{
+}
+
+MappedFile::~MappedFile()
+{
+	close();
+}
+
+bool MappedFile::open( const std::string& filename )
+{
+	close();
+
+#ifdef _WIN32
+	HANDLE f = CreateFileA( filename.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL,
+		OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL );
+	if( f == INVALID_HANDLE_VALUE )
+		return false;
+	LARGE_INTEGER size;
+	if( !GetFileSizeEx( f, &size ) || size.QuadPart == 0 ) {
+		CloseHandle( f );
+		return false;
+	}
+	HANDLE m = CreateFileMappingA( f, NULL, PAGE_READONLY, 0, 0, NULL );
+	const void* view = m ? MapViewOfFile( m, FILE_MAP_READ, 0, 0, 0 ) : NULL;
+	if( !view ) {
+		if( m )
+			CloseHandle( m );
+		CloseHandle( f );
+		return false;
+	}
+	fileHandle = f;
+	mapHandle = m;
+	base = (const char*)view;
+	length = (size_t)size.QuadPart;
+#else
+	int fd = ::open( filename.c_str(), O_RDONLY );
+	if( fd < 0 )
+		return false;
+	struct stat st;
+	if( fstat( fd, &st ) != 0 || st.st_size == 0 ) {
+		::close( fd );
+		return false;
+	}
+	void* view = mmap( NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0 );
+	// the mapping stays valid without the descriptor
+	::close( fd );
+	if( view == MAP_FAILED )
+		return false;
+	base = (const char*)view;
+	length = (size_t)st.st_size;
+#endif
+
+	mapped = true;
+	return true;
+}
+
+void MappedFile::adopt( std::string& bytes )
+{
+	close();
+	memory.swap( bytes );
+	base = memory.data();
+	length = memory.size();
+}
+
+void MappedFile::close()
+{
+	if( mapped ) {
+#ifdef _WIN32
+		UnmapViewOfFile( base );
+		CloseHandle( (HANDLE)mapHandle );
+		CloseHandle( (HANDLE)fileHandle );
+		mapHandle = fileHandle = NULL;
+#else
+		munmap( (void*)base, length );
+#endif
+	}
+	memory.clear();
+	base = NULL;
+	length = 0;
+	mapped = false;
+}
@@ -0,0 +1,40 @@
+#ifndef __MAPPEDFILE_H__
+#define __MAPPEDFILE_H__
+
+// A file mapped into memory, read only, for as long as the object lives.
+// It can also hold bytes read from somewhere else, e.g. a stream, so that
+// its users don't have to care where their data came from.
+
+#include <string>
+#include <stddef.h>
+
+class MappedFile
+{
+public:
+	MappedFile();
+	~MappedFile();
+
+	// Map the file; false if it can't be opened or mapped.
+	bool open( const std::string& filename );
+	// Take over bytes instead.
+	void adopt( std::string& bytes );
+	void close();
+
+	const char* data() const { return base; }
+	size_t size() const { return length; }
+
+private:
+	MappedFile( const MappedFile& );
+	MappedFile& operator=( const MappedFile& );
+
+	const char* base;
+	size_t length;
+	bool mapped;		// base is a mapping, not memory
+	std::string memory;
+#ifdef _WIN32
+	void* fileHandle;
+	void* mapHandle;
+#endif
+};
+
+#endif // __MAPPEDFILE_H__
@@ -5,256 +5,527 @@
 #endif
 
 #include <cstring>
+#include <cstdlib>
 
 #include "parse.h"
 
-static string readID( istream& is );
-static Obj *readString( istream& is );
-static Obj *readScalar( istream& is );
-static Obj *readTuple( istream& is );
-static Obj *readDict( istream& is );
-static Obj *readObject( istream& is );
-static Obj *readName( istream& is );
-static void eatWS( istream& is );
-static void eatNL( istream& is );
-
-Obj *readFile( istream& is )
+static string readID( ParseInput& in );
+static Obj *readString( ParseInput& in );
+static Obj *readScalar( ParseInput& in );
+static Obj *readTuple( ParseInput& in );
+static Obj *readDict( ParseInput& in );
+static Obj *readObject( ParseInput& in );
+static Obj *readName( ParseInput& in );
+static void eatWS( ParseInput& in );
+static void eatNL( ParseInput& in );
+
+static const size_t INPUT_BLOCK = 1 << 16;
+
+ParseInput::ParseInput( istream& is )
+	: is( &is )
+	, buffer( INPUT_BLOCK )
+	, text( NULL )
+	, pos( NULL )
+	, end( NULL )
 {
-	return readObject( is );
 }
 
-static void eatWS( istream& is )
+ParseInput::ParseInput( const char* text, size_t size )
+	: is( NULL )
+	, text( text )
+	, pos( text )
+	, end( text + size )
 {
-	int ch = is.peek();
-	while( ch == ' ' || ch == '\t' || ch == '\n' || ch == 0x0D || ch == 0x0A) {
-		is.get();
-		if( !is ) {
-			return;
+}
+
+int ParseInput::fill()
+{
+	if( !is || !*is ) {
+		return EOF;
+	}
+	is->read( &buffer[0], buffer.size() );
+	pos = &buffer[0];
+	end = pos + is->gcount();
+	return pos < end ? (unsigned char)*pos : EOF;
+}
+
+static Obj *rowObj( const double *v, size_t n )
+{
+	mytuple row;
+	for( size_t k = 0; k < n; ++k ) {
+		row.push_back( new ScalarObj( v[k] ) );
+	}
+	return new TupleObj( row );
+}
+
+PackedTupleObj::~PackedTupleObj()
+{
+	if( unpacked ) {
+		for( mytuple::iterator i = unpacked->begin(); i != unpacked->end(); ++i ) {
+			delete (*i);
 		}
-		ch = is.peek();
+		delete unpacked;
 	}
 }
 
-static void eatNL( istream& is )
+void PackedTupleObj::printOn( ostream& os ) const
 {
-	int ch = is.peek();
-	while( ch != '\n' ) {
-		is.get();
-		if( !is ) {
-			return;
+	os << '(';
+	for( size_t r = 0; r < rows; ++r ) {
+		os << (r ? ", (" : "(");
+		for( size_t k = 0; k < rowSize( r ); ++k ) {
+			os << (k ? ", " : "") << row( r )[k];
 		}
-		ch = is.peek();
+		os << ')';
+	}
+	os << ')';
+}
+
+const mytuple& PackedTupleObj::getTuple() const
+{
+	if( !unpacked ) {
+		unpacked = new mytuple;
+		for( size_t r = 0; r < rows; ++r ) {
+			unpacked->push_back( rowObj( row( r ), rowSize( r ) ) );
+		}
+	}
+	return *unpacked;
+}
+
+void PackedTupleObj::addRow( const vector<double>& row )
+{
+	if( rows == 0 ) {
+		width = row.size();
+	} else if( ends.empty() && row.size() != width ) {
+		// the first row of another size: from now on every row needs its end
+		for( size_t r = 1; r <= rows; ++r ) {
+			ends.push_back( r * width );
+		}
+	}
+	values.insert( values.end(), row.begin(), row.end() );
+	if( !ends.empty() ) {
+		ends.push_back( values.size() );
+	}
+	++rows;
+}
+
+Obj *readFile( ParseInput& in )
+{
+	return readObject( in );
+}
+
+static void eatWS( ParseInput& in )
+{
+	int ch = in.peek();
+	while( ch == ' ' || ch == '\t' || ch == '\n' || ch == 0x0D || ch == 0x0A) {
+		in.get();
+		ch = in.peek();
+	}
+}
+
+static void eatNL( ParseInput& in )
+{
+	int ch = in.peek();
+	while( ch != '\n' && ch != EOF ) {
+		in.get();
+		ch = in.peek();
 	}
 }
 
-static bool eat( istream& is ) 
+static bool eat( ParseInput& in ) 
 {
-	while( is ) {
-		eatWS( is );
-		if( is ) {
-			int ch = is.peek();
+	while( true ) {
+		eatWS( in );
+		int ch = in.peek();
+		if( ch == '/' ) {
+			in.get();
+			int ch = in.peek();
 			if( ch == '/' ) {
-				is.get();
-				int ch = is.peek();
-				if( ch == '/' ) {
-					eatNL( is );
-				} else if( ch == '*' ) {
-					while( true ) {
-						is.get();
-						ch = is.peek();
-						if( ch == '*' ) {
-							is.get();
-							ch = is.peek();
-							if( ch == '/' ) {
-								is.get();
-								break;
-							} else if( ch == -1 ) {	
-								is.get();
-								throw ParseError( 
-									"Parse Error: unterminated comment" );
-							}
-						} else if( ch == -1 ) {
-							is.get();
+				eatNL( in );
+			} else if( ch == '*' ) {
+				while( true ) {
+					in.get();
+					ch = in.peek();
+					if( ch == '*' ) {
+						in.get();
+						ch = in.peek();
+						if( ch == '/' ) {
+							in.get();
+							break;
+						} else if( ch == EOF ) {	
 							throw ParseError( 
 								"Parse Error: unterminated comment" );
 						}
+					} else if( ch == EOF ) {
+						throw ParseError( 
+							"Parse Error: unterminated comment" );
 					}
-				} else {
-					return true;
 				}
-			} else if( ch == -1 ) {
-				is.get();
-				return false;
 			} else {
 				return true;
 			}
-		} else {
+		} else if( ch == EOF ) {
 			return false;
+		} else {
+			return true;
 		}
 	}
-	return false;
 }
 
-static Obj *readName( istream& is )
+static Obj *readName( ParseInput& in )
 {
-	string s = readID( is );
+	string s = readID( in );
 
 	if( s == "true" ) {
 		return new BooleanObj( true );
 	} else if( s == "false" ) {
 		return new BooleanObj( false );
 	} else {
-		if( !eat( is ) ) {
+		if( !eat( in ) ) {
 			return new IdObj( s );
 		}
 
-		int ch = is.peek();
+		int ch = in.peek();
 		if( strchr( "}),;", ch ) != NULL ) {
 			return new IdObj( s );
 		} else {
-			return new NamedObj( s, readObject( is ) );
+			return new NamedObj( s, readObject( in ) );
 		}
 	}
 }
 
-static string readID( istream& is )
+static string readID( ParseInput& in )
 {
 	int ch;
 	string ret( "" );
 
-	ret += char( is.get() );
+	ret += char( in.get() );
 
-	while( is ) {
-		ch = is.peek();
-		if( strchr( " \t\n={}();,/", ch ) != NULL ) {
+	while( true ) {
+		ch = in.peek();
+		if( ch == EOF || strchr( " \t\n={}();,/", ch ) != NULL ) {
 			break;
 		} else {
 			ret += char( ch );
-			is.get();
+			in.get();
 		}
 	}
 
 	return ret;
 }
 
-static Obj *readString( istream& is ) 
+static Obj *readString( ParseInput& in ) 
 {
 	int ch;
 	string ret( "" );
 
-	is.get();
+	in.get();
 
 	while( true ) {
-		ch = is.peek();
+		ch = in.get();
 		if( ch == '"' ) {
-			is.get();
 			return new StringObj( ret );
+		} else if( ch == EOF ) {
+			throw ParseError( "Parse error: unterminated string." );
 		} else {
 			ret += char( ch );
 		}
-		is.get();
 	}
 }
 
-static Obj *readScalar( istream& is )
+static bool startsNumber( int ch )
 {
-	int ch;
-	string ret( "" );
+	return (ch == '-') || (ch >= '0' && ch <= '9');
+}
+
+// The characters of a number, converted as atof would.  Anything longer
+// than a double can hold is no number anyway, so the rest is dropped.
+static double readNumber( ParseInput& in )
+{
+	char buf[ 64 ];
+	size_t len = 0;
 
 	while( true ) {
-		ch = is.peek();
+		int ch = in.peek();
 		if( (ch == '-') || (ch == '.') || (ch == 'e') || (ch == 'E')
 				|| (ch >= '0' && ch <= '9') ) {
-			ret += char( ch );
-			is.get();
+			if( len < sizeof( buf ) - 1 ) {
+				buf[ len++ ] = char( ch );
+			}
+			in.get();
 		} else {
 			break;
 		}
 	}
+	buf[ len ] = '\0';
 
-	return new ScalarObj( atof( ret.c_str() ) );
+	return strtod( buf, NULL );
 }
 
-static Obj *readTuple( istream& is )
+static Obj *readScalar( ParseInput& in )
 {
-	vector<Obj*> ret;
-
-	is.get();
+	return new ScalarObj( readNumber( in ) );
+}
 
+// The elements of a tuple after items, up to and including the ')'.
+static Obj *readTupleRest( ParseInput& in, mytuple& items )
+{
 	while( true ) {
-		eat( is );
-		ret.push_back( readObject( is ) );	
-		eat( is );
-		int ch = is.get();
+		eat( in );
+		items.push_back( readObject( in ) );	
+		eat( in );
+		int ch = in.get();
 		if( ch == ')' ) {
-			return new TupleObj( ret );
+			return new TupleObj( items );
 		} else if( ch == ',' ) {
 			continue;
 		} else {
 			throw ParseError( "Parse error: expected comma." );
 		}
 	}
+}
+
+// A tuple of numbers, into row.  Returns false at the first element that
+// isn't a number, which is left for readTupleRest; row then has the
+// numbers before it.
+static bool readNumberRow( ParseInput& in, vector<double>& row )
+{
+	in.get();
 
-	throw ParseError( "Parse error: internal error." );
+	while( true ) {
+		eat( in );
+		if( !startsNumber( in.peek() ) ) {
+			return false;
+		}
+		row.push_back( readNumber( in ) );
+		eat( in );
+		int ch = in.get();
+		if( ch == ')' ) {
+			return true;
+		} else if( ch != ',' ) {
+			throw ParseError( "Parse error: expected comma." );
+		}
+	}
 }
 
-static Obj *readDict( istream& is )
+// A tuple that starts with a tuple is read as number rows for as long as
+// it is one; the first thing that isn't turns it back into Objs.
+static Obj *readTuple( ParseInput& in )
+{
+	mytuple ret;
+
+	in.get();
+	eat( in );
+	if( in.peek() != '(' ) {
+		return readTupleRest( in, ret );
+	}
+
+	PackedTupleObj *packed = new PackedTupleObj;
+	vector<double> row;
+	bool numbers;
+	do {
+		row.clear();
+		numbers = readNumberRow( in, row );
+		if( numbers ) {
+			packed->addRow( row );
+			eat( in );
+			int ch = in.get();
+			if( ch == ')' ) {
+				return packed;
+			} else if( ch != ',' ) {
+				delete packed;
+				throw ParseError( "Parse error: expected comma." );
+			}
+			eat( in );
+		}
+	} while( numbers && in.peek() == '(' );
+
+	for( size_t r = 0; r < packed->numRows(); ++r ) {
+		ret.push_back( rowObj( packed->row( r ), packed->rowSize( r ) ) );
+	}
+	delete packed;
+
+	if( numbers ) {
+		// stopped at an element that isn't a tuple
+		return readTupleRest( in, ret );
+	}
+
+	// stopped inside a row
+	mytuple items;
+	for( size_t k = 0; k < row.size(); ++k ) {
+		items.push_back( new ScalarObj( row[k] ) );
+	}
+	ret.push_back( readTupleRest( in, items ) );
+	eat( in );
+	int ch = in.get();
+	if( ch == ')' ) {
+		return new TupleObj( ret );
+	} else if( ch != ',' ) {
+		throw ParseError( "Parse error: expected comma." );
+	}
+	return readTupleRest( in, ret );
+}
+
+static Obj *readDict( ParseInput& in )
 {
 	string lhs;
 	Obj *rhs;
 
 	map<string,Obj*> ret;
 
-	is.get();
+	in.get();
 
 	while( true ) {
-		eat( is );
-		if( is.peek() == '}' ) {
-			is.get();
+		eat( in );
+		if( in.peek() == '}' ) {
+			in.get();
 			return new DictObj( ret );
 		}
-		lhs = readID( is );
-		eat( is );
-		if( is.get() != '=' ) {
+		lhs = readID( in );
+		eat( in );
+		if( in.get() != '=' ) {
 			throw ParseError( "Parse error: expected equals." );
 		}
-		rhs = readObject( is );
+		rhs = readObject( in );
 		ret[ lhs ] = rhs;
-		eat( is );
-		int ch = is.peek();
+		eat( in );
+		int ch = in.peek();
 		if( ch == ';' ) {
-			is.get();
+			in.get();
 		} else if( ch != '}' ) {
 			throw ParseError( "Parse error: expected semicolon or brace." );
 		}
 	}
 }
 
-static Obj *readObject( istream& is )
+static Obj *readObject( ParseInput& in )
 {
-	if( !eat( is ) ) {
+	if( !eat( in ) ) {
 		return NULL;
 	}
 
-	int ch = is.peek();
+	int ch = in.peek();
 
-	if( (ch == '-') || (ch >= '0' && ch <= '9') ) {
-		return readScalar( is );
+	if( startsNumber( ch ) ) {
+		return readScalar( in );
 	} else if( ch == '"' ) {
-		return readString( is );
+		return readString( in );
 	} else if( ch == '(' ) {
-		return readTuple( is );
+		return readTuple( in );
 	} else if( ch == '{' ) {
-		return readDict( is );
+		return readDict( in );
 	} else {
-		return readName( is );
+		return readName( in );
+	}
+}
+
+// Skip space and comments from i on; returns where they end, or size if
+// a comment doesn't.
+static size_t skipSpace( const char* text, size_t size, size_t i )
+{
+	while( i < size ) {
+		char ch = text[i];
+		if( ch == ' ' || ch == '\t' || ch == '\n' || ch == '\r' ) {
+			++i;
+		} else if( ch == '/' && i + 1 < size && text[i + 1] == '/' ) {
+			while( i < size && text[i] != '\n' ) {
+				++i;
+			}
+		} else if( ch == '/' && i + 1 < size && text[i + 1] == '*' ) {
+			const char* close = NULL;
+			for( size_t k = i + 2; k + 1 < size; ++k ) {
+				if( text[k] == '*' && text[k + 1] == '/' ) {
+					close = text + k;
+					break;
+				}
+			}
+			if( !close ) {
+				return size;
+			}
+			i = close - text + 2;
+		} else {
+			break;
+		}
+	}
+	return i;
+}
+
+// The end of the group of brackets that starts at i, or 0 if it doesn't
+// end.  Strings and comments don't count.
+static size_t skipGroup( const char* text, size_t size, size_t i )
+{
+	int depth = 0;
+	while( i < size ) {
+		char ch = text[i];
+		if( ch == '"' ) {
+			const char* close = (const char*)memchr( text + i + 1, '"', size - i - 1 );
+			if( !close ) {
+				return 0;
+			}
+			i = close - text + 1;
+			continue;
+		} else if( ch == '/' ) {
+			size_t next = skipSpace( text, size, i );
+			if( next != i ) {
+				i = next;
+				continue;
+			}
+		} else if( ch == '(' || ch == '{' ) {
+			++depth;
+		} else if( ch == ')' || ch == '}' ) {
+			if( --depth == 0 ) {
+				return i + 1;
+			}
+		}
+		++i;
+	}
+	return 0;
+}
+
+vector<size_t> objectBounds( const char* text, size_t size )
+{
+	vector<size_t> bounds( 1, 0 );
+	vector<size_t> whole( 1, 0 );
+	whole.push_back( size );
+
+	size_t i = skipSpace( text, size, 0 );
+	while( i < size ) {
+		// one or more names, as readName reads them, then a bracketed
+		// group; anything else is left to the parser
+		bool group = false;
+		while( i < size && !group ) {
+			size_t name = i;
+			while( i < size && !strchr( " \t\n={}();,/\"", text[i] ) ) {
+				++i;
+			}
+			string id( text + name, i - name );
+			if( i == name || (text[name] >= '0' && text[name] <= '9') || text[name] == '-'
+					|| id == "true" || id == "false" ) {
+				return whole;
+			}
+			i = skipSpace( text, size, i );
+			if( i < size && (text[i] == '{' || text[i] == '(') ) {
+				group = true;
+			}
+		}
+		if( !group || !(i = skipGroup( text, size, i )) ) {
+			return whole;
+		}
+		bounds.push_back( i );
+		i = skipSpace( text, size, i );
+	}
+
+	if( bounds.back() != size ) {
+		bounds.push_back( size );
 	}
+	return bounds;
 }
 
 /*
 int main( void )
 {
-	Obj *o = readFile( cin );
+	ParseInput in( cin );
+	Obj *o = readFile( in );
 	o->printOn( cout );
 	delete o;
 	return 0;
@@ -8,6 +8,7 @@
 #include <vector>
 #include <map>
 #include <iostream>
+#include <cstdio>
 
 using namespace std;
 
@@ -29,6 +30,7 @@ inline ostream& operator <<( ostream& os, const Exception& x )
 }
 
 class Obj;
+class PackedTupleObj;
 
 typedef vector<Obj*> 		mytuple;
 typedef map<string,Obj*> 	dict;
@@ -77,6 +79,10 @@ public:
 	{ throw ObjTypeMismatch( string( "named" ), getTypeName() ); }
 	virtual Obj 		 *getChild() const
 	{ throw ObjTypeMismatch( string( "named" ), getTypeName() ); }
+
+	// The numbers of a tuple of number tuples, if the parser packed them;
+	// NULL for everything else.
+	virtual const PackedTupleObj *getPacked() const { return NULL; }
 protected:
 	Obj() {}
 
@@ -261,6 +267,94 @@ private:
 	Obj *child;
 };
 
-Obj *readFile( istream& is );
+// A tuple of tuples of numbers, such as the points or faces of a mesh.
+// The parser keeps the numbers in one array instead of an Obj for each, so
+// a big mesh costs a few bytes per number; readers that know about it use
+// the rows directly, anyone else gets the usual tuple of tuples, made on
+// first use.
+class PackedTupleObj
+	: public Obj
+{
+public:
+	PackedTupleObj()
+		: Obj()
+		, rows( 0 )
+		, width( 0 )
+		, unpacked( NULL )
+	{}
+	virtual ~PackedTupleObj();
+
+	virtual string getTypeName() const { return string( "tuple" ); }
+	virtual void printOn( ostream& os ) const;
+	virtual const mytuple& getTuple() const;
+	virtual const PackedTupleObj *getPacked() const { return this; }
+
+	size_t numRows() const { return rows; }
+	size_t rowSize( size_t r ) const
+	{ return ends.empty() ? width : ends[ r ] - rowStart( r ); }
+	const double *row( size_t r ) const { return &values[ rowStart( r ) ]; }
+
+	void addRow( const vector<double>& row );
+
+private:
+	PackedTupleObj( const PackedTupleObj& );
+	PackedTupleObj& operator=( const PackedTupleObj& );
+
+	size_t rowStart( size_t r ) const
+	{ return ends.empty() ? r * width : (r ? ends[ r - 1 ] : 0); }
+
+	vector<double> values;
+	size_t rows;
+	size_t width;			// of every row, as long as ends is empty
+	vector<size_t> ends;	// end of every row, once the rows differ in size
+	mutable mytuple *unpacked;
+};
+
+// The parser's input.  The stream is read a block at a time, so a
+// character costs a pointer compare instead of a call into the stream.
+// That means it reads ahead: once a ParseInput is made for a stream,
+// read the rest of it through the ParseInput only.
+class ParseInput
+{
+public:
+	explicit ParseInput( istream& is );
+	// Read text[0, size) instead, which must outlive the ParseInput.
+	ParseInput( const char* text, size_t size );
+
+	// characters read so far from the text
+	size_t offset() const { return pos - text; }
+
+	// the next character, or EOF at the end of the input
+	int peek() { return pos < end ? (unsigned char)*pos : fill(); }
+	int get()
+	{
+		int ch = peek();
+		if( pos < end )
+			++pos;
+		return ch;
+	}
+
+private:
+	ParseInput( const ParseInput& );
+	ParseInput& operator=( const ParseInput& );
+
+	int fill();
+
+	istream* is;		// NULL for text
+	vector<char> buffer;
+	const char *text;
+	const char *pos;
+	const char *end;
+};
+
+// The next object of the input, NULL at its end.
+Obj *readFile( ParseInput& in );
+
+// Where the top-level objects of text[0, size) lie, so they can be parsed
+// separately, e.g. in parallel: piece k, text[bounds[k], bounds[k+1]),
+// holds object k and the space and comments in front of it; the last
+// piece may hold nothing but space.  If the text isn't a plain list of
+// named objects, there is just the one piece.
+vector<size_t> objectBounds( const char* text, size_t size );
 
 #endif // __PARSE_H__
@@ -5,12 +5,15 @@
 #include <cmath>
 #include <cstring>
 #include <fstream>
+#include <sstream>
 #include <strstream>
 
 #include <vector>
 
 #include "read.h"
 #include "parse.h"
+#include "binscene.h"
+#include "mappedfile.h"
 
 #include "../scene/scene.h"
 #include "../SceneObjects/trimesh.h"
@@ -21,7 +24,9 @@
 #include "../SceneObjects/Square.h"
 #include "../SceneObjects/Hyperboloid.h"
 #include "../SceneObjects/HyperbolicParaboloid.h"
+#include "../SceneObjects/Instance.h"
 #include "../scene/light.h"
+#include "../ThreadPool.h"
 
 typedef map<string,Material*> mmap;
 
@@ -34,40 +39,71 @@ static void processGeometry( string name, Obj *child, Scene *scene,
 	const mmap& materials, TransformNode *transform );
 static void processTrimesh( string name, Obj *child, Scene *scene,
                                      const mmap& materials, TransformNode *transform );
+static Trimesh *readTrimesh( Obj *child, Scene *scene, const mmap& materials,
+                             TransformNode *transform );
+static void readTrimeshArrays( Obj *child, Trimesh *tmesh );
+static void processMesh( Obj *child, Scene *scene, const mmap& materials );
+static void processInstance( Obj *child, Scene *scene, const mmap& materials,
+                             TransformNode *transform );
+static string getName( Obj *field );
 static void processCamera( Obj *child, Scene *scene );
 static Material *getMaterial( Obj *child, const mmap& bindings );
 static Material *processMaterial( Obj *child, mmap *bindings = NULL );
 static void verifyTuple( const mytuple& tup, size_t size );
+static Scene *readScene( BinaryScene *data, ThreadPool *pool );
+static Scene *readScene( const char *text, size_t size, BinaryScene *data,
+                         ThreadPool *pool );
 
-Scene *readScene( const string& filename )
+Scene *readScene( const string& filename, ThreadPool *pool )
 {
-	ifstream ifs( filename.c_str() );
-	if( !ifs ) {
+	// the text is mapped, so its objects can be parsed straight from it;
+	// a binary scene is mapped anyway
+	MappedFile file;
+	if( !file.open( filename ) ) {
 		cerr << "Error: couldn't read scene file " << filename << endl;
 		return NULL;
 	}
 
 	try {
-		return readScene( ifs );
+		if( BinaryScene::isBinary( file.data(), file.size() ) ) {
+			file.close();
+			BinaryScene *data = new BinaryScene( filename );
+			return readScene( data, pool );
+		}
+		return readScene( file.data(), file.size(), NULL, pool );
 	} catch( ParseError& pe ) {
 		cout << "Parse error: " << pe << endl;
 		return NULL;
 	}
 }
 
-Scene *readScene( istream& is )
+Scene *readScene( istream& is, ThreadPool *pool )
+{
+	if( is.peek() == (unsigned char)BINARY_SCENE_MAGIC[0] )
+		return readScene( new BinaryScene( is ), pool );
+
+	ostringstream bytes;
+	bytes << is.rdbuf();
+	string text = bytes.str();
+	return readScene( text.data(), text.size(), NULL, pool );
+}
+
+// The text of data, with its meshes
+static Scene *readScene( BinaryScene *data, ThreadPool *pool )
+{
+	string text = data->getText();
+	return readScene( text.data(), text.size(), data, pool );
+}
+
+void readSceneHeader( ParseInput& in )
 {
-	Scene *ret = new Scene;	//the scene to be RETURNED
-	
-	// Extract the file header
 	static const int MAXNAME = 80;
 	char buf[ MAXNAME ];
 	int ct = 0;
 
 	while( ct < MAXNAME - 1 ) {
-		char c;
-		is.get( c );
-		if( c == ' ' || c == '\t' || c == '\n' ) {
+		int c = in.get();
+		if( c == ' ' || c == '\t' || c == '\n' || c == EOF ) {
 			break;
 		}
 		buf[ ct++ ] = c;
@@ -79,8 +115,13 @@ Scene *readScene( istream& is )
 		throw ParseError( string( "Input is not an SBT input file." ) );
 	}
 
-	float version;
-	is >> version;
+	// the version, as operator>> would read it
+	string number;
+	while( in.peek() == ' ' || in.peek() == '\t' || in.peek() == '\n' || in.peek() == '\r' )
+		in.get();
+	while( in.peek() != EOF && strchr( "+-.eE0123456789", in.peek() ) )
+		number += char( in.get() );
+	float version = (float)atof( number.c_str() );
 
 	if( version != 1.0 ) {
 		ostrstream oss;
@@ -88,19 +129,97 @@ Scene *readScene( istream& is )
 
 		throw ParseError( string( oss.str() ) );
 	}
+}
+
+// The objects of one piece of the text, parsed by itself
+struct ParsedPiece
+{
+	vector<Obj*> objects;
+	bool failed;
+	string error;		// what went wrong after the objects, if it did
+};
+
+static void parsePiece( const char *text, size_t size, ParsedPiece& piece )
+{
+	ParseInput in( text, size );
+	piece.failed = false;
+	try {
+		while( Obj *obj = readFile( in ) )
+			piece.objects.push_back( obj );
+	} catch( ParseError& pe ) {
+		piece.failed = true;
+		piece.error = pe.getMsg();
+	}
+}
+
+// data is the binary scene the text comes from, if it does; the scene
+// takes it over.  With a pool, the top-level objects are parsed in
+// parallel, a window of them at a time, and then processed in order, so
+// the scene and its errors come out the same as from the serial parse,
+// which reads and processes an object at a time.
+static Scene *readScene( const char *text, size_t size, BinaryScene *data,
+                         ThreadPool *pool )
+{
+	Scene *ret = new Scene;	//the scene to be RETURNED
+	ret->setBinaryData( data );
+
+	ParseInput in( text, size );
+	readSceneHeader( in );
+	text += in.offset();
+	size -= in.offset();
 
 	// vector<Obj*> result;
 	mmap materials;		//map from string to material*
 
-	while( true ) {
-		Obj *cur = readFile( is );	//current object being processed
-		if( !cur ) {
-			break;
+	ret->setThreadPool( pool );
+	vector<size_t> bounds;
+	if( pool )
+		bounds = objectBounds( text, size );
+	int pieces = bounds.empty() ? 1 : (int)bounds.size() - 1;
+	if( pieces <= 1 ) {
+		ParseInput rest( text, size );
+		while( true ) {
+			Obj *cur = readFile( rest );	//current object being processed
+			if( !cur ) {
+				break;
+			}
+
+			processObject( cur, ret, materials );
+			delete cur;
 		}
+		ret->setThreadPool( NULL );
+		return ret;
+	}
 
-		processObject( cur, ret, materials );
-		delete cur;
+	int window = 4 * pool->size();
+	for( int first = 0; first < pieces; first += window ) {
+		int count = min( window, pieces - first );
+		vector<ParsedPiece> parsed( count );
+		pool->run( count, [&]( int k ) {
+			size_t begin = bounds[ first + k ], end = bounds[ first + k + 1 ];
+			parsePiece( text + begin, end - begin, parsed[k] );
+		} );
+
+		try {
+			for( int k = 0; k < count; ++k ) {
+				vector<Obj*>& objs = parsed[k].objects;
+				for( size_t i = 0; i < objs.size(); ++i ) {
+					processObject( objs[i], ret, materials );
+					delete objs[i];
+					objs[i] = NULL;
+				}
+				if( parsed[k].failed )
+					throw ParseError( parsed[k].error );
+			}
+		} catch( ... ) {
+			for( int k = 0; k < count; ++k )
+				for( size_t i = 0; i < parsed[k].objects.size(); ++i )
+					delete parsed[k].objects[i];
+			ret->setThreadPool( NULL );
+			throw;
+		}
 	}
+	ret->setThreadPool( NULL );
 
 	return ret;
 }
@@ -208,6 +327,26 @@ static bool maybeExtractField( Obj *child, const string& name, bool& ret )
 	return false;
 }
 
+// The infinite quadrics can be clipped to a box in their own space with
+// clip_min = (x,y,z); clip_max = (x,y,z);  Both or neither must be there.
+static bool maybeExtractClipBounds( Obj *child, vec3f& min, vec3f& max )
+{
+	bool hasMin = hasField( child, "clip_min" );
+	bool hasMax = hasField( child, "clip_max" );
+	if( !hasMin && !hasMax )
+		return false;
+	if( !hasMin || !hasMax )
+		throw ParseError( string( "clip_min and clip_max must be given together" ) );
+
+	min = tupleToVec( getField( child, "clip_min" ) );
+	max = tupleToVec( getField( child, "clip_max" ) );
+	for( int k = 0; k < 3; ++k ) {
+		if( min[k] > max[k] )
+			throw ParseError( string( "clip_min is above clip_max" ) );
+	}
+	return true;
+}
+
 // Check that a tuple has the expected size.
 static void verifyTuple( const mytuple& tup, size_t size )
 {
@@ -292,6 +431,8 @@ static void processGeometry( string name, Obj *child, Scene *scene,
                                                              l4[3]->getScalar() ) ) ) );
 	} else if( name == "trimesh" || name == "polymesh" ) { // 'polymesh' is for backwards compatibility
         processTrimesh( name, child, scene, materials, transform);
+    } else if( name == "instance" ) {
+        processInstance( child, scene, materials, transform );
     } else {
 		SceneObject *obj = NULL;
        	Material *mat;
@@ -305,10 +446,18 @@ static void processGeometry( string name, Obj *child, Scene *scene,
 			obj = new Sphere( scene, mat );
 		}
 		else if (name == "hyperboloid") {
-			obj = new Hyperboloid(scene, mat);
+			Hyperboloid* h = new Hyperboloid(scene, mat);
+			vec3f min, max;
+			if (maybeExtractClipBounds(child, min, max))
+				h->setClipBounds(min, max);
+			obj = h;
 		}
 		else if (name == "hyperbolic_paraboloid") {
-			obj = new HyperbolicParaboloid(scene, mat);
+			HyperbolicParaboloid* hp = new HyperbolicParaboloid(scene, mat);
+			vec3f min, max;
+			if (maybeExtractClipBounds(child, min, max))
+				hp->setClipBounds(min, max);
+			obj = hp;
 		}
 		else if( name == "box" ) {
 			obj = new Box( scene, mat );
@@ -340,6 +489,77 @@ static void processGeometry( string name, Obj *child, Scene *scene,
 
 static void processTrimesh( string name, Obj *child, Scene *scene,
                                      const mmap& materials, TransformNode *transform )
+{
+    scene->add( readTrimesh( child, scene, materials, transform ) );
+}
+
+// The points and faces of a trimesh in a .ray file
+// Call add with every 3-vector of the tuple obj, e.g. the points of a
+// mesh; straight from the numbers, if the parser packed them.
+static void readVectors( Obj *obj, Trimesh *tmesh, void (Trimesh::*add)( const vec3f& ) )
+{
+    const PackedTupleObj *packed = obj->getPacked();
+    if( !packed )
+    {
+        const mytuple &vecs = obj->getTuple();
+        for( mytuple::const_iterator vi = vecs.begin(); vi != vecs.end(); ++vi )
+            (tmesh->*add)( tupleToVec( *vi ) );
+        return;
+    }
+
+    for( size_t r = 0; r < packed->numRows(); ++r )
+    {
+        if( packed->rowSize( r ) != 3 )
+            verifyTuple( packed->getTuple()[r]->getTuple(), 3 );
+        const double *v = packed->row( r );
+        (tmesh->*add)( vec3f( v[0], v[1], v[2] ) );
+    }
+}
+
+// triangulate here and now.  assume the poly is
+// concave and we can triangulate using an arbitrary fan
+static void addPolygon( Trimesh *tmesh, const double *ids, size_t n )
+{
+    if( n < 3 )
+        throw ParseError( "Faces must have at least 3 vertices." );
+
+    int a = (int) ids[0];
+    int b = (int) ids[1];
+    for( size_t k = 2; k < n; ++k )
+    {
+        int c = (int) ids[k];
+        if( !tmesh->addFace(a,b,c) )
+            throw ParseError( "Bad face in trimesh." );
+        b = c;
+    }
+}
+
+static void readTrimeshArrays( Obj *child, Trimesh *tmesh )
+{
+    readVectors( getField( child, "points" ), tmesh, &Trimesh::addVertex );
+
+    Obj *faces = getField( child, "faces" );
+    if( const PackedTupleObj *packed = faces->getPacked() )
+    {
+        for( size_t r = 0; r < packed->numRows(); ++r )
+            addPolygon( tmesh, packed->row( r ), packed->rowSize( r ) );
+        return;
+    }
+
+    const mytuple &polys = faces->getTuple();
+    vector<double> ids;
+    for( mytuple::const_iterator fi = polys.begin(); fi != polys.end(); ++fi )
+    {
+        const mytuple &pointids = (*fi)->getTuple();
+        ids.clear();
+        for( mytuple::const_iterator i = pointids.begin(); i != pointids.end(); ++i )
+            ids.push_back( (*i)->getScalar() );
+        addPolygon( tmesh, ids.empty() ? NULL : &ids[0], ids.size() );
+    }
+}
+
+static Trimesh *readTrimesh( Obj *child, Scene *scene, const mmap& materials,
+                             TransformNode *transform )
 {
     Material *mat;
     
@@ -350,31 +570,37 @@ static void processTrimesh( string name, Obj *child, Scene *scene,
     
     Trimesh *tmesh = new Trimesh( scene, mat, transform);
 
-    const mytuple &points = getField( child, "points" )->getTuple();
-    for( mytuple::const_iterator pi = points.begin(); pi != points.end(); ++pi )
-        tmesh->addVertex( tupleToVec( *pi ) );
-                
-    const mytuple &faces = getField( child, "faces" )->getTuple();
-    for( mytuple::const_iterator fi = faces.begin(); fi != faces.end(); ++fi )
+    // from a binary scene: the arrays are in the file, where they stay,
+    // and so is the BVH, unless it was built for another block size
+    double data;
+    if( maybeExtractField( child, "data", data ) )
     {
-        const mytuple &pointids = (*fi)->getTuple();
-
-        // triangulate here and now.  assume the poly is
-        // concave and we can triangulate using an arbitrary fan
-        if( pointids.size() < 3 )
-            throw ParseError( "Faces must have at least 3 vertices." );
-
-        mytuple::const_iterator i = pointids.begin();
-        int a = (int) (*i++)->getScalar();
-        int b = (int) (*i++)->getScalar();
-        while( i != pointids.end() )
-        {
-            int c = (int) (*i++)->getScalar();
-            if( !tmesh->addFace(a,b,c) )
-                throw ParseError( "Bad face in trimesh." );
-            b = c;
-        }
+        const BinaryScene *bin = scene->getBinaryData();
+        if( !bin )
+            throw ParseError( "Trimesh data outside of a binary scene." );
+        // checked before the cast, which is undefined for NaN or out of range
+        if( !std::isfinite( data ) || data != floor( data ) ||
+            data < 0.0 || data >= bin->numMeshes() )
+            throw ParseError( "Bad mesh number in binary scene." );
+        int mesh = (int)data;
+
+        const float *positions, *normals;
+        const int *indices;
+        int numVertices, numFaces;
+        bin->getMesh( mesh, positions, numVertices, indices, numFaces, normals );
+        tmesh->viewArrays( positions, numVertices, indices, numFaces, normals );
+
+        const BVHNode *nodes;
+        const int *primitives;
+        int numNodes, leafBatch;
+        vec3f bmin, bmax;
+        if( bin->getTree( mesh, nodes, numNodes, primitives, leafBatch, bmin, bmax ) &&
+            leafBatch == TRI_BLOCK_SIZE &&
+            !tmesh->useTree( nodes, numNodes, primitives, bmin, bmax ) )
+            throw ParseError( "Bad mesh tree in binary scene." );
     }
+    else
+        readTrimeshArrays( child, tmesh );
 
     bool generateNormals = false;
     maybeExtractField( child, "gennormals", generateNormals );
@@ -388,17 +614,61 @@ static void processTrimesh( string name, Obj *child, Scene *scene,
             tmesh->addMaterial( getMaterial( *mi, materials ) );
     }
     if( hasField( child, "normals" ) )
-    {
-        const mytuple &norms = getField( child, "normals" )->getTuple();
-        for( mytuple::const_iterator ni = norms.begin(); ni != norms.end(); ++ni )
-            tmesh->addNormal( tupleToVec( *ni ) );
-    }
+        readVectors( getField( child, "normals" ), tmesh, &Trimesh::addNormal );
 
     char *error;
     if( error = tmesh->doubleCheck() )
         throw ParseError( error );
 
-    scene->add(tmesh);
+    return tmesh;
+}
+
+// mesh { name = "tree"; points = ...; faces = ...; } takes the fields of a
+// trimesh, but only defines it.  instance { mesh = "tree"; } places it, under
+// whatever transforms it is in, as often as needed; all the instances share
+// the one copy of the mesh.  An instance can have a material of its own.
+static void processMesh( Obj *child, Scene *scene, const mmap& materials )
+{
+    if( child == NULL ) {
+        throw ParseError( "No info for mesh" );
+    }
+    if( !hasField( child, "name" ) ) {
+        throw ParseError( string( "Attempt to define mesh with no name" ) );
+    }
+
+    string name = getName( getField( child, "name" ) );
+    if( scene->getPrototype( name ) ) {
+        throw ParseError( string( "Mesh defined twice: " ) + name );
+    }
+
+    scene->addPrototype( name, readTrimesh( child, scene, materials, &scene->transformRoot ) );
+}
+
+static void processInstance( Obj *child, Scene *scene, const mmap& materials,
+                             TransformNode *transform )
+{
+    string name = getName( getField( child, "mesh" ) );
+    SceneObject *prototype = scene->getPrototype( name );
+    if( prototype == NULL ) {
+        throw ParseError( string( "Unknown mesh: " ) + name );
+    }
+
+    Material *mat = NULL;
+    if( hasField( child, "material" ) )
+        mat = getMaterial( getField( child, "material" ), materials );
+
+    Instance *instance = new Instance( scene, prototype, mat );
+    instance->setTransform( transform );
+    scene->add( instance );
+}
+
+// A name given as an identifier or as a string.
+static string getName( Obj *field )
+{
+    if( field->getTypeName() == "id" ) {
+        return field->getID();
+    }
+    return field->getString();
 }
 
 static Material*  getMaterial( Obj *child, const mmap& bindings )
@@ -459,16 +729,7 @@ static Material *processMaterial( Obj *child, mmap *bindings )
     if( bindings != NULL ) {
         // Want to bind, better have "name" field:
         if( hasField( child, "name" ) ) {
-            Obj *field = getField( child, "name" );
-            string tfield = field->getTypeName();
-            string name;
-            if( tfield == "id" ) {
-                name = field->getID();
-            } else {
-                name = field->getString();
-            }
-
-            (*bindings)[ name ] = mat;
+            (*bindings)[ getName( getField( child, "name" ) ) ] = mat;
         } else {
             throw ParseError( 
                 string( "Attempt to bind material with no name" ) );
@@ -586,6 +847,42 @@ static void processObject( Obj *obj, Scene *scene, mmap& materials )
 		}
 		scene->add(l);
 	}
+	else if (name == "area_light") {
+		if (child == NULL) {
+			throw ParseError("No info for area_light");
+		}
+
+		// shape = rect: a rectangle with sides edge1 and edge2
+		// shape = disk: a disk of the given radius, facing normal
+		// shape = sphere: a sphere of the given radius
+		// all centered on position
+		string shape = getName(getField(child, "shape"));
+		vec3f center = tupleToVec(getField(child, "position"));
+		LightShape s;
+		if (shape == "rect") {
+			s = LightShape::rect(center, tupleToVec(getField(child, "edge1")),
+				tupleToVec(getField(child, "edge2")));
+		} else if (shape == "disk") {
+			s = LightShape::disk(center, tupleToVec(getField(child, "normal")),
+				getField(child, "radius")->getScalar());
+		} else if (shape == "sphere") {
+			s = LightShape::sphere(center, getField(child, "radius")->getScalar());
+		} else {
+			throw ParseError(string("Unknown area light shape: ") + shape);
+		}
+
+		double samples = AreaLight::DEFAULT_SAMPLES;
+		maybeExtractField(child, "samples", samples);
+		if (samples < 1) {
+			throw ParseError("An area light needs at least one sample");
+		}
+
+		AreaLight* l = new AreaLight(scene, s, tupleToVec(getColorField(child)), (int)samples);
+		maybeExtractField(child, "constant_attenuation_coeff", l->constant_attenuation_coeff);
+		maybeExtractField(child, "linear_attenuation_coeff", l->linear_attenuation_coeff);
+		maybeExtractField(child, "quadratic_attenuation_coeff", l->quadratic_attenuation_coeff);
+		scene->add(l);
+	}
 	else if (name == "warn_model_light") {
 		if (child == NULL) {
 			throw ParseError("No info for Warn Model Light");
@@ -642,9 +939,12 @@ static void processObject( Obj *obj, Scene *scene, mmap& materials )
 				name == "scale" ||
 				name == "transform" ||
                 name == "trimesh" ||
-                name == "polymesh") { // polymesh is for backwards compatibility.
+                name == "polymesh" || // polymesh is for backwards compatibility.
+                name == "instance" ) {
 		processGeometry( name, child, scene, materials, &scene->transformRoot);
 		//scene->add( geo );
+	} else if( name == "mesh" ) {
+		processMesh( child, scene, materials );
 	} else if( name == "material" ) {
 		processMaterial( child, &materials );
 	} else if( name == "camera" ) {
@@ -6,7 +6,17 @@
 
 #include "../scene/scene.h"
 
-Scene *readScene( const string& filename );
-Scene *readScene( istream& is );
+class ParseInput;
+class ThreadPool;
+
+// Either reads a .ray file or a binary scene (see binscene.h).  With a
+// pool, the objects of the file are parsed in parallel, and the meshes
+// use it for their normals.
+Scene *readScene( const string& filename, ThreadPool *pool = NULL );
+Scene *readScene( istream& is, ThreadPool *pool = NULL );
+
+// Reads the "SBT-raytracer 1.0" a .ray file starts with; throws ParseError
+// if it isn't there.
+void readSceneHeader( ParseInput& in );
 
 #endif // __READ_H__
@@ -0,0 +1,135 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <fstream>
+#include <sstream>
+
+#include "scenecache.h"
+#include "binscene.h"
+#include "mappedfile.h"
+#include "parse.h"
+#include "read.h"
+#include "../SceneObjects/trikernel.h"
+
+#ifdef _WIN32
+#include <direct.h>
+#include <process.h>
+#else
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+// 64-bit FNV-1a
+static uint64_t hashBytes( uint64_t h, const char* bytes, size_t size )
+{
+	for( size_t k = 0; k < size; ++k ) {
+		h ^= (unsigned char)bytes[k];
+		h *= 1099511628211ULL;
+	}
+	return h;
+}
+
+// The name of the cached scene of text.  Besides the text, the hash
+// covers what the file depends on in this build: its format, and what the
+// trees in it are built from and for.
+static std::string cacheName( const char* text, size_t size )
+{
+	uint32_t build[] = { BINARY_SCENE_VERSION, TRI_BLOCK_SIZE,
+		(uint32_t)sizeof( vreal ), (uint32_t)sizeof( BVHNode ) };
+	uint64_t h = hashBytes( 14695981039346656037ULL, text, size );
+	h = hashBytes( h, (const char*)build, sizeof( build ) );
+
+	char name[ 64 ];
+	snprintf( name, sizeof( name ), "%016llx-%llu.rayb",
+		(unsigned long long)h, (unsigned long long)size );
+	return name;
+}
+
+static bool isBinaryScene( const std::string& path )
+{
+	try {
+		BinaryScene check( path );
+		return true;
+	} catch( ParseError& ) {
+		return false;
+	}
+}
+
+// The cached binary scene of text, made first if need be; empty if there
+// is none to be had, e.g. because the text doesn't parse, which reading
+// it as usual then reports.
+static std::string cachedScene( const char* text, size_t size, const std::string& cacheDir,
+	ThreadPool* pool )
+{
+	// a scene only gets into the cache by being renamed into it once it
+	// is complete, but someone else may have put any file there
+	std::string path = cacheDir + "/" + cacheName( text, size );
+	if( isBinaryScene( path ) )
+		return path;
+
+#ifdef _WIN32
+	_mkdir( cacheDir.c_str() );
+	int pid = _getpid();
+#else
+	mkdir( cacheDir.c_str(), 0777 );
+	int pid = (int)getpid();
+#endif
+	std::ostringstream temp;
+	temp << path << ".tmp" << pid;
+
+	std::ofstream out( temp.str().c_str(), std::ios::binary );
+	if( !out ) {
+		cerr << "Warning: can't write to the scene cache " << cacheDir << endl;
+		return "";
+	}
+	try {
+		writeBinaryScene( text, size, out, pool );
+	} catch( ParseError& ) {
+		out.close();
+		remove( temp.str().c_str() );
+		return "";
+	}
+	out.close();
+	if( !out ) {
+		cerr << "Warning: couldn't write all of " << temp.str() << endl;
+		remove( temp.str().c_str() );
+		return "";
+	}
+
+	// fails on Windows if another process cached the scene meanwhile
+	if( rename( temp.str().c_str(), path.c_str() ) != 0 ) {
+		remove( temp.str().c_str() );
+		if( !isBinaryScene( path ) )
+			return "";
+	}
+	return path;
+}
+
+Scene *readCachedScene( const std::string& filename, const std::string& cacheDir,
+	ThreadPool *pool )
+{
+	MappedFile file;
+	if( !file.open( filename ) || BinaryScene::isBinary( file.data(), file.size() ) ) {
+		file.close();
+		return readScene( filename, pool );
+	}
+
+	std::string path = cachedScene( file.data(), file.size(), cacheDir, pool );
+	file.close();
+	return readScene( path.empty() ? filename : path, pool );
+}
+
+Scene *readCachedScene( std::istream& is, const std::string& cacheDir, ThreadPool *pool )
+{
+	std::ostringstream bytes;
+	bytes << is.rdbuf();
+	std::string text = bytes.str();
+
+	std::string path;
+	if( !BinaryScene::isBinary( text.data(), text.size() ) )
+		path = cachedScene( text.data(), text.size(), cacheDir, pool );
+	if( !path.empty() )
+		return readScene( path, pool );
+
+	std::istringstream in( text );
+	return readScene( in, pool );
+}
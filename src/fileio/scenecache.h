@@ -0,0 +1,24 @@
+#ifndef __SCENECACHE_H__
+#define __SCENECACHE_H__
+
+// A directory of binary scenes (see binscene.h) made from .ray files, so
+// that rendering the same scene again maps its meshes and their BVHs
+// instead of parsing and building them.  A cached scene is named after a
+// hash of the text of the scene and of the build that made it, so an
+// edited scene simply misses; nothing is ever removed from the directory.
+
+#include <string>
+#include <iostream>
+
+class Scene;
+class ThreadPool;
+
+// Like readScene, but through the cache in cacheDir, which is made if it
+// doesn't exist.  A scene that isn't in it yet is converted and put there
+// first; if that can't be done, the scene is read as usual.
+Scene *readCachedScene( const std::string& filename, const std::string& cacheDir,
+	ThreadPool *pool = NULL );
+Scene *readCachedScene( std::istream& is, const std::string& cacheDir,
+	ThreadPool *pool = NULL );
+
+#endif // __SCENECACHE_H__
@@ -56,6 +56,13 @@
 char* optarg = NULL;
 int optind, opterr, optopt;
 
+// '/' starts an option the DOS way, but on Unix it starts absolute paths
+#ifdef WIN32
+#define IS_OPTION(c) ((c) == '-' || (c) == '/')
+#else
+#define IS_OPTION(c) ((c) == '-')
+#endif
+
 int GetOption (
     int argc,
     char** argv,
@@ -70,7 +77,7 @@ int GetOption (
     if (iArg < argc)
     {
         psz = &(argv[iArg][0]);
-        if (*psz == '-' || *psz == '/')
+        if (IS_OPTION(*psz))
         {
             // we have an option specifier
             chOpt = argv[iArg][1];
@@ -91,7 +98,7 @@ int GetOption (
                             if (iArg+1 < argc)
                             {
                                 psz = &(argv[iArg+1][0]);
-                                if (*psz == '-' || *psz == '/')
+                                if (IS_OPTION(*psz))
                                 {
                                     // next argv is a new option, so param
                                     // not given for current option
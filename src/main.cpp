@@ -13,7 +13,7 @@
 //  |
 //  +- RayTracer::traceSetup
 //  |
-//  +- RayTracer::traceLines
+//  +- RayTracer::traceTiles
 //        |
 //        +- RayTracer::tracePixel
 //              |
@@ -34,9 +34,11 @@
 //                          +- Material::shade
 //
 // The loadScene and traceSetup methods load a file and set up all the internal
-// buffers necessary to render the scene.  The traceLines method begins the
-// process of actually rendering the image, one scanline at a time.  It does
-// this by calling tracePixel for each pixel in the image.  tracePixel is given
+// buffers necessary to render the scene.  The traceTiles method begins the
+// process of actually rendering the image, one 16x16 tile at a time, spread
+// over as many threads as asked for (traceLines does the same one scanline at
+// a time on the calling thread).  It does this by calling tracePixel for each
+// pixel in the image.  tracePixel is given
 // a coordinate pair which is converted into an (x,y) screen coordinate and
 // passed to trace.  The trace method calculates a ray from the camera position
 // through the (x,y) coordinate and then calls traceRay to see if this ray
@@ -55,8 +57,14 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <time.h>
+#include <chrono>
+#include <fstream>
+#include <sstream>
 
+// RAY_NO_GUI builds the command line renderer alone, without FLTK
+#ifndef RAY_NO_GUI
 #include <FL/Fl.h>
 #include <FL/Fl_Window.H>
 #include <FL/Fl_Box.H>
@@ -64,7 +72,11 @@
 #include <FL/fl_ask.h>
 
 #include "ui/TraceUI.h"
+#endif
+
 #include "RayTracer.h"
+#include "RenderFarm.h"
+#include "scene/sampler.h"
 
 #include "fileio/bitmap.h"
 
@@ -78,25 +90,49 @@ extern int optind, opterr, optopt;
 // ***********************************************************
 
 RayTracer* theRayTracer;
+#ifndef RAY_NO_GUI
 TraceUI* traceUI;
+#endif
 
 //
 // options from program parameters
 //
-int recursion_depth = 0;
+RenderSettings g_settings;
 int g_height;
 int g_width = 150;
+int g_threads = 0;	// 0 = one thread per core
+int g_bucketSize = 0;	// 0 = the whole image at once
+char* g_cacheDir = NULL;	// scene cache, if any
+// distributed rendering: a coordinator listens on g_port, beyond this
+// machine only if g_listenAnywhere, and starts g_localWorkers workers of
+// its own; a worker connects to g_coordinator
+bool g_coordinate = false;
+int g_port = 0;
+int g_localWorkers = 0;
+bool g_listenAnywhere = false;
+char* g_coordinator = NULL;
 bool bReport = false;
 char *progname, *rayName, *imgName;
 
 void usage()
 {
-#ifdef WIN32
-	fl_alert( "usage: %s [-r <#> -w <#> -t] [input.ray output.bmp]\n", progname );
+#if defined(WIN32) && !defined(RAY_NO_GUI)
+	fl_alert( "usage: %s [-r <#> -w <#> -n <#> -p <pattern> -o <name=value> -b <#> -c <dir> -S <port> -j <#> -L -C <host:port> -t] [input.ray output.bmp]\n", progname );
 #else
 	fprintf( stderr, "usage: %s [options] [input.ray output.bmp]\n", progname );
-	fprintf( stderr, "  -r <#>      set recurssion level (default %d)\n", recursion_depth );
+	fprintf( stderr, "  -r <#>      set recurssion level (default %d)\n", g_settings.depth );
 	fprintf( stderr, "  -w <#>      set output image width (default %d)\n", g_width );
+	fprintf( stderr, "  -n <#>      number of render threads (default 0 = one per core)\n" );
+	fprintf( stderr, "  -p <name>   sample pattern: random, stratified or halton (default halton)\n" );
+	fprintf( stderr, "  -o <n=v>    set render option n to v, may be repeated:\n" );
+	RenderSettings::printOptions( stderr );
+	fprintf( stderr, "  -b <#>      render in <#> x <#> buckets, one after the other\n" );
+	fprintf( stderr, "  -c <dir>    keep parsed scenes and their BVHs in dir, for the next run\n" );
+	fprintf( stderr, "  -S <port>   coordinate: hand buckets out to workers on port (0 = any)\n" );
+	fprintf( stderr, "  -j <#>      coordinate, with <#> workers started on this machine\n" );
+	fprintf( stderr, "  -L          coordinate for workers on other machines too; anyone who\n" );
+	fprintf( stderr, "              can reach the port can get the scene and send pixels\n" );
+	fprintf( stderr, "  -C <h:p>    work for the coordinator at host h, port p; no file names\n" );
 	fprintf( stderr, "  -t			report time statistics\n" );
 #endif
 }
@@ -104,7 +140,7 @@ void usage()
 bool processArgs(int argc, char **argv) {
 	int i;
 
-    while ( (i = getopt( argc, argv, "tr:w:h:" )) != EOF )
+    while ( (i = getopt( argc, argv, "tr:w:h:n:p:o:b:c:S:j:LC:" )) != EOF )
 	{
 		switch ( i )
 		{
@@ -113,7 +149,7 @@ bool processArgs(int argc, char **argv) {
 			break;
 	    
 			case 'r':
-			recursion_depth = atoi( optarg );
+			g_settings.depth = atoi( optarg );
 			break;
 	    
 			case 'w':
@@ -124,11 +160,66 @@ bool processArgs(int argc, char **argv) {
 			g_height = atoi( optarg );
 			break;
 
+			case 'n':
+			g_threads = atoi( optarg );
+			break;
+
+			case 'b':
+			g_bucketSize = atoi( optarg );
+			break;
+
+			case 'c':
+			g_cacheDir = optarg;
+			break;
+
+			case 'S':
+			g_coordinate = true;
+			g_port = atoi( optarg );
+			break;
+
+			case 'j':
+			g_coordinate = true;
+			g_localWorkers = atoi( optarg );
+			break;
+
+			case 'L':
+			g_coordinate = true;
+			g_listenAnywhere = true;
+			break;
+
+			case 'C':
+			g_coordinator = optarg;
+			if ( !strchr( g_coordinator, ':' ) )
+				return false;
+			break;
+
+			case 'p':
+			if ( !strcmp( optarg, "random" ) )
+				Sampler::setPattern( SAMPLE_RANDOM );
+			else if ( !strcmp( optarg, "stratified" ) )
+				Sampler::setPattern( SAMPLE_STRATIFIED );
+			else if ( !strcmp( optarg, "halton" ) )
+				Sampler::setPattern( SAMPLE_HALTON );
+			else
+				return false;
+			break;
+
+			case 'o':
+			if ( !g_settings.parse( optarg ) ) {
+				fprintf( stderr, "bad render option %s.\n", optarg );
+				return false;
+			}
+			break;
+
 			default:
 			return false;
 		}
     }
 
+	// a worker gets everything else from the coordinator
+	if ( g_coordinator )
+		return true;
+
     if ( optind >= argc-1 )
     {
 		fprintf( stderr, "no input and/or output name.\n" );
@@ -152,27 +243,74 @@ bool processArgs(int argc, char **argv) {
 int main(int argc, char **argv) {
 	progname=argv[0];
 
+#ifndef RAY_NO_GUI
 	if (argc!=1) {
+#else
+	{
+#endif
 		// text mode
 		if (!processArgs(argc, argv)) {
 			usage();
 			exit(1);
 		}
 		
+		if (g_coordinator) {
+			char* colon = strrchr(g_coordinator, ':');
+			*colon = '\0';
+			return runRenderWorker(g_coordinator, atoi(colon + 1), g_threads) ? 0 : 1;
+		}
+
 		theRayTracer=new RayTracer();
-		theRayTracer->loadScene(rayName);
+		theRayTracer->setThreads(g_threads);
+		theRayTracer->setSettings(g_settings);
+		if (g_cacheDir)
+			theRayTracer->setCacheDir(g_cacheDir);
+
+		// the coordinator sends the workers the scene as it read it
+		std::string sceneText;
+		if (g_coordinate) {
+			std::ifstream ifs(rayName, std::ios::binary);
+			std::ostringstream text;
+			text << ifs.rdbuf();
+			sceneText = text.str();
+			std::istringstream is(sceneText);
+			if (ifs)
+				theRayTracer->loadScene(is);
+		} else {
+			theRayTracer->loadScene(rayName);
+		}
 	
 		if (theRayTracer->sceneLoaded()) {
 			g_height = (int)(g_width / theRayTracer->aspectRatio() + 0.5);
 
 			theRayTracer->traceSetup(g_width, g_height);
 		
-			clock_t start, end;
-			start=clock();
+			// wall clock time; clock() would add up the time of all the threads
+			std::chrono::steady_clock::time_point start, end;
+			start=std::chrono::steady_clock::now();
 
-			theRayTracer->traceLines(0, g_height);
+			if (g_coordinate) {
+				RenderCoordinator coordinator(theRayTracer, sceneText);
+				if (!coordinator.listen(g_port, g_listenAnywhere)) {
+					fprintf(stderr, "can't listen on port %d.\n", g_port);
+					return 1;
+				}
+				fprintf(stderr, "coordinating on port %d\n", coordinator.getPort());
+				if (g_localWorkers > 0 && !coordinator.spawnWorkers(progname, g_localWorkers, g_threads))
+					fprintf(stderr, "couldn't start all the workers.\n");
+				coordinator.render(g_bucketSize > 0 ? g_bucketSize : 64);
+			} else if (g_bucketSize > 0) {
+				std::vector<RenderTile> buckets;
+				theRayTracer->makeBuckets(g_bucketSize, buckets);
+				for (size_t k = 0; k < buckets.size(); ++k) {
+					theRayTracer->traceRegion(buckets[k]);
+					theRayTracer->mergeTile(buckets[k]);
+				}
+			} else {
+				theRayTracer->traceTiles(0, g_height);
+			}
 		
-			end=clock();
+			end=std::chrono::steady_clock::now();
 
 			// save image
 			unsigned char* buf;
@@ -182,8 +320,8 @@ int main(int argc, char **argv) {
 				writeBMP(imgName, g_width, g_height, buf); 
 
 			if (bReport) {
-				double t=(double)(end-start)/CLOCKS_PER_SEC;
-#ifdef WIN32
+				double t=std::chrono::duration<double>(end-start).count();
+#if defined(WIN32) && !defined(RAY_NO_GUI)
 				fl_message( "total time = %.3f seconds\n", t); 
 #else
 				fprintf( stderr, "total time = %.3f seconds\n", t); 
@@ -191,11 +329,14 @@ int main(int argc, char **argv) {
 			}
 		}
 
-		return 1;
-	} else {
+		return theRayTracer->sceneLoaded() ? 0 : 1;
+	}
+#ifndef RAY_NO_GUI
+	else {
 		// graphics mode
 		traceUI=new TraceUI();
 		theRayTracer=new RayTracer();
+		theRayTracer->setThreads(g_threads);
 
 		traceUI->setRayTracer(theRayTracer);
 
@@ -205,4 +346,5 @@ int main(int argc, char **argv) {
 
 		return Fl::run();
 	}
+#endif
 }
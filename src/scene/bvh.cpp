@@ -0,0 +1,648 @@
+#include <cmath>
+#include <float.h>
+
+#include "bvh.h"
+#include "scene.h"
+#include "../ThreadPool.h"
+
+// Number of buckets the centroid range is split into when looking for
+// the cheapest SAH partition.
+static const int NUM_BINS = 16;
+
+// The top of the tree is built a node at a time, with every node's
+// primitives binned and partitioned in pieces of BUILD_GRAIN on the pool;
+// subtrees of fewer than SUBTREE_SIZE primitives are then built whole, one
+// per task.
+static const int BUILD_GRAIN = 1 << 13;
+static const int SUBTREE_SIZE = 1 << 15;
+
+struct BVH::BuildPrim
+{
+	int		index;
+	vec3f	min;
+	vec3f	max;
+	vec3f	centroid;
+};
+
+// Bounds of the boxes and of the centroids of a range of primitives
+struct BVH::BuildRange
+{
+	int		begin, end;
+	vec3f	bmin, bmax;
+	vec3f	cmin, cmax;
+
+	void add( const BuildPrim& p )
+	{
+		if( end == begin ) {
+			bmin = p.min;
+			bmax = p.max;
+			cmin = cmax = p.centroid;
+		} else {
+			bmin = minimum( bmin, p.min );
+			bmax = maximum( bmax, p.max );
+			cmin = minimum( cmin, p.centroid );
+			cmax = maximum( cmax, p.centroid );
+		}
+		++end;
+	}
+
+	// r follows this range directly
+	void merge( const BuildRange& r )
+	{
+		if( r.end == r.begin )
+			return;
+		if( end == begin ) {
+			bmin = r.bmin;
+			bmax = r.bmax;
+			cmin = r.cmin;
+			cmax = r.cmax;
+		} else {
+			bmin = minimum( bmin, r.bmin );
+			bmax = maximum( bmax, r.bmax );
+			cmin = minimum( cmin, r.cmin );
+			cmax = maximum( cmax, r.cmax );
+		}
+		end = r.end;
+	}
+};
+
+// The SAH bins of all three axes.  The boxes are plain arrays, so that
+// the bins of a small node cost nothing to set up.
+struct BVH::BuildBins
+{
+	int		count[3][ NUM_BINS ];
+	vreal	min[3][ NUM_BINS ][3];
+	vreal	max[3][ NUM_BINS ][3];
+
+	BuildBins()
+	{
+		for( int axis = 0; axis < 3; ++axis )
+			for( int b = 0; b < NUM_BINS; ++b )
+				count[axis][b] = 0;
+	}
+
+	void add( int axis, int b, const vec3f& bmin, const vec3f& bmax, int n )
+	{
+		vreal* lo = min[axis][b];
+		vreal* hi = max[axis][b];
+		if( count[axis][b] == 0 ) {
+			for( int k = 0; k < 3; ++k ) {
+				lo[k] = bmin[k];
+				hi[k] = bmax[k];
+			}
+		} else {
+			for( int k = 0; k < 3; ++k ) {
+				lo[k] = std::min( lo[k], bmin[k] );
+				hi[k] = std::max( hi[k], bmax[k] );
+			}
+		}
+		count[axis][b] += n;
+	}
+
+	void merge( const BuildBins& bins )
+	{
+		for( int axis = 0; axis < 3; ++axis )
+			for( int b = 0; b < NUM_BINS; ++b )
+				if( bins.count[axis][b] )
+					add( axis, b, bins.binMin( axis, b ), bins.binMax( axis, b ), bins.count[axis][b] );
+	}
+
+	vec3f binMin( int axis, int b ) const
+	{ return vec3f( min[axis][b][0], min[axis][b][1], min[axis][b][2] ); }
+	vec3f binMax( int axis, int b ) const
+	{ return vec3f( max[axis][b][0], max[axis][b][1], max[axis][b][2] ); }
+};
+
+// A subtree left to a task by the top of the build, and what it built
+struct BVH::Subtree
+{
+	int		begin, end;
+	int		depth;
+	BuildPrim*	data;		// prims or the scratch array, whichever has them
+	std::vector<BVHNode>	nodes;
+	std::vector<int>		primitives;
+};
+
+// Round a double bound outwards to the nearest float so the stored box
+// still contains the original one.
+static float roundDown( double v )
+{
+	float f = (float)v;
+	if( f > v )
+		f = nextafterf( f, -FLT_MAX );
+	return f;
+}
+
+static float roundUp( double v )
+{
+	float f = (float)v;
+	if( f < v )
+		f = nextafterf( f, FLT_MAX );
+	return f;
+}
+
+static double halfArea( const vec3f& min, const vec3f& max )
+{
+	vec3f d = max - min;
+	return d[0]*d[1] + d[1]*d[2] + d[2]*d[0];
+}
+
+static int binOf( double centroid, double cmin, double extent )
+{
+	int b = (int)( NUM_BINS * (centroid - cmin) / extent );
+	return b >= NUM_BINS ? NUM_BINS - 1 : b;
+}
+
+void BVH::clear()
+{
+	nodes.clear();
+	primitives.clear();
+}
+
+void BVH::build( const std::vector<BoundingBox>& boxes, int leafBatch, ThreadPool* pool )
+{
+	clear();
+	this->leafBatch = leafBatch > 0 ? leafBatch : 1;
+
+	int n = boxes.size();
+	if( n == 0 )
+		return;
+
+	std::vector<BuildPrim> prims( n );
+	ThreadPool::forRange( pool, n, BUILD_GRAIN, [&]( int begin, int end ) {
+		for( int i = begin; i < end; ++i ) {
+			prims[i].index = i;
+			prims[i].min = boxes[i].min;
+			prims[i].max = boxes[i].max;
+			prims[i].centroid = (boxes[i].min + boxes[i].max) * 0.5;
+		}
+	} );
+
+	if( n < SUBTREE_SIZE ) {
+		nodes.reserve( 2 * n );
+		primitives.reserve( n );
+		buildRecursive( prims, 0, n, 0, nodes, primitives );
+		return;
+	}
+
+	std::vector<BuildPrim> scratch( n );
+	std::vector<Subtree> subtrees;
+	buildTop( &prims[0], &scratch[0], 0, n, 0, subtrees, pool );
+
+	ThreadPool::forRange( pool, subtrees.size(), 1, [&]( int k, int ) {
+		Subtree& t = subtrees[k];
+		if( t.data != &prims[0] )
+			std::copy( t.data + t.begin, t.data + t.end, prims.begin() + t.begin );
+		buildRecursive( prims, t.begin, t.end, t.depth, t.nodes, t.primitives );
+	} );
+	std::vector<BuildPrim>().swap( scratch );
+
+	// put the subtrees in place of their stand-ins, keeping the nodes in
+	// depth-first order
+	std::vector<BVHNode> top;
+	top.swap( nodes );
+	std::vector<int> moved( top.size() );
+	nodes.reserve( 2 * n );
+	primitives.reserve( n );
+	for( size_t i = 0; i < top.size(); ++i ) {
+		moved[i] = nodes.size();
+		if( top[i].count >= 0 ) {
+			nodes.push_back( top[i] );
+			continue;
+		}
+
+		Subtree& t = subtrees[ -top[i].count - 1 ];
+		int base = nodes.size();
+		int primBase = primitives.size();
+		for( size_t k = 0; k < t.nodes.size(); ++k ) {
+			BVHNode node = t.nodes[k];
+			node.offset += node.count > 0 ? primBase : base;
+			nodes.push_back( node );
+		}
+		primitives.insert( primitives.end(), t.primitives.begin(), t.primitives.end() );
+		std::vector<BVHNode>().swap( t.nodes );
+		std::vector<int>().swap( t.primitives );
+	}
+	for( size_t i = 0; i < top.size(); ++i ) {
+		if( top[i].count == 0 )
+			nodes[ moved[i] ].offset = moved[ top[i].offset ];
+	}
+}
+
+bool BVH::assign( const BVHNode* treeNodes, int numNodes, const int* treePrimitives,
+	int numPrimitives, int leafBatch )
+{
+	clear();
+	if( numNodes < 1 || numPrimitives < 0 )
+		return false;
+
+	// every node must be reached exactly once from the root, and the walks
+	// must fit the stacks of traverse and the packet walk
+	std::vector<char> seen( numNodes, 0 );
+	std::vector<std::pair<int, int> > todo( 1, std::make_pair( 0, 0 ) );
+	int reached = 0;
+	while( !todo.empty() ) {
+		int n = todo.back().first;
+		int depth = todo.back().second;
+		todo.pop_back();
+		if( seen[n] )
+			return false;
+		seen[n] = 1;
+		++reached;
+
+		const BVHNode& node = treeNodes[n];
+		if( node.count > 0 ) {
+			if( node.offset < 0 || node.count > numPrimitives - node.offset )
+				return false;
+		} else if( node.count < 0 || depth >= MAX_DEPTH || n + 1 >= numNodes ||
+			node.offset <= n + 1 || node.offset >= numNodes ) {
+			return false;
+		} else {
+			todo.push_back( std::make_pair( node.offset, depth + 1 ) );
+			todo.push_back( std::make_pair( n + 1, depth + 1 ) );
+		}
+	}
+	if( reached != numNodes )
+		return false;
+	for( int k = 0; k < numPrimitives; ++k )
+		if( treePrimitives[k] < 0 || treePrimitives[k] >= numPrimitives )
+			return false;
+
+	nodes.assign( treeNodes, treeNodes + numNodes );
+	primitives.assign( treePrimitives, treePrimitives + numPrimitives );
+	this->leafBatch = leafBatch > 0 ? leafBatch : 1;
+	return true;
+}
+
+// Bin the primitives of r on every axis its centroids extend along.
+void BVH::binPrims( const BuildPrim* prims, int begin, int end,
+	const BuildRange& r, BuildBins& bins )
+{
+	for( int axis = 0; axis < 3; ++axis ) {
+		double extent = r.cmax[axis] - r.cmin[axis];
+		if( extent <= 0.0 )
+			continue;
+		for( int i = begin; i < end; ++i )
+			bins.add( axis, binOf( prims[i].centroid[axis], r.cmin[axis], extent ),
+				prims[i].min, prims[i].max, 1 );
+	}
+}
+
+// How to split the primitives of r, given their bins: at bin boundary
+// split on axis; on axis -1, in half, if no plane separates them; or,
+// returning false, not at all.
+bool BVH::chooseSplit( const BuildRange& r, const BuildBins& bins, int depth,
+	int& axis, int& split ) const
+{
+	int count = r.end - r.begin;
+	if( count <= 1 || depth >= MAX_DEPTH )
+		return false;
+
+	// evaluate the SAH at every bin boundary on all three axes
+	double bestCost = DBL_MAX;
+	int bestAxis = -1;
+	int bestSplit = -1;
+
+	for( int a = 0; a < 3; ++a ) {
+		if( r.cmax[a] - r.cmin[a] <= 0.0 )
+			continue;
+
+		const int* binCount = bins.count[a];
+
+		// sweep from the right to get the area and count of every suffix
+		double rightArea[ NUM_BINS ];
+		int rightCount[ NUM_BINS ];
+		vec3f rmin, rmax;
+		int rc = 0;
+		for( int b = NUM_BINS - 1; b > 0; --b ) {
+			if( binCount[b] ) {
+				if( rc == 0 ) {
+					rmin = bins.binMin( a, b );
+					rmax = bins.binMax( a, b );
+				} else {
+					rmin = minimum( rmin, bins.binMin( a, b ) );
+					rmax = maximum( rmax, bins.binMax( a, b ) );
+				}
+				rc += binCount[b];
+			}
+			rightCount[b] = rc;
+			rightArea[b] = rc ? halfArea( rmin, rmax ) : 0.0;
+		}
+
+		// then from the left, pricing the split in front of every bin
+		vec3f lmin, lmax;
+		int lc = 0;
+		for( int b = 0; b < NUM_BINS - 1; ++b ) {
+			if( binCount[b] ) {
+				if( lc == 0 ) {
+					lmin = bins.binMin( a, b );
+					lmax = bins.binMax( a, b );
+				} else {
+					lmin = minimum( lmin, bins.binMin( a, b ) );
+					lmax = maximum( lmax, bins.binMax( a, b ) );
+				}
+				lc += binCount[b];
+			}
+			if( lc == 0 || rightCount[b + 1] == 0 )
+				continue;
+
+			double cost = batches( lc ) * halfArea( lmin, lmax )
+				+ batches( rightCount[b + 1] ) * rightArea[b + 1];
+			if( cost < bestCost ) {
+				bestCost = cost;
+				bestAxis = a;
+				bestSplit = b;
+			}
+		}
+	}
+
+	double area = halfArea( r.bmin, r.bmax );
+	// traversal cost of one interior node relative to one primitive test
+	double leafCost = batches( count );
+	double splitCost = 1.0 + (area > 0.0 ? bestCost / area : leafCost);
+	int maxLeafSize = leafBatch > MAX_LEAF_SIZE ? leafBatch : MAX_LEAF_SIZE;
+
+	axis = bestAxis;
+	split = bestSplit;
+	if( bestAxis >= 0 )
+		return count > maxLeafSize || splitCost < leafCost;
+	// all the centroids coincide; no plane separates them, so just
+	// halve the list to keep leaves small
+	return count > maxLeafSize;
+}
+
+BVHNode BVH::boundsNode( const BuildRange& r )
+{
+	BVHNode node;
+	for( int k = 0; k < 3; ++k ) {
+		node.bmin[k] = roundDown( r.bmin[k] );
+		node.bmax[k] = roundUp( r.bmax[k] );
+	}
+	node.offset = 0;
+	node.count = 0;
+	return node;
+}
+
+// Builds the subtree over prims[begin, end) into out and outPrims, and
+// returns the index of its root node.
+int BVH::buildRecursive( std::vector<BuildPrim>& prims, int begin, int end, int depth,
+	std::vector<BVHNode>& out, std::vector<int>& outPrims ) const
+{
+	BuildRange r;
+	r.begin = begin;
+	r.end = end;
+	r.bmin = prims[begin].min;
+	r.bmax = prims[begin].max;
+	r.cmin = r.cmax = prims[begin].centroid;
+	for( int i = begin + 1; i < end; ++i ) {
+		r.bmin = minimum( r.bmin, prims[i].min );
+		r.bmax = maximum( r.bmax, prims[i].max );
+		r.cmin = minimum( r.cmin, prims[i].centroid );
+		r.cmax = maximum( r.cmax, prims[i].centroid );
+	}
+
+	int nodeIndex = out.size();
+	out.push_back( boundsNode( r ) );
+
+	int count = end - begin;
+	int mid = -1;
+	int axis, split;
+	BuildBins bins;
+	if( count > 1 && depth < MAX_DEPTH )
+		binPrims( &prims[0], begin, end, r, bins );
+	if( chooseSplit( r, bins, depth, axis, split ) ) {
+		if( axis >= 0 ) {
+			double extent = r.cmax[axis] - r.cmin[axis];
+			int i = begin;
+			int j = end - 1;
+			while( i <= j ) {
+				if( binOf( prims[i].centroid[axis], r.cmin[axis], extent ) <= split ) {
+					++i;
+				} else {
+					std::swap( prims[i], prims[j] );
+					--j;
+				}
+			}
+			mid = i;
+		} else {
+			mid = begin + count / 2;
+		}
+	}
+
+	if( mid <= begin || mid >= end ) {
+		out[nodeIndex].offset = outPrims.size();
+		out[nodeIndex].count = count;
+		for( int i = begin; i < end; ++i )
+			outPrims.push_back( prims[i].index );
+		return nodeIndex;
+	}
+
+	buildRecursive( prims, begin, mid, depth + 1, out, outPrims );
+	int second = buildRecursive( prims, mid, end, depth + 1, out, outPrims );
+	out[nodeIndex].offset = second;
+	out[nodeIndex].count = 0;
+
+	return nodeIndex;
+}
+
+// The top of the tree, over prims[begin, end), into nodes.  The nodes
+// are the final ones except that a subtree small enough for one task is
+// only a stand-in, with count -1 - its number in subtrees.  The
+// partitioning is stable, so that the order of the primitives, and with
+// it the tree, doesn't depend on the pool.  It moves the primitives to
+// the same range of scratch, which the children then partition back into
+// prims, so a subtree's primitives may end up in either array.
+int BVH::buildTop( BuildPrim* prims, BuildPrim* scratch, int begin, int end, int depth,
+	std::vector<Subtree>& subtrees, ThreadPool* pool )
+{
+	int nodeIndex = nodes.size();
+	int count = end - begin;
+
+	int axis = -1, split = -1;
+	BuildRange r;
+	bool leaf = count < SUBTREE_SIZE;
+	if( !leaf ) {
+		int pieces = (count + BUILD_GRAIN - 1) / BUILD_GRAIN;
+		std::vector<BuildRange> ranges( pieces );
+		std::vector<BuildBins> pieceBins( pieces );
+		ThreadPool::forRange( pool, count, BUILD_GRAIN, [&]( int b, int e ) {
+			BuildRange& piece = ranges[ b / BUILD_GRAIN ];
+			piece.begin = piece.end = begin + b;
+			for( int i = begin + b; i < begin + e; ++i )
+				piece.add( prims[i] );
+		} );
+		r = ranges[0];
+		for( int p = 1; p < pieces; ++p )
+			r.merge( ranges[p] );
+
+		ThreadPool::forRange( pool, count, BUILD_GRAIN, [&]( int b, int e ) {
+			binPrims( prims, begin + b, begin + e, r, pieceBins[ b / BUILD_GRAIN ] );
+		} );
+		BuildBins bins;
+		for( int p = 0; p < pieces; ++p )
+			bins.merge( pieceBins[p] );
+
+		// a leaf after all, if there is no split; buildRecursive then
+		// makes the same choice
+		leaf = !chooseSplit( r, bins, depth, axis, split );
+	}
+
+	if( leaf ) {
+		subtrees.push_back( Subtree() );
+		Subtree& t = subtrees.back();
+		t.begin = begin;
+		t.end = end;
+		t.depth = depth;
+		t.data = prims;
+		nodes.push_back( BVHNode() );
+		nodes[nodeIndex].offset = 0;
+		nodes[nodeIndex].count = -(int)subtrees.size();
+		return nodeIndex;
+	}
+
+	nodes.push_back( boundsNode( r ) );
+
+	if( axis < 0 ) {
+		int mid = begin + count / 2;
+		buildTop( prims, scratch, begin, mid, depth + 1, subtrees, pool );
+		int second = buildTop( prims, scratch, mid, end, depth + 1, subtrees, pool );
+		nodes[nodeIndex].offset = second;
+		return nodeIndex;
+	}
+
+	// count the left side of every piece, then move each piece's
+	// primitives to their places on either side
+	int pieces = (count + BUILD_GRAIN - 1) / BUILD_GRAIN;
+	double extent = r.cmax[axis] - r.cmin[axis];
+	std::vector<int> left( pieces ), leftAt( pieces ), rightAt( pieces );
+	ThreadPool::forRange( pool, count, BUILD_GRAIN, [&]( int b, int e ) {
+		int n = 0;
+		for( int i = begin + b; i < begin + e; ++i )
+			if( binOf( prims[i].centroid[axis], r.cmin[axis], extent ) <= split )
+				++n;
+		left[ b / BUILD_GRAIN ] = n;
+	} );
+	int totalLeft = 0;
+	for( int p = 0; p < pieces; ++p )
+		totalLeft += left[p];
+	int l = begin, rt = begin + totalLeft;
+	for( int p = 0; p < pieces; ++p ) {
+		int size = p == pieces - 1 ? count - p * BUILD_GRAIN : BUILD_GRAIN;
+		leftAt[p] = l;
+		rightAt[p] = rt;
+		l += left[p];
+		rt += size - left[p];
+	}
+	ThreadPool::forRange( pool, count, BUILD_GRAIN, [&]( int b, int e ) {
+		int l = leftAt[ b / BUILD_GRAIN ], rt = rightAt[ b / BUILD_GRAIN ];
+		for( int i = begin + b; i < begin + e; ++i ) {
+			if( binOf( prims[i].centroid[axis], r.cmin[axis], extent ) <= split )
+				scratch[ l++ ] = prims[i];
+			else
+				scratch[ rt++ ] = prims[i];
+		}
+	} );
+
+	int mid = begin + totalLeft;
+	buildTop( scratch, prims, begin, mid, depth + 1, subtrees, pool );
+	int second = buildTop( scratch, prims, mid, end, depth + 1, subtrees, pool );
+	nodes[nodeIndex].offset = second;
+	return nodeIndex;
+}
+
+void BVHPacket::set( int k, const ray& r, double tMax )
+{
+	vec3f p = r.getPosition();
+	vec3f d = r.getDirection();
+	for( int a = 0; a < 3; ++a ) {
+		o[a][k] = p[a];
+		invD[a][k] = 1.0 / d[a];
+	}
+	this->tMax[k] = tMax;
+	if( k >= count )
+		count = k + 1;
+}
+
+void BVHPacket::finish()
+{
+	useIntervals = count > 0;
+	for( int a = 0; a < 3; ++a ) {
+		oMin[a] = oMax[a] = o[a][0];
+		invMin[a] = invMax[a] = invD[a][0];
+		for( int k = 1; k < count; ++k ) {
+			oMin[a] = std::min( oMin[a], o[a][k] );
+			oMax[a] = std::max( oMax[a], o[a][k] );
+			invMin[a] = std::min( invMin[a], invD[a][k] );
+			invMax[a] = std::max( invMax[a], invD[a][k] );
+		}
+		// the intervals only bound the slab distances if no direction is
+		// parallel to the slabs and they all cross them the same way
+		if( !(invMin[a] > 0.0 || invMax[a] < 0.0) || !(fabs( invMin[a] ) < DBL_MAX) ||
+			!(fabs( invMax[a] ) < DBL_MAX) )
+			useIntervals = false;
+	}
+}
+
+// Same test as BVHRay::hits, on all the rays at once.
+unsigned BVHPacket::hits( const BVHNode& n, unsigned mask, double& tNear ) const
+{
+	double t0[ PACKET_SIZE ];
+	double t1[ PACKET_SIZE ];
+	for( int k = 0; k < count; ++k ) {
+		t0[k] = 0.0;
+		t1[k] = tMax[k];
+	}
+	for( int a = 0; a < 3; ++a ) {
+		for( int k = 0; k < count; ++k ) {
+			double ta = (n.bmin[a] - o[a][k]) * invD[a][k];
+			double tb = (n.bmax[a] - o[a][k]) * invD[a][k];
+			double lo = ta > tb ? tb : ta;
+			double hi = ta > tb ? ta : tb;
+			t0[k] = lo > t0[k] ? lo : t0[k];
+			t1[k] = hi < t1[k] ? hi : t1[k];
+		}
+	}
+
+	unsigned result = 0;
+	tNear = DBL_MAX;
+	for( int k = 0; k < count; ++k ) {
+		if( (mask & (1u << k)) && t0[k] <= t1[k] ) {
+			result |= 1u << k;
+			tNear = std::min( tNear, t0[k] );
+		}
+	}
+	return result;
+}
+
+// Interval version of the slab test: bounds every ray's entry and exit
+// distance at once.
+bool BVHPacket::missesAll( const BVHNode& n ) const
+{
+	if( !useIntervals )
+		return false;
+
+	double t0 = 0.0;
+	double t1 = tMax[0];
+	for( int k = 1; k < count; ++k )
+		t1 = std::max( t1, tMax[k] );
+
+	for( int a = 0; a < 3; ++a ) {
+		// near and far planes of the slab; the same for the whole packet
+		double pNear = invMin[a] > 0.0 ? n.bmin[a] : n.bmax[a];
+		double pFar = invMin[a] > 0.0 ? n.bmax[a] : n.bmin[a];
+
+		// lower bound of (pNear - o) * invD and upper bound of (pFar - o) * invD
+		double dn0 = pNear - oMax[a], dn1 = pNear - oMin[a];
+		double df0 = pFar - oMax[a], df1 = pFar - oMin[a];
+		double nearLo = std::min( std::min( dn0 * invMin[a], dn0 * invMax[a] ),
+			std::min( dn1 * invMin[a], dn1 * invMax[a] ) );
+		double farHi = std::max( std::max( df0 * invMin[a], df0 * invMax[a] ),
+			std::max( df1 * invMin[a], df1 * invMax[a] ) );
+
+		t0 = std::max( t0, nearLo );
+		t1 = std::min( t1, farHi );
+		if( t0 > t1 )
+			return true;
+	}
+	return false;
+}
@@ -0,0 +1,367 @@
+//
+// bvh.h
+//
+// A bounding volume hierarchy over a set of axis-aligned boxes.  The tree
+// is built top-down with a binned surface area heuristic and stored as a
+// flat array of nodes in depth-first order: the first child of an interior
+// node is always the node right after it, and only the second child's index
+// has to be stored.
+//
+// Rays can walk the tree one at a time or as a packet of up to PACKET_SIZE
+// rays that visit the nodes together.
+//
+
+#ifndef __BVH_H__
+#define __BVH_H__
+
+#include <vector>
+#include <algorithm>
+
+#include "ray.h"
+
+class BoundingBox;
+class ThreadPool;
+
+// 32 bytes, so two nodes share a cache line.  The bounds are stored in
+// single precision, rounded outwards so the boxes stay conservative.
+struct BVHNode
+{
+	float	bmin[3];
+	float	bmax[3];
+	int		offset;		// leaf: first entry in primitives; interior: index of the second child
+	int		count;		// leaf: number of primitives; interior: 0
+};
+
+// Per-ray data for the slab test, computed once per traversal.
+class BVHRay
+{
+public:
+	BVHRay( const ray& r )
+	{
+		vec3f p = r.getPosition();
+		vec3f d = r.getDirection();
+		for( int k = 0; k < 3; ++k ) {
+			o[k] = p[k];
+			invD[k] = 1.0 / d[k];
+		}
+	}
+
+	// Does the ray enter the node's box somewhere in [0, tMax]?  The entry
+	// distance goes into tNear.  A zero direction component gives an infinite
+	// inverse; the NaNs that can produce fail the comparisons below and are
+	// simply ignored, which keeps the test conservative.
+	bool hits( const BVHNode& n, double tMax, double& tNear ) const
+	{
+		double t0 = 0.0;
+		double t1 = tMax;
+		for( int k = 0; k < 3; ++k ) {
+			double ta = (n.bmin[k] - o[k]) * invD[k];
+			double tb = (n.bmax[k] - o[k]) * invD[k];
+			if( ta > tb ) {
+				double tmp = ta;
+				ta = tb;
+				tb = tmp;
+			}
+			t0 = ta > t0 ? ta : t0;
+			t1 = tb < t1 ? tb : t1;
+			if( t0 > t1 )
+				return false;
+		}
+		tNear = t0;
+		return true;
+	}
+
+	double o[3];
+	double invD[3];
+};
+
+// Rays traced together, e.g. the primary rays of a 4x4 block of pixels.
+const int PACKET_SIZE = 16;
+
+// Slab test data for a packet, one array per coordinate so the per-ray
+// tests run across the packet.  Besides the rays themselves it keeps
+// intervals over their origins and inverse directions: when the interval
+// test rejects a box, no ray in the packet can hit it.
+class BVHPacket
+{
+public:
+	BVHPacket() : count( 0 ), useIntervals( false ) {}
+
+	// Ray k, which only counts hits closer than tMax.  Call finish() once
+	// all the rays are in.
+	void set( int k, const ray& r, double tMax );
+	void finish();
+
+	// Bit k set for every ray in mask that enters the node's box before its
+	// tMax.  The smallest entry distance of those goes into tNear.
+	unsigned hits( const BVHNode& n, unsigned mask, double& tNear ) const;
+
+	// Conservative: true only if no ray of the packet can reach the box.
+	bool missesAll( const BVHNode& n ) const;
+
+	int		count;
+	double	o[3][ PACKET_SIZE ];
+	double	invD[3][ PACKET_SIZE ];
+	double	tMax[ PACKET_SIZE ];
+
+private:
+	bool	useIntervals;		// false if the directions differ in sign on some axis
+	double	oMin[3], oMax[3];
+	double	invMin[3], invMax[3];
+};
+
+// Number of bits set in a ray mask.
+inline int countRays( unsigned mask )
+{
+	int n = 0;
+	for( ; mask; mask &= mask - 1 )
+		++n;
+	return n;
+}
+
+class BVH
+{
+public:
+	BVH() : leafBatch( 1 ) {}
+
+	// (Re)build the tree over boxes.  Primitives are referred to by their
+	// index in boxes.  leafBatch says how many primitives the caller tests
+	// at once: the SAH then prices a leaf by the number of batches in it,
+	// and leaves grow to up to leafBatch primitives.  With a pool, big
+	// trees are built in parallel; the tree is the same either way.
+	void build( const std::vector<BoundingBox>& boxes, int leafBatch = 1,
+		ThreadPool* pool = NULL );
+	// Take a tree some earlier build made, e.g. one stored in a file, over
+	// numPrimitives primitives.  Returns false, and leaves the tree empty,
+	// if it isn't a well-formed tree of no more than MAX_DEPTH levels.
+	bool assign( const BVHNode* nodes, int numNodes, const int* primitives,
+		int numPrimitives, int leafBatch );
+	void clear();
+
+	bool empty() const { return nodes.empty(); }
+	const std::vector<BVHNode>& getNodes() const { return nodes; }
+	const std::vector<int>& getPrimitives() const { return primitives; }
+
+	// Walk the tree front-to-back along r.  For every primitive in a leaf the
+	// ray reaches before tMax, hit( prim, tMax ) is called; it should return
+	// true and lower tMax if it found a closer intersection.  Subtrees that
+	// start beyond the closest hit found so far are skipped.  The walk can
+	// start at any node, and then only covers its subtree.
+	template <class PrimHit>
+	bool intersect( const ray& r, double& tMax, PrimHit& hit, int root = 0 ) const
+	{
+		PrimitiveLeafHit<PrimHit> leafHit( nodes, primitives, hit );
+		return traverse( r, tMax, leafHit, root );
+	}
+
+	// Same walk, but the callback gets whole leaves: leafHit( node, tMax ),
+	// with node the index of the leaf in getNodes().
+	template <class LeafHit>
+	bool traverse( const ray& r, double& tMax, LeafHit& leafHit, int root = 0 ) const
+	{
+		if( nodes.empty() )
+			return false;
+
+		BVHRay q( r );
+		double tNear;
+		if( !q.hits( nodes[root], tMax, tNear ) )
+			return false;
+
+		StackEntry stack[ MAX_DEPTH + 1 ];
+		int sp = 0;
+		int cur = root;
+		bool have_one = false;
+
+		while( true ) {
+			const BVHNode& n = nodes[cur];
+			if( n.count > 0 ) {
+				if( leafHit( cur, tMax ) )
+					have_one = true;
+			} else {
+				// visit the nearer child first, come back for the other one
+				int first = cur + 1;
+				int second = n.offset;
+				double tFirst, tSecond;
+				bool hitFirst = q.hits( nodes[first], tMax, tFirst );
+				bool hitSecond = q.hits( nodes[second], tMax, tSecond );
+				if( hitFirst && hitSecond ) {
+					if( tSecond < tFirst ) {
+						int tmp = first;
+						first = second;
+						second = tmp;
+						double ttmp = tFirst;
+						tFirst = tSecond;
+						tSecond = ttmp;
+					}
+					stack[ sp ].node = second;
+					stack[ sp ].tNear = tSecond;
+					++sp;
+					cur = first;
+					continue;
+				} else if( hitFirst ) {
+					cur = first;
+					continue;
+				} else if( hitSecond ) {
+					cur = second;
+					continue;
+				}
+			}
+
+			// pop the next subtree that still starts before the closest hit
+			bool found = false;
+			while( sp > 0 ) {
+				--sp;
+				if( stack[ sp ].tNear <= tMax ) {
+					cur = stack[ sp ].node;
+					found = true;
+					break;
+				}
+			}
+			if( !found )
+				break;
+		}
+
+		return have_one;
+	}
+
+	// Walk the tree with the rays of p in mask together.  At a leaf,
+	// packetHit.leaf( node, mask ) gets the rays that reach it; it should
+	// lower p.tMax[k] for every ray k that hits something closer.  Once no
+	// more than MIN_PACKET_RAYS rays of the packet reach a subtree, the
+	// packet has diverged, and each of those rays finishes that subtree on
+	// its own through packetHit.single( k, node ).
+	template <class PacketHit>
+	void traversePacket( BVHPacket& p, unsigned mask, PacketHit& packetHit ) const
+	{
+		if( nodes.empty() )
+			return;
+
+		double tNear;
+		if( p.missesAll( nodes[0] ) || !(mask = p.hits( nodes[0], mask, tNear )) )
+			return;
+
+		PacketEntry stack[ MAX_DEPTH + 1 ];
+		int sp = 0;
+		int cur = 0;
+
+		while( true ) {
+			const BVHNode& n = nodes[cur];
+			if( countRays( mask ) <= MIN_PACKET_RAYS ) {
+				for( int k = 0; k < p.count; ++k )
+					if( mask & (1u << k) )
+						packetHit.single( k, cur );
+			} else if( n.count > 0 ) {
+				packetHit.leaf( cur, mask );
+			} else {
+				int first = cur + 1;
+				int second = n.offset;
+				double tFirst = 0.0, tSecond = 0.0;
+				unsigned maskFirst = p.missesAll( nodes[first] ) ? 0 : p.hits( nodes[first], mask, tFirst );
+				unsigned maskSecond = p.missesAll( nodes[second] ) ? 0 : p.hits( nodes[second], mask, tSecond );
+				if( maskFirst && maskSecond ) {
+					if( tSecond < tFirst ) {
+						std::swap( first, second );
+						std::swap( maskFirst, maskSecond );
+					}
+					stack[ sp ].node = second;
+					stack[ sp ].mask = maskSecond;
+					++sp;
+					cur = first;
+					mask = maskFirst;
+					continue;
+				} else if( maskFirst ) {
+					cur = first;
+					mask = maskFirst;
+					continue;
+				} else if( maskSecond ) {
+					cur = second;
+					mask = maskSecond;
+					continue;
+				}
+			}
+
+			// pop the next subtree, keeping only the rays whose closest hit
+			// so far is still beyond its box
+			bool found = false;
+			while( sp > 0 ) {
+				--sp;
+				mask = p.hits( nodes[ stack[ sp ].node ], stack[ sp ].mask, tNear );
+				if( mask ) {
+					cur = stack[ sp ].node;
+					found = true;
+					break;
+				}
+			}
+			if( !found )
+				break;
+		}
+	}
+
+	// Leaves hold at most this many primitives, or leafBatch if that's more,
+	// unless the build runs out of depth or cannot separate them.
+	static const int MAX_LEAF_SIZE = 4;
+	static const int MAX_DEPTH = 64;
+	static const int MIN_PACKET_RAYS = 2;
+
+private:
+	struct StackEntry
+	{
+		int		node;
+		double	tNear;
+	};
+
+	struct PacketEntry
+	{
+		int			node;
+		unsigned	mask;
+	};
+
+	// Turns a per-primitive callback into a per-leaf one for intersect().
+	template <class PrimHit>
+	class PrimitiveLeafHit
+	{
+	public:
+		PrimitiveLeafHit( const std::vector<BVHNode>& nodes, const std::vector<int>& prims,
+			PrimHit& hit )
+			: nodes( nodes ), prims( prims ), hit( hit ) {}
+
+		bool operator()( int node, double& tMax ) const
+		{
+			const BVHNode& n = nodes[ node ];
+			bool have_one = false;
+			for( int k = 0; k < n.count; ++k ) {
+				if( hit( prims[ n.offset + k ], tMax ) )
+					have_one = true;
+			}
+			return have_one;
+		}
+
+	private:
+		const std::vector<BVHNode>& nodes;
+		const std::vector<int>& prims;
+		PrimHit& hit;
+	};
+
+	struct BuildPrim;
+	struct BuildRange;
+	struct BuildBins;
+	struct Subtree;
+
+	static void binPrims( const BuildPrim* prims, int begin, int end,
+		const BuildRange& r, BuildBins& bins );
+	static BVHNode boundsNode( const BuildRange& r );
+
+	bool chooseSplit( const BuildRange& r, const BuildBins& bins, int depth,
+		int& axis, int& split ) const;
+	int buildRecursive( std::vector<BuildPrim>& prims, int begin, int end, int depth,
+		std::vector<BVHNode>& out, std::vector<int>& outPrims ) const;
+	int buildTop( BuildPrim* prims, BuildPrim* scratch, int begin, int end, int depth,
+		std::vector<Subtree>& subtrees, ThreadPool* pool );
+	int batches( int count ) const { return (count + leafBatch - 1) / leafBatch; }
+
+	std::vector<BVHNode> nodes;
+	std::vector<int> primitives;	// primitive indices, in leaf order
+	int leafBatch;					// of the last build
+};
+
+#endif // __BVH_H__
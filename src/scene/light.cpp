@@ -1,31 +1,206 @@
 #include <cmath>
 
 #include "light.h"
+#include "sampler.h"
+#include "raystats.h"
 
-#include <FL/fl_ask.H>
+vec3f Light::shadowAttenuation( const vec3f& P ) const
+{
+	double distance;
+	ray r = shadowRay(P, distance);
+	++RayStats::forThread().shadowRays;
 
-double DirectionalLight::distanceAttenuation( const vec3f& P ) const
+	isect i;
+	switch (scene->occluded(r, distance, i)) {
+	case Scene::OPAQUE:
+		return vec3f(0,0,0);
+	case Scene::TRANSPARENT:
+		// go on from the nearest blocker
+		return prod(i.getTransmissive(), shadowAttenuation(r.at(i.t)));
+	default:
+		return vec3f(1,1,1);
+	}
+}
+
+void Light::shadowAttenuation( const vec3f* P, int count, vec3f* atten ) const
 {
-	// distance to light is infinite, so f(di) goes to 0.  Return 1.
-	return 1.0;
+	if (sampled()) {
+		for (int k = 0; k < count; ++k)
+			atten[k] = shadowAttenuation(P[k]);
+		return;
+	}
+
+	ray r[ PACKET_SIZE ];
+	double distance[ PACKET_SIZE ];
+	isect i[ PACKET_SIZE ];
+	Scene::Occlusion result[ PACKET_SIZE ];
+
+	for (int k = 0; k < count; ++k)
+		r[k] = shadowRay(P[k], distance[k]);
+	RayStats::forThread().shadowRays += count;
+
+	scene->occludedPacket(r, count, distance, i, result);
+
+	// whatever is behind a transparent blocker goes on one ray at a time
+	for (int k = 0; k < count; ++k) {
+		if (result[k] == Scene::OPAQUE)
+			atten[k] = vec3f(0,0,0);
+		else if (result[k] == Scene::TRANSPARENT)
+			atten[k] = prod(i[k].getTransmissive(), shadowAttenuation(r[k].at(i[k].t)));
+		else
+			atten[k] = vec3f(1,1,1);
+	}
+}
+
+// How much light gets from Q to P through the transparent objects in
+// between, if nothing opaque is in the way.
+static vec3f transmittance( const Scene* scene, vec3f P, const vec3f& Q )
+{
+	vec3f atten(1,1,1);
+	while (true) {
+		vec3f d = Q - P;
+		double distance = d.length();
+		if (distance == 0.0)
+			return atten;
+		ray r(P, d / distance);
+		++RayStats::forThread().shadowRays;
+
+		isect i;
+		switch (scene->occluded(r, distance, i)) {
+		case Scene::OPAQUE:
+			return vec3f(0,0,0);
+		case Scene::TRANSPARENT:
+			// go on from the nearest blocker
+			atten = prod(atten, i.getTransmissive());
+			P = r.at(i.t);
+			break;
+		default:
+			return atten;
+		}
+	}
 }
 
+vec3f Light::sampleShadowAttenuation( const vec3f& P, const LightShape& shape, int maxSamples ) const
+{
+	Sampler& sampler = Sampler::forThread();
+
+	// too few for the quadrants: that many strips across the shape
+	if (maxSamples < 4) {
+		int strips = std::max(1, maxSamples);
+		vec3f sum;
+		for (int k = 0; k < strips; ++k)
+			sum += transmittance(scene, P, shape.point((k + sampler.uniform()) / strips, sampler.uniform(), P));
+		return sum / strips;
+	}
 
-vec3f DirectionalLight::shadowAttenuation( const vec3f& P ) const
+	// an even number of cells per side, so the grid splits into quadrants,
+	// and no more cells than maxSamples
+	int half = (int)(sqrt((double)maxSamples) / 2.0);
+	int side = 2 * half;
+
+	// one random cell of every quadrant first
+	int first[4];
+	vec3f firstAtten[4];
+	vec3f sum;
+	for (int q = 0; q < 4; ++q) {
+		int cx = (q & 1) * half + std::min(half - 1, (int)(sampler.uniform() * half));
+		int cy = (q >> 1) * half + std::min(half - 1, (int)(sampler.uniform() * half));
+		first[q] = cy * side + cx;
+		double u = (cx + sampler.uniform()) / side;
+		double v = (cy + sampler.uniform()) / side;
+		firstAtten[q] = transmittance(scene, P, shape.point(u, v, P));
+		sum += firstAtten[q];
+	}
+	if (firstAtten[1] == firstAtten[0] && firstAtten[2] == firstAtten[0] &&
+		firstAtten[3] == firstAtten[0])
+		return firstAtten[0];
+
+	// in the penumbra: every other cell as well
+	for (int c = 0; c < side * side; ++c) {
+		if (c == first[0] || c == first[1] || c == first[2] || c == first[3])
+			continue;
+		double u = (c % side + sampler.uniform()) / side;
+		double v = (c / side + sampler.uniform()) / side;
+		sum += transmittance(scene, P, shape.point(u, v, P));
+	}
+	return sum / (side * side);
+}
+
+LightShape LightShape::rect( const vec3f& center, const vec3f& edge1, const vec3f& edge2 )
 {
-    // YOUR CODE HERE:
-    // You should implement shadow-handling code here.
-	ray r(P, -orientation);
+	LightShape s;
+	s.kind = RECT;
+	s.center = center;
+	s.axis1 = edge1;
+	s.axis2 = edge2;
+	s.radius = 0.0;
+	return s;
+}
 
-	isect i;
-	if (scene->intersect(r, i)) {
-		const Material& m = i.getMaterial();
-		//return m.kt;
-		return prod(m.kt, shadowAttenuation(r.at(i.t)));
+LightShape LightShape::disk( const vec3f& center, const vec3f& normal, double radius )
+{
+	// any two directions at right angles to the normal
+	vec3f n = normal.normalize();
+	vec3f other = fabs(n[0]) < 0.9 ? vec3f(1,0,0) : vec3f(0,1,0);
+	vec3f a = n.cross(other).normalize();
+
+	LightShape s;
+	s.kind = DISK;
+	s.center = center;
+	s.axis1 = radius * a;
+	s.axis2 = radius * n.cross(a);
+	s.radius = radius;
+	return s;
+}
 
+LightShape LightShape::sphere( const vec3f& center, double radius )
+{
+	LightShape s;
+	s.kind = SPHERE;
+	s.center = center;
+	s.radius = radius;
+	return s;
+}
+
+vec3f LightShape::point( double u, double v, const vec3f& P ) const
+{
+	const double PI = 3.14159265358979;
+	switch (kind) {
+	case RECT:
+		return center + (u - 0.5) * axis1 + (v - 0.5) * axis2;
+	case DISK: {
+		double r = sqrt(u);
+		double phi = 2.0 * PI * v;
+		return center + (r * cos(phi)) * axis1 + (r * sin(phi)) * axis2;
 	}
+	default: {
+		// the hemisphere around the direction to P, where the height is
+		// uniform in area
+		vec3f w = P - center;
+		double d = w.length();
+		w = d > 0.0 ? w / d : vec3f(0,0,1);
+		vec3f other = fabs(w[0]) < 0.9 ? vec3f(1,0,0) : vec3f(0,1,0);
+		vec3f a = w.cross(other).normalize();
+		vec3f b = w.cross(a);
+		double z = u;
+		double sinTheta = sqrt(std::max(0.0, 1.0 - z * z));
+		double phi = 2.0 * PI * v;
+		return center + radius * (z * w + (sinTheta * cos(phi)) * a + (sinTheta * sin(phi)) * b);
+	}
+	}
+}
 
-    return vec3f(1,1,1);
+double DirectionalLight::distanceAttenuation( const vec3f& P ) const
+{
+	// distance to light is infinite, so f(di) goes to 0.  Return 1.
+	return 1.0;
+}
+
+
+ray DirectionalLight::shadowRay( const vec3f& P, double& distance ) const
+{
+	distance = 1.0e308;
+	return ray(P, -orientation);
 }
 
 vec3f DirectionalLight::getColor( const vec3f& P ) const
@@ -56,7 +231,6 @@ double PointLight::distanceAttenuation(const vec3f& P) const
 
 
 	if (constant_attenuation_coeff > 0.0 || linear_attenuation_coeff > 0.0 || quadratic_attenuation_coeff > 0.0) {
-		cout << constant_attenuation_coeff << " - -" << linear_attenuation_coeff << endl;
 		double distance = (position - P).length();
 		return min(1.0, 1.0 / (constant_attenuation_coeff*scene->constAttenFactor + 
 			linear_attenuation_coeff*distance* scene->linearAttenFactor + 
@@ -81,35 +255,25 @@ vec3f PointLight::getDirection( const vec3f& P ) const
 }
 
 
-vec3f PointLight::shadowAttenuation(const vec3f& P) const
+ray PointLight::shadowRay(const vec3f& P, double& distance) const
 {
-    // YOUR CODE HERE:
-    // You should implement shadow-handling code here.
-	vec3f d = (position - P).normalize();
-	ray r(P, d);
+	distance = (position - P).length();
+	return ray(P, (position - P).normalize());
+}
 
-	double distance = (position - P).length();
+vec3f PointLight::shadowAttenuationSoft(const vec3f & P, double coeff) const
+{
+	return sampleShadowAttenuation(P, LightShape::sphere(position, coeff), SOFT_SHADOW_SAMPLES);
+}
 
-	isect i;
-	if (scene->intersect(r, i)) {
-		if (i.t <= distance) {
-			const Material& m = i.getMaterial();
-			return prod(m.kt, shadowAttenuation(r.at(i.t)));
-		}
-	}
-    return vec3f(1,1,1);
+vec3f AreaLight::shadowAttenuation(const vec3f & P) const
+{
+	return sampleShadowAttenuation(P, shape, samples);
 }
 
-vec3f PointLight::shadowAttenuationSoft(const vec3f & P, double coeff) const
+vec3f AreaLight::shadowAttenuationSoft(const vec3f & P, double coeff) const
 {
-	vec3f attenColor(0.0, 0.0, 0.0);
-	for (int i = 0; i < 150; i++) {
-		double area = coeff;
-		vec3f newPos = position + area * vec3f((double(rand()) / double(RAND_MAX)), (double(rand()) / double(RAND_MAX)), (double(rand()) / double(RAND_MAX)));
-		PointLight newLight(scene, newPos, color);
-		attenColor += newLight.shadowAttenuation(P);
-	}
-	return attenColor / 150;
+	return shadowAttenuation(P);	// soft already, and as big as it says
 }
 
 
@@ -3,11 +3,46 @@
 
 #include "scene.h"
 
+// The surface of an area light: a rectangle, a disk or a sphere.
+class LightShape
+{
+public:
+	enum Kind { RECT, DISK, SPHERE };
+
+	// centered on center, with sides edge1 and edge2
+	static LightShape rect( const vec3f& center, const vec3f& edge1, const vec3f& edge2 );
+	static LightShape disk( const vec3f& center, const vec3f& normal, double radius );
+	static LightShape sphere( const vec3f& center, double radius );
+
+	const vec3f& getCenter() const { return center; }
+
+	// The point for (u, v) in [0,1)^2.  Equal areas of the square map to
+	// equal areas of the shape, so strata of the square stay strata of the
+	// shape.  A sphere only offers the half facing P.
+	vec3f point( double u, double v, const vec3f& P ) const;
+
+private:
+	Kind kind;
+	vec3f center;
+	vec3f axis1, axis2;	// the edges of a rect, two radii at right angles of a disk
+	double radius;		// of a sphere
+};
+
 class Light
 	: public SceneElement
 {
 public:
-	virtual vec3f shadowAttenuation(const vec3f& P) const = 0;
+	// How much of the light reaches P past the objects in between.
+	virtual vec3f shadowAttenuation(const vec3f& P) const;
+	// The same for count <= PACKET_SIZE points at once; their shadow rays
+	// go through the scene as one packet.
+	void shadowAttenuation(const vec3f* P, int count, vec3f* atten) const;
+	// Whether shadowAttenuation() shoots randomly placed rays, which come
+	// from the sampler of the pixel being traced.
+	virtual bool sampled() const { return false; }
+	// The ray from P towards the light, and how far along it the light is.
+	virtual ray shadowRay(const vec3f& P, double& distance) const = 0;
+
 	virtual double distanceAttenuation( const vec3f& P ) const = 0;
 	virtual vec3f getColor( const vec3f& P ) const = 0;
 	virtual vec3f getDirection( const vec3f& P ) const = 0;
@@ -18,6 +53,14 @@ protected:
 	Light( Scene *scene, const vec3f& col )
 		: SceneElement( scene ), color( col ) {}
 
+	// The part of shape that P sees, from at most maxSamples shadow rays,
+	// one into each cell of the largest grid with an even side that fits;
+	// 10 samples make a 2x2 grid.  One cell of every quadrant goes first;
+	// if those four agree, P is taken to be fully lit or fully in shadow
+	// and the rest are skipped.  Fewer than 4 samples go into as many
+	// strips across the shape, all of them always.
+	vec3f sampleShadowAttenuation(const vec3f& P, const LightShape& shape, int maxSamples) const;
+
 	vec3f 		color;	//intensity of light
 };
 
@@ -27,7 +70,7 @@ class DirectionalLight
 public:
 	DirectionalLight( Scene *scene, const vec3f& orien, const vec3f& color )
 		: Light( scene, color ), orientation( orien ) {}
-	virtual vec3f shadowAttenuation(const vec3f& P) const;
+	virtual ray shadowRay(const vec3f& P, double& distance) const;
 	virtual double distanceAttenuation( const vec3f& P ) const;
 	virtual vec3f getColor( const vec3f& P ) const;
 	virtual vec3f getDirection( const vec3f& P ) const;
@@ -46,7 +89,7 @@ class PointLight
 public:
 	PointLight( Scene *scene, const vec3f& pos, const vec3f& color )
 		: Light( scene, color ), position( pos ), constant_attenuation_coeff(0.0), linear_attenuation_coeff(0.0), quadratic_attenuation_coeff(0.0) {}
-	virtual vec3f shadowAttenuation(const vec3f& P) const;
+	virtual ray shadowRay(const vec3f& P, double& distance) const;
 	virtual vec3f shadowAttenuationSoft(const vec3f& P, double coeff) const;	//pure virtual function, to be overwritten by PointLight ONLY
 
 	virtual double distanceAttenuation( const vec3f& P ) const;
@@ -56,10 +99,36 @@ public:
 	double linear_attenuation_coeff;
 	double quadratic_attenuation_coeff;
 
+	// shadowAttenuationSoft() treats the light as a sphere of radius coeff,
+	// sampled with this many shadow rays at most
+	static const int SOFT_SHADOW_SAMPLES = 144;
+
 protected:
 	vec3f position;
 };
 
+// A light with an extent, which casts soft shadows whether or not they
+// are turned on.  Otherwise it behaves like a point light at the center of
+// its shape: that is where its direction and distance are measured from.
+class AreaLight
+	: public PointLight
+{
+public:
+	AreaLight( Scene *scene, const LightShape& shape, const vec3f& color, int samples )
+		: PointLight( scene, shape.getCenter(), color ), shape( shape ), samples( samples ) {}
+
+	virtual vec3f shadowAttenuation(const vec3f& P) const;
+	virtual vec3f shadowAttenuationSoft(const vec3f& P, double coeff) const;
+	virtual bool sampled() const { return true; }
+
+	// shadow rays per shade point, when it is in the penumbra
+	static const int DEFAULT_SAMPLES = 64;
+
+protected:
+	LightShape shape;
+	int samples;	// at most; see sampleShadowAttenuation
+};
+
 
 class SpotLight : public PointLight {
 public:
@@ -15,7 +15,7 @@ vec3f elementMulti(vec3f k, vec3f i) {
 	return vec3f(i0, i1, i2);
 }
 
-vec3f Material::shade( Scene *scene, const ray& r, const isect& i ) const
+vec3f Material::shade( Scene *scene, const ray& r, const isect& i, const vec3f* shadows ) const
 {
 	// YOUR CODE HERE
 
@@ -41,8 +41,9 @@ vec3f Material::shade( Scene *scene, const ray& r, const isect& i ) const
 	// iteration 2+3 :specular and diffuse, multiplied by shadow+distance attenuation
 	typedef list<Light*>::const_iterator iter;
 	iter j;
+	int lightIndex = 0;
 
-	for (j = scene->beginLights(); j != scene->endLights(); ++j) {
+	for (j = scene->beginLights(); j != scene->endLights(); ++j, ++lightIndex) {
 		vec3f P = r.at(i.t);	//position
 		vec3f L = (*j)->getDirection(P);	//direction of light
 		vec3f V = r.getDirection();		//direction of eyeray
@@ -86,7 +87,10 @@ vec3f Material::shade( Scene *scene, const ray& r, const isect& i ) const
 			vec3f Attenuation;
 
 			//if soft shadow is enabled, use "soft shadow attenuation" instead.
-			if (scene->getSoftShadow()) {
+			if (shadows) {
+				Attenuation = (*j)->distanceAttenuation(P)*   prod(shadows[lightIndex], (*j)->getColor(P));
+			}
+			else if (scene->getSoftShadow()) {
 				Attenuation = (*j)->distanceAttenuation(P)*   prod((*j)->shadowAttenuationSoft(P, scene->getSoftShadowCoeff()), (*j)->getColor(P));
 			}
 			else {
@@ -30,7 +30,9 @@ public:
               const vec3f& d, const vec3f& r, const vec3f& t, double sh, double in)
         : ke( e ), ka( a ), ks( s ), kd( d ), kr( r ), kt( t ), shininess( sh ), index( in ) {}
 
-	virtual vec3f shade(Scene *scene, const ray& r, const isect& i) const;
+	// shadows, if given, holds the shadow attenuation of every light in the
+	// scene's order, already traced by the caller.
+	virtual vec3f shade(Scene *scene, const ray& r, const isect& i, const vec3f* shadows = NULL) const;
 
     vec3f ke;                    // emissive
     vec3f ka;                    // ambient
@@ -0,0 +1,56 @@
+//
+// medium.h
+//
+// The media a ray is inside of, innermost last, for refraction through
+// overlapping and nested transparent objects.  It lives on the stack of
+// the camera ray's trace and is passed down the ray tree by reference;
+// whoever pushes onto it pops again before returning, so every ray sees
+// the media of its own path.
+//
+
+#ifndef __MEDIUM_H__
+#define __MEDIUM_H__
+
+class SceneObject;
+
+class MediumStack
+{
+public:
+	MediumStack() : count( 0 ) {}
+
+	bool empty() const { return count == 0; }
+	int size() const { return count; }
+
+	// The innermost medium; not to be called when empty.
+	const SceneObject* topObject() const { return entries[ count - 1 ].obj; }
+	double topIndex() const { return entries[ count - 1 ].index; }
+
+	// Enter obj, of refractive index index.  Returns false, and remembers
+	// nothing, when MAX_DEPTH media are already open; the ray is then taken
+	// to enter obj again every time it crosses it.
+	bool push( const SceneObject* obj, double index )
+	{
+		if( count == MAX_DEPTH )
+			return false;
+		entries[ count ].obj = obj;
+		entries[ count ].index = index;
+		++count;
+		return true;
+	}
+
+	void pop() { --count; }
+
+	static const int MAX_DEPTH = 16;
+
+private:
+	struct Entry
+	{
+		const SceneObject*	obj;
+		double				index;
+	};
+
+	Entry entries[ MAX_DEPTH ];
+	int count;
+};
+
+#endif // __MEDIUM_H__
@@ -5,5 +5,45 @@
 const Material &
 isect::getMaterial() const
 {
-    return material ? *material : obj->getMaterial();
+    if( hasDiffuse )
+    {
+        if( !blended )
+        {
+            material = obj->getMaterial();
+            material.kd = diffuse;
+            blended = true;
+        }
+        return material;
+    }
+
+    if( !vertexMaterials[0] )
+        return obj->getMaterial();
+
+    if( !blended )
+    {
+        const Material &a = *vertexMaterials[0];
+        const Material &b = *vertexMaterials[1];
+        const Material &c = *vertexMaterials[2];
+        material.ke = bary[0] * a.ke + bary[1] * b.ke + bary[2] * c.ke;
+        material.ka = bary[0] * a.ka + bary[1] * b.ka + bary[2] * c.ka;
+        material.ks = bary[0] * a.ks + bary[1] * b.ks + bary[2] * c.ks;
+        material.kd = bary[0] * a.kd + bary[1] * b.kd + bary[2] * c.kd;
+        material.kr = bary[0] * a.kr + bary[1] * b.kr + bary[2] * c.kr;
+        material.kt = bary[0] * a.kt + bary[1] * b.kt + bary[2] * c.kt;
+        material.shininess = bary[0] * a.shininess + bary[1] * b.shininess + bary[2] * c.shininess;
+        material.index = bary[0] * a.index + bary[1] * b.index + bary[2] * c.index;
+        blended = true;
+    }
+    return material;
+}
+
+vec3f
+isect::getTransmissive() const
+{
+    if( !vertexMaterials[0] )
+        return obj->getMaterial().kt;
+    if( blended )
+        return material.kt;
+    return bary[0] * vertexMaterials[0]->kt + bary[1] * vertexMaterials[1]->kt
+        + bary[2] * vertexMaterials[2]->kt;
 }
@@ -17,6 +17,7 @@ class SceneObject;
 
 class ray {
 public:
+	ray() {}
 	ray( const vec3f& pp, const vec3f& dd )
 		: p( pp ), d( dd ) {}
 	ray( const ray& other ) 
@@ -45,54 +46,74 @@ class isect
 {
 public:
     isect()
-        : obj( NULL ), t( 0.0 ), N(), material(0) {}
-
-    ~isect()
+        : obj( NULL ), t( 0.0 ), N(), localT( 0.0 ), bary(), hasDiffuse( false ), blended( false )
     {
-        delete material;
+        vertexMaterials[0] = vertexMaterials[1] = vertexMaterials[2] = NULL;
     }
-    
+
     void setObject( SceneObject *o ) { obj = o; }
     void setT( double tt ) { t = tt; }
     void setN( const vec3f& n ) { N = n; }
-    void setMaterial( Material *m ) { delete material; material = m; }
-        
-    isect& operator =( const isect& other )
+
+    // The material at this point is a blend of a, b and c, weighted by
+    // the barycentric coordinates w, as on a mesh with per-vertex
+    // materials.  Nothing is blended until the material is asked for, so
+    // hits that lose out to a closer one cost nothing.
+    void setMaterials( const Material *a, const Material *b, const Material *c,
+                       const vec3f& w )
+    {
+        vertexMaterials[0] = a;
+        vertexMaterials[1] = b;
+        vertexMaterials[2] = c;
+        bary = w;
+        hasDiffuse = false;
+        blended = false;
+    }
+    // The material is the object's own, only with diffuse color kd, as on
+    // a heightfield colored by an image.
+    void setDiffuse( const vec3f& kd )
     {
-        if( this != &other )
-        {
-            obj = other.obj;
-            t = other.t;
-            N = other.N;
-//            material = other.material ? new Material( *(other.material) ) : 0;
-			if( other.material )
-            {
-                if( material )
-                    *material = *other.material;
-                else
-                    material = new Material(*other.material );
-            }
-            else
-            {
-                material = 0;
-            }
-        }
-        return *this;
+        vertexMaterials[0] = NULL;
+        diffuse = kd;
+        hasDiffuse = true;
+        blended = false;
     }
+    // The material is the object's own.
+    void clearMaterials() { vertexMaterials[0] = NULL; hasDiffuse = false; }
 
 public:
     const SceneObject 	*obj;
     double t;
     vec3f N;			//normal vector
-    Material *material;         // if this intersection has its own material
-                                // (as opposed to one in its associated object)
-                                // as in the case where the material was interpolated
+
+    // The ray in the object's own coordinates, as the object was tested
+    // against it, and the distance to the hit along it.
+    ray localRay;
+    double localT;
+    vec3f localPoint() const { return localRay.at( localT ); }
+
+    const Material *vertexMaterials[3];	// NULL unless the material is interpolated
+    vec3f bary;							// their weights
+    vec3f diffuse;						// kd, if hasDiffuse
+    bool hasDiffuse;
 
     const Material &getMaterial() const;
+    // getMaterial().kt, without blending the rest of the material.
+    vec3f getTransmissive() const;
     // Other info here.
+
+private:
+    mutable Material material;	// the blend, once getMaterial has worked it out
+    mutable bool blended;
 };
 
+#ifdef RAY_SIMD_VECMATH
+// hit points are only good to single precision, so secondary rays have to
+// start further away to clear the surface they leave
+const double RAY_EPSILON = 0.0001;
+#else
 const double RAY_EPSILON = 0.00001;
+#endif
 const double NORMAL_EPSILON = 0.00001;
 
 #endif // __RAY_H__
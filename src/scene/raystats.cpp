@@ -0,0 +1,104 @@
+#include <vector>
+#include <mutex>
+#include <algorithm>
+
+#include "raystats.h"
+
+// Every live per-thread RayStats, plus what the finished threads counted.
+static std::mutex& registryLock()
+{
+	static std::mutex lock;
+	return lock;
+}
+
+static std::vector<RayStats*>& registry()
+{
+	static std::vector<RayStats*> threads;
+	return threads;
+}
+
+static RayStats& retired()
+{
+	static RayStats stats;
+	return stats;
+}
+
+RayStats::RayStats()
+	: registered( false )
+{
+	clear();
+}
+
+RayStats::RayStats( const RayStats& s )
+	: registered( false )
+{
+	clear();
+	add( s );
+}
+
+RayStats& RayStats::operator=( const RayStats& s )
+{
+	if( this != &s ) {
+		clear();
+		add( s );
+	}
+	return *this;
+}
+
+RayStats::~RayStats()
+{
+	if( !registered )
+		return;
+
+	std::lock_guard<std::mutex> guard( registryLock() );
+	std::vector<RayStats*>& threads = registry();
+	threads.erase( std::remove( threads.begin(), threads.end(), this ), threads.end() );
+	retired().add( *this );
+}
+
+RayStats& RayStats::forThread()
+{
+	static thread_local RayStats stats;
+	if( !stats.registered ) {
+		std::lock_guard<std::mutex> guard( registryLock() );
+		registry().push_back( &stats );
+		stats.registered = true;
+	}
+	return stats;
+}
+
+RayStats RayStats::total()
+{
+	std::lock_guard<std::mutex> guard( registryLock() );
+	RayStats sum;
+	sum.add( retired() );
+	std::vector<RayStats*>& threads = registry();
+	for( size_t i = 0; i < threads.size(); ++i )
+		sum.add( *threads[i] );
+	return sum;
+}
+
+void RayStats::reset()
+{
+	std::lock_guard<std::mutex> guard( registryLock() );
+	retired().clear();
+	std::vector<RayStats*>& threads = registry();
+	for( size_t i = 0; i < threads.size(); ++i )
+		threads[i]->clear();
+}
+
+void RayStats::clear()
+{
+	primaryRays = 0;
+	secondaryRays = 0;
+	shadowRays = 0;
+	intersectionTests = 0;
+}
+
+void RayStats::add( const RayStats& s )
+{
+	primaryRays += s.primaryRays;
+	secondaryRays += s.secondaryRays;
+	shadowRays += s.shadowRays;
+	intersectionTests += s.intersectionTests;
+}
@@ -0,0 +1,46 @@
+//
+// raystats.h
+//
+// Counters of the work a render does: the rays shot, by kind, and the
+// ray-object intersection tests run for them.  Every thread counts into
+// its own RayStats; total() adds them all up.
+//
+
+#ifndef __RAYSTATS_H__
+#define __RAYSTATS_H__
+
+class RayStats
+{
+public:
+	RayStats();
+	RayStats( const RayStats& s );	// copies the counts only
+	~RayStats();
+
+	RayStats& operator=( const RayStats& s );
+
+	// The counters of the calling thread.
+	static RayStats& forThread();
+
+	// Sum over every thread, including the ones that have exited.
+	static RayStats total();
+	// Zero the counters of every thread.  Don't call it during a render.
+	static void reset();
+
+	unsigned long long totalRays() const
+	{
+		return primaryRays + secondaryRays + shadowRays;
+	}
+
+	unsigned long long primaryRays;			// camera rays
+	unsigned long long secondaryRays;		// reflected and refracted rays
+	unsigned long long shadowRays;
+	unsigned long long intersectionTests;	// Geometry::intersect calls
+
+private:
+	void clear();
+	void add( const RayStats& s );
+
+	bool registered;
+};
+
+#endif // __RAYSTATS_H__
@@ -0,0 +1,92 @@
+#include <cmath>
+
+#include "sampler.h"
+
+SamplePattern Sampler::pattern = SAMPLE_HALTON;
+
+Sampler& Sampler::forThread()
+{
+	static thread_local Sampler sampler;
+	return sampler;
+}
+
+void Sampler::beginPixel( int x, int y, int frameIndex, int firstSample )
+{
+	px = x;
+	py = y;
+	frame = frameIndex;
+	sample = firstSample;
+	reseed();
+}
+
+void Sampler::nextSample()
+{
+	++sample;
+	reseed();
+}
+
+// The pixel and frame pick the state, the sample picks the stream, so
+// two samples of the same pixel never share a sequence.
+void Sampler::reseed()
+{
+	uint64_t key = ((uint64_t)(uint32_t)px << 32) | (uint32_t)py;
+	key ^= (uint64_t)(uint32_t)frame * 0x9E3779B97F4A7C15ULL;
+	rng.seed( key, (uint64_t)(uint32_t)sample );
+}
+
+static const int primes[ SampleSequence::MAX_DIMS ] = { 2, 3, 5, 7 };
+
+// k written in the given base, mirrored around the decimal point
+static double radicalInverse( int k, int base )
+{
+	double inv = 1.0 / base;
+	double f = inv;
+	double r = 0.0;
+	while( k > 0 ) {
+		r += (k % base) * f;
+		k /= base;
+		f *= inv;
+	}
+	return r;
+}
+
+SampleSequence::SampleSequence( Sampler& s, int n, int d )
+	: sampler( s ), pattern( Sampler::getPattern() ), count( n ), dims( d )
+{
+	if( dims > MAX_DIMS )
+		dims = MAX_DIMS;
+
+	gridSize = (int)ceil( sqrt( (double)count ) );
+	if( gridSize < 1 )
+		gridSize = 1;
+
+	if( pattern == SAMPLE_HALTON )
+		for( int i = 0; i < dims; ++i )
+			shift[i] = sampler.uniform();
+}
+
+double SampleSequence::get( int k, int dim )
+{
+	switch( pattern ) {
+	case SAMPLE_STRATIFIED:
+		// the first two dimensions share a gridSize x gridSize grid, a
+		// lone dimension is cut into count strata, the rest is left random
+		if( dims == 1 && dim == 0 )
+			return (k + sampler.uniform()) / count;
+		if( dim == 0 )
+			return ((k % gridSize) + sampler.uniform()) / gridSize;
+		if( dim == 1 )
+			return ((k / gridSize) % gridSize + sampler.uniform()) / gridSize;
+		return sampler.uniform();
+
+	case SAMPLE_HALTON:
+		if( dim < dims ) {
+			double u = radicalInverse( k, primes[dim] ) + shift[dim];
+			return u >= 1.0 ? u - 1.0 : u;
+		}
+		return sampler.uniform();
+
+	default:
+		return sampler.uniform();
+	}
+}
@@ -0,0 +1,122 @@
+//
+// sampler.h
+//
+// Random numbers and sample patterns for the effects that shoot several
+// rays per hit (depth of field, glossy reflection, soft shadows and
+// jittered antialiasing).  Every render thread has its own Sampler, which
+// is reseeded from the pixel, sample and frame indices, so a pixel comes out
+// the same no matter which thread traced it or in what order.
+//
+
+#ifndef __SAMPLER_H__
+#define __SAMPLER_H__
+
+#include <stdint.h>
+
+// PCG32 (O'Neill, "PCG: A Family of Simple Fast Space-Efficient
+// Statistically Good Algorithms for Random Number Generation").
+class Pcg32
+{
+public:
+	Pcg32() { seed( 0, 0 ); }
+
+	void seed( uint64_t initState, uint64_t stream )
+	{
+		state = 0;
+		inc = (stream << 1) | 1;
+		next();
+		state += initState;
+		next();
+	}
+
+	uint32_t next()
+	{
+		uint64_t old = state;
+		state = old * 6364136223846793005ULL + inc;
+		uint32_t xorshifted = (uint32_t)( ((old >> 18) ^ old) >> 27 );
+		uint32_t rot = (uint32_t)( old >> 59 );
+		return (xorshifted >> rot) | (xorshifted << ((32 - rot) & 31));
+	}
+
+	// uniform in [0, 1)
+	double nextDouble()
+	{
+		return next() * (1.0 / 4294967296.0);
+	}
+
+private:
+	uint64_t state;
+	uint64_t inc;
+};
+
+// How the points of a SampleSequence are spread over [0,1)^d.
+enum SamplePattern
+{
+	SAMPLE_RANDOM,		// independent uniform numbers
+	SAMPLE_STRATIFIED,	// one jittered point per cell of a grid
+	SAMPLE_HALTON		// Halton points, randomly shifted per sequence
+};
+
+class Sampler
+{
+public:
+	Sampler() : px( 0 ), py( 0 ), frame( 0 ), sample( 0 ) {}
+
+	// The sampler of the calling thread.
+	static Sampler& forThread();
+
+	// The pattern every SampleSequence uses.  Set it before rendering.
+	static void setPattern( SamplePattern p ) { pattern = p; }
+	static SamplePattern getPattern() { return pattern; }
+
+	// Start pixel (x, y) of the given frame.  The samples are numbered from
+	// firstSample on, so later passes over a pixel can use fresh ones.
+	void beginPixel( int x, int y, int frameIndex, int firstSample = 0 );
+	// Move on to the next sample (camera ray) of the current pixel; called
+	// once per camera ray, before it is traced.
+	void nextSample();
+
+	double uniform() { return rng.nextDouble(); }
+
+private:
+	void reseed();
+
+	static SamplePattern pattern;
+
+	Pcg32 rng;
+	int px, py;
+	int frame;
+	int sample;
+};
+
+// n points in [0,1)^dims (dims <= MAX_DIMS) for one batch of secondary
+// rays, e.g. the 100 rays of one glossy reflection.  The pattern is
+// randomized with the sampler, so neighbouring pixels don't repeat it.
+class SampleSequence
+{
+public:
+	SampleSequence( Sampler& s, int n, int dims );
+
+	int size() const { return count; }
+
+	// Component dim of point k.
+	double get( int k, int dim );
+
+	void get2D( int k, double& u, double& v )
+	{
+		u = get( k, 0 );
+		v = get( k, 1 );
+	}
+
+	static const int MAX_DIMS = 4;
+
+private:
+	Sampler& sampler;
+	SamplePattern pattern;
+	int count;
+	int dims;
+	int gridSize;				// cells per side of the stratified grid
+	double shift[ MAX_DIMS ];	// Cranley-Patterson rotation of the Halton points
+};
+
+#endif // __SAMPLER_H__
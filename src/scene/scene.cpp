@@ -4,9 +4,10 @@
 
 #include "scene.h"
 #include "light.h"
-#include "../ui/TraceUI.h"
-#include "../SceneObjects/trimesh.h"
-extern TraceUI* traceUI;
+#include "raystats.h"
+#include "../SceneObjects/Heightfield.h"
+#include "../ThreadPool.h"
+#include "../fileio/binscene.h"
 
 void BoundingBox::operator=(const BoundingBox& target)
 {
@@ -76,18 +77,50 @@ bool BoundingBox::intersect(const ray& r, double& tMin, double& tMax) const
 	return true; // it made it past all 3 axes.
 }
 
+bool nearestQuadricRoot(const ray& r, double t1, double t2, const BoundingBox* clip, double& t)
+{
+	if (clip) {
+		// the nearest root in front of the ray that is inside the clip box
+		double tNear = min(t1, t2);
+		double tFar = max(t1, t2);
+		if (tNear > RAY_EPSILON && clip->intersects(r.at(tNear)))
+			t = tNear;
+		else if (tFar > RAY_EPSILON && clip->intersects(r.at(tFar)))
+			t = tFar;
+		else
+			return false;
+	}
+	else {
+		if (t2 <= RAY_EPSILON) {	//larger root
+			return false;
+		}
+		t = (t1 > RAY_EPSILON) ? t1 : t2;
+	}
+	return true;
+}
+
 
 bool Geometry::intersect(const ray&r, isect&i) const
 {
-    // Transform the ray into the object's local coordinate space
-    vec3f pos = transform->globalToLocalCoords(r.getPosition());
-    vec3f dir = transform->globalToLocalCoords(r.getPosition() + r.getDirection()) - pos;
-    double length = dir.length();
-    dir /= length;
+    // Transform the ray into the object's local coordinate space.  Unless
+    // the transform keeps lengths, the direction has to be made a unit
+    // vector again, and t scaled back by the same length.
+    const AffineXform& toLocal = transform->globalToLocal();
+    vec3f pos = toLocal.point(r.getPosition());
+    vec3f dir = toLocal.vector(r.getDirection());
+    double length = 1.0;
+    if (!toLocal.preservesLength()) {
+        length = dir.length();
+        dir /= length;
+    }
 
     ray localRay( pos, dir );
 
     if (intersectLocal(localRay, i)) {	//send this iscet point to the intersect local function.
+        // keep the local ray for texture coordinates and the like
+        i.localRay = localRay;
+        i.localT = i.t;
+
         // Transform the intersection point & normal returned back into global space.
 		i.N = transform->localToGlobalCoordsNormal(i.N);
 		i.t /= length;
@@ -130,23 +163,64 @@ Scene::~Scene()
     giter g;
     liter l;
     
+	// boundedobjects and nonboundedobjects hold the same pointers as objects
 	for( g = objects.begin(); g != objects.end(); ++g ) {
 		delete (*g);
 	}
 
-	for( g = boundedobjects.begin(); g != boundedobjects.end(); ++g ) {
-		delete (*g);
-	}
-
-	for( g = nonboundedobjects.begin(); g != boundedobjects.end(); ++g ) {
-		delete (*g);
+	for( map<string, SceneObject*>::iterator p = prototypes.begin(); p != prototypes.end(); ++p ) {
+		delete p->second;
 	}
 
 	for( l = lights.begin(); l != lights.end(); ++l ) {
 		delete (*l);
 	}
+
+	delete binaryData;
+}
+
+void Scene::addPrototype( const string& name, SceneObject* obj )
+{
+	obj->setTransform( &transformRoot );
+	obj->ComputeBoundingBox();
+
+	prototypes[ name ] = obj;
+}
+
+SceneObject* Scene::getPrototype( const string& name ) const
+{
+	map<string, SceneObject*>::const_iterator p = prototypes.find( name );
+	return p == prototypes.end() ? NULL : p->second;
 }
 
+// BVH callback for Scene::intersect: tests one bounded object and keeps
+// the intersection if it is closer than the best one so far.
+class ClosestObjectHit
+{
+public:
+	ClosestObjectHit( const vector<Geometry*>& objs, const ray& r, isect& i, isect& cur )
+		: tests( 0 ), objs( objs ), r( r ), i( i ), cur( cur ) {}
+
+	bool operator()( int prim, double& tMax )
+	{
+		++tests;
+		if( objs[prim]->intersect( r, cur ) && cur.t < tMax ) {
+			i = cur;
+			tMax = cur.t;
+			return true;
+		}
+		return false;
+	}
+
+	int tests;		// objects tried so far
+
+private:
+	const vector<Geometry*>& objs;
+	const ray& r;
+	isect& i;
+	isect& cur;
+};
+
 // Get any intersection with an object.  Return information about the 
 // intersection through the reference parameter.
 bool Scene::intersect( const ray& r, isect& i ) const
@@ -156,6 +230,7 @@ bool Scene::intersect( const ray& r, isect& i ) const
 
 	isect cur;		//working pointer to find the nearest intersecting object
 	bool have_one = false;
+	unsigned long long tests = nonboundedobjects.size();
 
 	// try the non-bounded objects
 	for( j = nonboundedobjects.begin(); j != nonboundedobjects.end(); ++j ) {
@@ -167,25 +242,293 @@ bool Scene::intersect( const ray& r, isect& i ) const
 		}
 	}
 
-	// try the bounded objects
-	for( j = boundedobjects.begin(); j != boundedobjects.end(); ++j ) {
-		if( (*j)->intersect( r, cur ) ) {
-			if( !have_one || (cur.t < i.t) ) {
-				i = cur;
-				have_one = true;
+	if( motionBlur ) {
+		// motion blur moves the objects away from the boxes the BVH was
+		// built from, so fall back to trying every bounded object
+		tests += boundedobjects.size();
+		for( j = boundedobjects.begin(); j != boundedobjects.end(); ++j ) {
+			if( (*j)->intersect( r, cur ) ) {
+				if( !have_one || (cur.t < i.t) ) {
+					i = cur;
+					have_one = true;
+				}
 			}
 		}
+	} else {
+		// try the bounded objects, nearest BVH nodes first
+		double tMax = have_one ? i.t : 1.0e308;
+		ClosestObjectHit hit( bvhObjects, r, i, cur );
+		if( bvh.intersect( r, tMax, hit ) )
+			have_one = true;
+		tests += hit.tests;
 	}
 
+	RayStats::forThread().intersectionTests += tests;
 
 	return have_one;
 }
 
-void Scene::initScene()
+// BVH callback for Scene::intersectPacket: the leaves get ClosestObjectHit's
+// test for every ray that reaches them, and rays that go on alone use it
+// directly.
+class PacketObjectHit
+{
+public:
+	PacketObjectHit( const vector<Geometry*>& objs, const BVH& bvh, const ray* r,
+		isect* i, bool* found, BVHPacket& p, isect& cur )
+		: tests( 0 ), objs( objs ), bvh( bvh ), r( r ), i( i ), found( found ),
+		  p( p ), cur( cur ) {}
+
+	void leaf( int node, unsigned mask )
+	{
+		const BVHNode& n = bvh.getNodes()[ node ];
+		const vector<int>& prims = bvh.getPrimitives();
+		for( int j = 0; j < n.count; ++j ) {
+			const Geometry* obj = objs[ prims[ n.offset + j ] ];
+			for( int k = 0; k < p.count; ++k ) {
+				if( !(mask & (1u << k)) )
+					continue;
+				++tests;
+				if( obj->intersect( r[k], cur ) && cur.t < p.tMax[k] ) {
+					i[k] = cur;
+					p.tMax[k] = cur.t;
+					found[k] = true;
+				}
+			}
+		}
+	}
+
+	void single( int k, int node )
+	{
+		ClosestObjectHit hit( objs, r[k], i[k], cur );
+		if( bvh.intersect( r[k], p.tMax[k], hit, node ) )
+			found[k] = true;
+		tests += hit.tests;
+	}
+
+	int tests;
+
+private:
+	const vector<Geometry*>& objs;
+	const BVH& bvh;
+	const ray* r;
+	isect* i;
+	bool* found;
+	BVHPacket& p;
+	isect& cur;
+};
+
+void Scene::intersectPacket( const ray* r, int count, isect* i, bool* found,
+	const double* tMax ) const
+{
+	if( motionBlur ) {
+		// see intersect(); the BVH doesn't fit the moved objects
+		for( int k = 0; k < count; ++k )
+			found[k] = intersect( r[k], i[k] ) && (!tMax || i[k].t < tMax[k]);
+		return;
+	}
+
+	typedef list<Geometry*>::const_iterator iter;
+	isect cur;
+	unsigned long long tests = 0;
+	BVHPacket p;
+	unsigned mask = 0;
+
+	for( int k = 0; k < count; ++k ) {
+		double limit = tMax ? tMax[k] : 1.0e308;
+		found[k] = false;
+
+		// the non-bounded objects, one ray at a time
+		for( iter j = nonboundedobjects.begin(); j != nonboundedobjects.end(); ++j ) {
+			++tests;
+			if( (*j)->intersect( r[k], cur ) && cur.t < limit ) {
+				i[k] = cur;
+				limit = cur.t;
+				found[k] = true;
+			}
+		}
+
+		p.set( k, r[k], limit );
+		mask |= 1u << k;
+	}
+	p.finish();
+
+	PacketObjectHit hit( bvhObjects, bvh, r, i, found, p, cur );
+	bvh.traversePacket( p, mask, hit );
+	tests += hit.tests;
+
+	RayStats::forThread().intersectionTests += tests;
+}
+
+// BVH callback for Scene::occluded: tests one bounded object against a
+// shadow ray.  An opaque hit ends the walk by dropping tMax below zero;
+// transparent hits leave tMax alone, so every blocker up to the light is
+// seen, and the nearest one is kept in i.
+class AnyOpaqueHit
+{
+public:
+	AnyOpaqueHit() : tests( 0 ), opaque( false ), transparent( false ),
+		objs( NULL ), r( NULL ), i( NULL ) {}
+
+	void set( const vector<Geometry*>& o, const ray& ray, isect& hit )
+	{
+		objs = &o;
+		r = &ray;
+		i = &hit;
+	}
+
+	bool operator()( int prim, double& tMax )
+	{
+		if( opaque )
+			return false;
+		++tests;
+		return test( *(*objs)[prim], tMax );
+	}
+
+	bool test( const Geometry& obj, double& tMax )
+	{
+		// written so that a NaN distance doesn't count as a hit
+		if( !obj.intersect( *r, cur ) || !(cur.t <= tMax) )
+			return false;
+
+		if( cur.getTransmissive().iszero() ) {
+			opaque = true;
+			tMax = -1.0;
+		} else if( !transparent || cur.t < i->t ) {
+			*i = cur;
+			transparent = true;
+		}
+		return true;
+	}
+
+	Scene::Occlusion result() const
+	{
+		return opaque ? Scene::OPAQUE : transparent ? Scene::TRANSPARENT : Scene::UNOCCLUDED;
+	}
+
+	const ray& getRay() const { return *r; }
+
+	int tests;
+	bool opaque;		// found an opaque blocker
+	bool transparent;	// found transparent ones, the nearest is in i
+
+private:
+	const vector<Geometry*>* objs;
+	const ray* r;
+	isect* i;
+	isect cur;
+};
+
+Scene::Occlusion Scene::occluded( const ray& r, double distance, isect& i ) const
+{
+	typedef list<Geometry*>::const_iterator iter;
+
+	double tMax = distance;
+	AnyOpaqueHit hit;
+	hit.set( bvhObjects, r, i );
+	unsigned long long tests = 0;
+
+	for( iter j = nonboundedobjects.begin(); j != nonboundedobjects.end() && !hit.opaque; ++j ) {
+		++tests;
+		hit.test( **j, tMax );
+	}
+
+	if( motionBlur ) {
+		// see intersect(); the BVH doesn't fit the moved objects
+		for( iter j = boundedobjects.begin(); j != boundedobjects.end() && !hit.opaque; ++j ) {
+			++tests;
+			hit.test( **j, tMax );
+		}
+	} else if( !hit.opaque ) {
+		bvh.intersect( r, tMax, hit );
+	}
+
+	RayStats::forThread().intersectionTests += tests + hit.tests;
+	return hit.result();
+}
+
+// BVH callback for Scene::occludedPacket: AnyOpaqueHit for every ray of
+// the packet.  A ray that finds an opaque blocker drops out of the walk.
+class PacketOccluderHit
+{
+public:
+	PacketOccluderHit( const BVH& bvh, AnyOpaqueHit* hits, BVHPacket& p )
+		: bvh( bvh ), hits( hits ), p( p ) {}
+
+	void leaf( int node, unsigned mask )
+	{
+		const BVHNode& n = bvh.getNodes()[ node ];
+		const vector<int>& prims = bvh.getPrimitives();
+		for( int j = 0; j < n.count; ++j )
+			for( int k = 0; k < p.count; ++k )
+				if( mask & (1u << k) )
+					hits[k]( prims[ n.offset + j ], p.tMax[k] );
+	}
+
+	void single( int k, int node )
+	{
+		bvh.intersect( hits[k].getRay(), p.tMax[k], hits[k], node );
+	}
+
+private:
+	const BVH& bvh;
+	AnyOpaqueHit* hits;
+	BVHPacket& p;
+};
+
+void Scene::occludedPacket( const ray* r, int count, const double* distance,
+	isect* i, Occlusion* result ) const
+{
+	if( motionBlur || !nonboundedobjects.empty() ) {
+		// the objects outside the BVH go one ray at a time anyway
+		for( int k = 0; k < count; ++k )
+			result[k] = occluded( r[k], distance[k], i[k] );
+		return;
+	}
+
+	AnyOpaqueHit hits[ PACKET_SIZE ];
+	BVHPacket p;
+	unsigned mask = 0;
+
+	for( int k = 0; k < count; ++k ) {
+		hits[k].set( bvhObjects, r[k], i[k] );
+		p.set( k, r[k], distance[k] );
+		mask |= 1u << k;
+	}
+	p.finish();
+
+	PacketOccluderHit hit( bvh, hits, p );
+	bvh.traversePacket( p, mask, hit );
+
+	unsigned long long tests = 0;
+	for( int k = 0; k < count; ++k ) {
+		result[k] = hits[k].result();
+		tests += hits[k].tests;
+	}
+	RayStats::forThread().intersectionTests += tests;
+}
+
+void Scene::initScene( ThreadPool* pool )
+{
+	ambientLight = vec3f(1.0, 1.0, 1.0);
+
+	// one task per object; a big mesh puts its own loops on the pool too
+	threadPool = pool;
+	vector<Geometry*> objs( objects.begin(), objects.end() );
+	ThreadPool::forRange( pool, objs.size(), 1, [&]( int k, int ) {
+		objs[k]->ComputeBoundingBox();
+	} );
+	buildAccelerationStructure();
+	threadPool = NULL;
+}
+
+void Scene::buildAccelerationStructure()
 {
 	bool first_boundedobject = true;
 	BoundingBox b;
-	ambientLight = vec3f(1.0, 1.0, 1.0);
+
+	boundedobjects.clear();
+	nonboundedobjects.clear();
 	
 	typedef list<Geometry*>::const_iterator iter;
 	// split the objects into two categories: bounded and non-bounded
@@ -209,6 +552,13 @@ void Scene::initScene()
 		else
 			nonboundedobjects.push_back(*j);
 	}
+
+	vector<BoundingBox> boxes;
+	bvhObjects.assign( boundedobjects.begin(), boundedobjects.end() );
+	boxes.reserve( bvhObjects.size() );
+	for( size_t k = 0; k < bvhObjects.size(); ++k )
+		boxes.push_back( bvhObjects[k]->getBoundingBox() );
+	bvh.build( boxes, 1, threadPool );
 }
 
 void Scene::setTexture(unsigned char * tex)
@@ -366,128 +716,17 @@ void Scene::setHFColorImg(unsigned char * hfc)
 
 void Scene::showHeightField()
 {
-	//Material* emptyMaterial = new Material();
-	//TransformRoot* emptyNode = new TransformRoot();
-
-	//Trimesh* hfTrimesh = new Trimesh(this, emptyMaterial, emptyNode);//generate a default trimesh WITH NO MATERIAL AND NO TRANSFORM
-	//cout << "hfh hfw" << hfWidth << " " << hfHeight << endl;
-	////add all vertices: 512*512 vertices
-	////trimesh will be shown between -1,-1 and 1,1
-	//int interval = 3;
-	//for (int y = 0; y < hfHeight; y += interval) {
-	//	for (int x = 0; x < hfWidth; x += interval) {
-	//		vec3f intensityColor = getBitmapColorFromPixel(heightFieldIntensity, hfWidth, hfHeight, x, y);
-	//		double intensityValue = 0.299*intensityColor[0] + 0.587*intensityColor[1] + 0.114*intensityColor[2];
-	//		vec3f newVertex(2.0* double(x) / double(hfWidth) - 1.0, 2.0* double(y) / double(hfHeight) - 1.0, intensityValue);
-	//		hfTrimesh->addVertex(newVertex);
-	//	}
-	//}
-
-	//int numCols = hfWidth / interval;
-	//int numRows = hfHeight / interval;
-	////add faces
-	//for (int j = 0; j < numRows-1; j++) {
-	//	for (int i = 0; i < numCols -1; i++){
-	//		int v00 = i + j*numCols;
-	//		int v01 = v00 + numCols;
-	//		int v10 = v00 + 1;
-	//		int v11 = v01 + 1;
-	//		hfTrimesh->addFace(v00, v01, v11);
-	//		hfTrimesh->addFace(v00, v10, v11);
-	//	}
-	//}
+	if( !heightFieldIntensity || hfWidth < 2 || hfHeight < 2 )
+		return;
 
-
-	////add faces
-	////for (int y = 0; y < hfHeight-4; y+= 3) {
-	////	for (int x = 0; x < hfWidth - 4; x+= 3) {
-	////		int v00 = x + y*hfWidth;
-	////		int v01 = v00 + hfWidth*3;
-	////		int v10 = v00 + 3;
-	////		int v11 = v01 + 3;
-	////		hfTrimesh->addFace(v00, v01, v11);
-	////		hfTrimesh->addFace(v00, v10, v11);
-	////	}
-	////}
-
-	//hfTrimesh->generateNormals();
-
-	//for (int y = 0; y < hfHeight; y += 3) {
-	//	for (int x = 0; x < hfWidth; x += 3) {
-	//		//add material (mainly color) to this vertex
-	//		Material* matThisVertex = new Material();
-	//		matThisVertex->kd = getBitmapColorFromPixel(heightFieldColor, hfWidth, hfHeight, x, y);
-	//		hfTrimesh->addMaterial(matThisVertex);
-	//	}
-	//}
-	//if (hfTrimesh->doubleCheckTrueorFalse())
-	//	fl_alert("great hf finished!!!");
-
-	////this->add(hfTrimesh);
-	////this->boundedobjects.push_back(hfTrimesh);
-
-	////copy them to bounded object list (this should have been done in initScene(), but it has been executed before, so have to do it here
-	////for (std::list<Geometry*>::iterator itr = this->objects.begin(); itr != this->objects.end(); itr++) {
-	////	this->boundedobjects.push_back(*itr);
-	////}
-	////for (std::vector<TrimeshFace*>::iterator itr = hfTrimesh->getFaces().begin(); itr != hfTrimesh->getFaces().end(); itr++) {
-	////	this->boundedobjects.push_back(*itr);
-	////}
-	//for (std::list<Geometry*>::iterator itr = this->objects.begin(); itr != this->objects.end(); itr++) {
-	//	this->boundedobjects.push_back(*itr);
-	//	
-	//}
-	////initScene();
-	Material* emptyMaterial = new Material();
-	mat4f identityXform = { vec4f(1.0,0.0,0.0,0.0),
-		vec4f(0.0,1.0,0.0,0.0),
-		vec4f(0.0,0.0,1.0,0.0) ,
-		vec4f(0.0,0.0,0.0,1.0) };
-	TransformRoot* emptyNode = new TransformRoot();
-
-	Trimesh* hfTrimesh = new Trimesh(this, emptyMaterial, emptyNode);//generate a default trimesh WITH NO MATERIAL AND NO TRANSFORM
-	cout << "hfh hfw" << hfWidth << " " << hfHeight << endl;
-	//add all vertices: 512*512 vertices
-	//trimesh will be shown between -1,-1 and 1,1
-	for (int y = 0; y < hfHeight; y += 1) {
-		for (int x = 0; x < hfWidth; x += 1) {
-			vec3f intensityColor = getBitmapColorFromPixel(heightFieldIntensity, hfWidth, hfHeight, x, y);
-			double intensityValue = 0.299*intensityColor[0] + 0.587*intensityColor[1] + 0.114*intensityColor[2];
-			vec3f newVertex(2.0* double(x) / double(hfWidth) - 1.0, 2.0* double(y) / double(hfHeight) - 1.0, intensityValue);
-			hfTrimesh->addVertex(newVertex);
-			//cout << "new vertex at " << newVertex << endl;
-
-
-			//add material (mainly color) to this vertex
-			Material* matThisVertex = new Material();
-			matThisVertex->kd = getBitmapColorFromPixel(heightFieldColor, hfWidth, hfHeight, x, y);
-			hfTrimesh->addMaterial(matThisVertex);
-			//cout << "its color is" << matThisVertex->kd << endl;
-
-		}
-	}
-
-
-
-	//add faces
-	for (int y = 0; y < hfHeight - 1; y += 1) {
-		for (int x = 0; x < hfWidth - 1; x += 1) {
-			int v00 = x + y*hfWidth;
-			int v01 = v00 + hfWidth;
-			int v10 = v00 + 1;
-			int v11 = v01 + 1;
-			hfTrimesh->addFace(v00, v01, v11);
-			hfTrimesh->addFace(v00, v10, v11);
-			cout << "new face " << v00 << " " << v01 << " " << v11 << endl;
-			cout << "new face2 " << v00 << " " << v10 << " " << v11 << endl;
-		}
-	}
-
-	//fl_message(hfTrimesh->doubleCheck());
-	//copy them to bounded object list
-	for (std::list<Geometry*>::iterator itr = this->objects.begin(); itr != this->objects.end(); itr++) {
-		this->boundedobjects.push_back(*itr);
-	}
+	// the surface spans -1,-1 to 1,1; the heightfield keeps its own copy of
+	// the images, so they may be replaced after this
+	Heightfield* hf = new Heightfield( this, new Material(), heightFieldIntensity,
+		heightFieldColor, hfWidth, hfHeight );
+	hf->setTransform( &transformRoot );
+	hf->ComputeBoundingBox();
+	add( hf );
+	buildAccelerationStructure();
 }
 
 void Scene::setTextureMapping(bool tm)
@@ -537,6 +776,65 @@ mat4f TransformNode::getXform()
 void TransformNode::setXform(mat4f newxform)
 {
 	this->xform = newxform;
-	inverse = this->xform.inverse();
-	normi = this->xform.upper33().inverse().transpose();
+	updateXforms();
+}
+
+void TransformNode::updateXforms()
+{
+	toGlobal.set(xform);
+	toLocal.set(xform.inverse());
+	normi.set(xform.upper33().inverse().transpose());
+}
+
+void AffineXform::set( const mat4f& a )
+{
+	for( int r = 0; r < 3; ++r )
+		for( int c = 0; c < 4; ++c )
+			m[r][c] = a[r][c];
+	classify();
+}
+
+void AffineXform::set( const mat3f& a )
+{
+	for( int r = 0; r < 3; ++r ) {
+		for( int c = 0; c < 3; ++c )
+			m[r][c] = a[r][c];
+		m[r][3] = 0.0;
+	}
+	classify();
+}
+
+void AffineXform::classify()
+{
+	bool diagonal = true, unit = true;
+	for( int r = 0; r < 3; ++r )
+		for( int c = 0; c < 3; ++c ) {
+			if( r != c && m[r][c] != 0.0 )
+				diagonal = false;
+			if( m[r][c] != (r == c ? 1.0 : 0.0) )
+				unit = false;
+		}
+	bool translates = m[0][3] != 0.0 || m[1][3] != 0.0 || m[2][3] != 0.0;
+
+	if( unit ) {
+		kind = translates ? TRANSLATE : IDENTITY;
+	} else if( diagonal ) {
+		kind = SCALE_TRANSLATE;
+	} else {
+		// orthonormal rows, to within rounding, make a rotation
+#ifdef RAY_SIMD_VECMATH
+		const double tolerance = 1e-6;
+#else
+		const double tolerance = 1e-12;
+#endif
+		kind = RIGID;
+		for( int r = 0; r < 3 && kind == RIGID; ++r )
+			for( int s = 0; s < 3; ++s ) {
+				double d = m[r][0] * m[s][0] + m[r][1] * m[s][1] + m[r][2] * m[s][2];
+				if( fabs( d - (r == s ? 1.0 : 0.0) ) > tolerance ) {
+					kind = GENERAL;
+					break;
+				}
+			}
+	}
 }
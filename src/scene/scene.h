@@ -8,6 +8,8 @@
 #define __SCENE_H__
 
 #include <list>
+#include <map>
+#include <string>
 #include <algorithm>
 
 using namespace std;
@@ -15,11 +17,14 @@ using namespace std;
 #include "ray.h"
 #include "material.h"
 #include "camera.h"
+#include "bvh.h"
 #include "../vecmath/vecmath.h"
 #include <vector>
 
 class Light;
 class Scene;
+class BinaryScene;
+class ThreadPool;
 
 class SceneElement
 {
@@ -55,14 +60,87 @@ public:
 	bool intersect(const ray& r, double& tMin, double& tMax) const;
 };
 
+// Of t1 and t2, the roots of an infinite quadric along r with t2 the larger,
+// the one it is hit at: the nearest in front of the ray, or if clip is not
+// NULL, the nearest in front of it that lies in clip.  Returns false if the
+// ray misses.
+bool nearestQuadricRoot(const ray& r, double t1, double t2, const BoundingBox* clip, double& t);
+
+// The top three rows of a mat4f whose bottom row is (0, 0, 0, 1), which is
+// all an object transform needs.  What kind of transform it is gets worked
+// out once, so the common cases (none at all, a translation, a scale) skip
+// most of the arithmetic when points and vectors go through it.
+class AffineXform
+{
+public:
+	enum Kind
+	{
+		IDENTITY,
+		TRANSLATE,			// identity upper 3x3
+		RIGID,				// orthonormal upper 3x3: lengths are kept
+		SCALE_TRANSLATE,	// diagonal upper 3x3
+		GENERAL
+	};
+
+	AffineXform() { set( mat4f::identity() ); }
+
+	// The top three rows of m; the bottom one is assumed to be (0, 0, 0, 1).
+	void set( const mat4f& m );
+	// A linear transform, without translation.
+	void set( const mat3f& m );
+
+	Kind getKind() const { return kind; }
+	bool preservesLength() const { return kind <= RIGID; }
+
+	vec3f point( const vec3f& p ) const
+	{
+		switch( kind ) {
+		case IDENTITY:
+			return p;
+		case TRANSLATE:
+			return vec3f( p[0] + m[0][3], p[1] + m[1][3], p[2] + m[2][3] );
+		case SCALE_TRANSLATE:
+			return vec3f( m[0][0] * p[0] + m[0][3], m[1][1] * p[1] + m[1][3],
+				m[2][2] * p[2] + m[2][3] );
+		default:
+			return vec3f( m[0][0] * p[0] + m[0][1] * p[1] + m[0][2] * p[2] + m[0][3],
+				m[1][0] * p[0] + m[1][1] * p[1] + m[1][2] * p[2] + m[1][3],
+				m[2][0] * p[0] + m[2][1] * p[1] + m[2][2] * p[2] + m[2][3] );
+		}
+	}
+
+	// v as a direction: the translation doesn't apply.
+	vec3f vector( const vec3f& v ) const
+	{
+		switch( kind ) {
+		case IDENTITY:
+		case TRANSLATE:
+			return v;
+		case SCALE_TRANSLATE:
+			return vec3f( m[0][0] * v[0], m[1][1] * v[1], m[2][2] * v[2] );
+		default:
+			return vec3f( m[0][0] * v[0] + m[0][1] * v[1] + m[0][2] * v[2],
+				m[1][0] * v[0] + m[1][1] * v[1] + m[1][2] * v[2],
+				m[2][0] * v[0] + m[2][1] * v[1] + m[2][2] * v[2] );
+		}
+	}
+
+private:
+	void classify();
+
+	double m[3][4];
+	Kind kind;
+};
+
 class TransformNode
 {
 protected:
 
     // information about this node's transformation
     mat4f    xform;
-	mat4f    inverse;
-	mat3f    normi;
+	AffineXform toGlobal;	// xform
+	AffineXform toLocal;	// its inverse
+	AffineXform normi;		// inverse transpose of its upper 3x3, for normals
 
     // information about parent & children
     TransformNode *parent;
@@ -88,15 +166,17 @@ public:
         return child;
     }
     
+    const AffineXform& globalToLocal() const { return toLocal; }
+
     // Coordinate-Space transformation
     vec3f globalToLocalCoords(const vec3f &v)
     {
-        return inverse * v;
+        return toLocal.point(v);
     }
 
     vec3f localToGlobalCoords(const vec3f &v)
     {
-        return xform * v;
+        return toGlobal.point(v);
     }
 
     vec4f localToGlobalCoords(const vec4f &v)
@@ -104,9 +184,12 @@ public:
         return xform * v;
     }
 
-    vec3f localToGlobalCoordsNormal(const vec3f &v)
+    // v must be a unit vector; so is the result.
+    vec3f localToGlobalCoordsNormal(const vec3f &v) const
     {
-        return (normi * v).normalize();
+        if (normi.preservesLength())
+            return normi.vector(v);
+        return normi.vector(v).normalize();
     }
 
 protected:
@@ -121,9 +204,10 @@ protected:
         else
             this->xform = parent->xform * xform;
         
-        inverse = this->xform.inverse();
-        normi = this->xform.upper33().inverse().transpose();
+        updateXforms();
     }
+
+    void updateXforms();	// toGlobal, toLocal and normi from xform
 };
 
 class TransformRoot : public TransformNode
@@ -143,7 +227,8 @@ public:
     virtual bool intersect(const ray&r, isect&i) const;
     
     // intersections performed in the object's local coordinate space
-    // do not call directly - this should only be called by intersect()
+    // do not call directly - this should only be called by intersect(),
+    // or by an Instance of the object
 	virtual bool intersectLocal( const ray& r, isect& i ) const;
 
 
@@ -281,7 +366,7 @@ public:
 
 public:
 	Scene() 
-		: transformRoot(), objects(), lights() {
+		: transformRoot(), objects(), binaryData( NULL ), threadPool( NULL ), lights() {
 		constAttenFactor = 1.0;
 		linearAttenFactor = 1.0;
 		quadAttenFactor = 1.0;
@@ -291,19 +376,64 @@ public:
 		terminationThreshold = 1.0;
 		ambientLight = vec3f(1.0, 1.0, 1.0);
 		accShadowAttenThresh = 0.0;
+		textureMapping = false;
+		softShadow = false;
+		glossyReflection = false;
+		motionBlur = false;
+		softShadowCoeff = 0.9;
+		bumpMapping = false;
 	}
 	virtual ~Scene();
 
+	// The object's bounds are computed by initScene, so add it complete
+	// but don't count on them before.
 	void add( Geometry* obj )
-	{
-		obj->ComputeBoundingBox();
-		objects.push_back( obj );
-	}
+	{ objects.push_back( obj ); }
 	void add( Light* light )
 	{ lights.push_back( light ); }
 
+	// An object that isn't in the scene itself, only placed in it by
+	// Instances, under the given name.  It is put at the root of the
+	// transform tree, so the bounds it gets here are its local ones.  The
+	// name must not be taken yet.
+	void addPrototype( const string& name, SceneObject* obj );
+	// NULL if there is no prototype of that name
+	SceneObject* getPrototype( const string& name ) const;
+
+	// The binary scene file the scene was read from, if it was; its meshes
+	// use their arrays right there, so the scene keeps it, and deletes it
+	// after the objects.
+	void setBinaryData( BinaryScene* data ) { binaryData = data; }
+
+	// The pool that reading and setting up the scene may use for parallel
+	// loops, e.g. over the faces of a mesh; NULL the rest of the time,
+	// when everything runs serially.
+	void setThreadPool( ThreadPool* pool ) { threadPool = pool; }
+	ThreadPool* getThreadPool() const { return threadPool; }
+	const BinaryScene* getBinaryData() const { return binaryData; }
+
 	bool intersect( const ray& r, isect& i ) const;
-	void initScene();
+
+	// intersect() for count <= PACKET_SIZE coherent rays, e.g. the primary
+	// rays of neighbouring pixels, that walk the BVH together.  found[k]
+	// says whether ray k hit something closer than tMax[k] (anything, if
+	// tMax is NULL), and i[k] gets that hit.
+	void intersectPacket( const ray* r, int count, isect* i, bool* found,
+		const double* tMax = NULL ) const;
+
+	// The shadow ray query: what lies on r no further than distance?  The
+	// walk stops at the first opaque surface it comes across, in whatever
+	// order.  If everything in the way lets light through, i gets the
+	// nearest of it, from where the caller can go on towards the light.
+	enum Occlusion { UNOCCLUDED, OPAQUE, TRANSPARENT };
+	Occlusion occluded( const ray& r, double distance, isect& i ) const;
+	// occluded() for count <= PACKET_SIZE rays walking the BVH together.
+	void occludedPacket( const ray* r, int count, const double* distance,
+		isect* i, Occlusion* result ) const;
+	// Compute the bounds of the objects, which builds the BVHs of meshes,
+	// and the scene BVH over them; on pool, if it isn't NULL.
+	void initScene( ThreadPool* pool = NULL );
+	void buildAccelerationStructure();	// sorts the objects into bounded/non-bounded and builds the BVH over the bounded ones
 
 	list<Light*>::const_iterator beginLights() const { return lights.begin(); }
 	list<Light*>::const_iterator endLights() const { return lights.end(); }
@@ -356,9 +486,14 @@ public:
 	void setTerminationThreshold(double terThresh);
 
 private:
-    list<Geometry*> objects;
+    list<Geometry*> objects;	// owns every object in the scene; the lists below only refer to them
 	list<Geometry*> nonboundedobjects;
 	list<Geometry*> boundedobjects;
+	vector<Geometry*> bvhObjects;	// the bounded objects, indexed by BVH primitive number
+	BVH bvh;
+	map<string, SceneObject*> prototypes;	// owned, like objects
+	BinaryScene* binaryData;
+	ThreadPool* threadPool;
     list<Light*> lights;
     Camera camera;
 	bool textureMapping;
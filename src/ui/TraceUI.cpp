@@ -26,7 +26,7 @@ void TraceUI::cb_load_scene(Fl_Menu_* o, void* v)
 {
 	TraceUI* pUI=whoami(o);
 	
-	char* newfile = fl_file_chooser("Open Scene?", "*.ray", NULL );
+	char* newfile = fl_file_chooser("Open Scene?", "*.{ray,rayb}", NULL );
 
 	if (newfile != NULL) {
 		char buf[256];
@@ -403,6 +403,12 @@ void TraceUI::cb_motionBlur(Fl_Widget * o, void * v)
 	}
 }
 
+void TraceUI::cb_progressive(Fl_Widget * o, void * v)
+{
+	TraceUI* pUI = (TraceUI*)(o->user_data());
+	pUI->m_progressive = bool(((Fl_Light_Button *)o)->value());
+}
+
 void TraceUI::cb_bumpMapping(Fl_Widget * o, void * v)
 {
 	TraceUI* pUI = (TraceUI*)(o->user_data());
@@ -434,19 +440,17 @@ void TraceUI::cb_render(Fl_Widget* o, void* v)
 		//set background img for RayTracer
 		pUI->raytracer->setBackgroundImg(pUI->backgroundImg);
 
-		//set the linked ui of raytracer to be me
-		pUI->raytracer->setUI(pUI);
+		//hand the current options over to the raytracer
+		pUI->raytracer->setSettings(pUI->getRenderSettings());
 
 
 		int width=pUI->getSize();
 		int	height = (int)(width / pUI->raytracer->aspectRatio() + 0.5);
-		int depth = pUI->getDepth();
 		pUI->m_traceGlWindow->resizeWindow( width, height );
 
 		pUI->m_traceGlWindow->show();
 
 		pUI->raytracer->traceSetup(width, height);
-		pUI->raytracer->setDepthLimit(depth);
 		
 		// Save the window label
 		const char *old_label = pUI->m_traceGlWindow->label();
@@ -460,47 +464,96 @@ void TraceUI::cb_render(Fl_Widget* o, void* v)
 		Fl::check();
 		Fl::flush();
 
-		for (int y=0; y<height; y++) {
-			for (int x=0; x<width; x++) {
+		int threads = pUI->raytracer->getThreads();
+		if (pUI->m_progressive) {
+			// a blocky preview, then one sample per pixel and pass until
+			// stopped; the bands are as tall as the tiled render's, so
+			// the window is still refreshed every so often within a pass
+			int tilesPerRow = (width + 15) / 16;
+			int rowsPerBand = 16 * ((2 * threads + tilesPerRow - 1) / tilesPerRow);
+
+			pUI->raytracer->beginProgressive();
+			while (!done && !pUI->raytracer->progressiveDone()) {
+				for (int y=0; y<height && !done; y+=rowsPerBand) {
+					pUI->raytracer->tracePass( y, y + rowsPerBand );
+
+					pUI->m_traceGlWindow->refresh();
+					Fl::check();
+					if (Fl::damage()) {
+						Fl::flush();
+					}
+				}
 				if (done) break;
-				
-				// current time
-				now = clock();
+				pUI->raytracer->endPass();
+
+				// update the window label
+				sprintf(buffer, "(pass %d) %s", pUI->raytracer->getPasses(), old_label);
+				pUI->m_traceGlWindow->label(buffer);
+			}
+		} else if (threads > 1 && !pUI->raytracer->getScene()->getMotionBlur()) {
+			// render bands of tile rows on all threads, coming back to the
+			// event loop after every band; a band is made tall enough to
+			// keep every thread busy with a couple of tiles
+			int tilesPerRow = (width + 15) / 16;
+			int rowsPerBand = 16 * ((2 * threads + tilesPerRow - 1) / tilesPerRow);
 
-				// check event every 1/2 second
-				if (((double)(now-prev)/CLOCKS_PER_SEC)>0.5) {
-					prev=now;
+			for (int y=0; y<height && !done; y+=rowsPerBand) {
+				pUI->raytracer->traceTiles( y, y + rowsPerBand );
 
-					if (Fl::ready()) {
-						// refresh
-						pUI->m_traceGlWindow->refresh();
-						// check event
-						Fl::check();
+				pUI->m_traceGlWindow->refresh();
+				Fl::check();
+				if (Fl::damage()) {
+					Fl::flush();
+				}
 
-						if (Fl::damage()) {
-							Fl::flush();
+				// update the window label
+				int finished = y + rowsPerBand < height ? y + rowsPerBand : height;
+				sprintf(buffer, "(%d%%) %s", (int)((double)finished / (double)height * 100.0), old_label);
+				pUI->m_traceGlWindow->label(buffer);
+			}
+		} else {
+			for (int y=0; y<height; y++) {
+				for (int x=0; x<width; x++) {
+					if (done) break;
+				
+					// current time
+					now = clock();
+
+					// check event every 1/2 second
+					if (((double)(now-prev)/CLOCKS_PER_SEC)>0.5) {
+						prev=now;
+
+						if (Fl::ready()) {
+							// refresh
+							pUI->m_traceGlWindow->refresh();
+							// check event
+							Fl::check();
+
+							if (Fl::damage()) {
+								Fl::flush();
+							}
 						}
 					}
-				}
 
-				pUI->raytracer->tracePixel( x, y );
+					pUI->raytracer->tracePixel( x, y );
 		
-			}
-			if (done) break;
+				}
+				if (done) break;
 
-			// flush when finish a row
-			if (Fl::ready()) {
-				// refresh
-				pUI->m_traceGlWindow->refresh();
+				// flush when finish a row
+				if (Fl::ready()) {
+					// refresh
+					pUI->m_traceGlWindow->refresh();
 
-				if (Fl::damage()) {
-					Fl::flush();
+					if (Fl::damage()) {
+						Fl::flush();
+					}
 				}
-			}
-			// update the window label
-			sprintf(buffer, "(%d%%) %s", (int)((double)y / (double)height * 100.0), old_label);
-			pUI->m_traceGlWindow->label(buffer);
+				// update the window label
+				sprintf(buffer, "(%d%%) %s", (int)((double)y / (double)height * 100.0), old_label);
+				pUI->m_traceGlWindow->label(buffer);
 			
+			}
 		}
 		done=true;
 		pUI->m_traceGlWindow->refresh();
@@ -601,6 +654,38 @@ bool TraceUI::getAdaptiveSupersampling()
 	return this->m_adaptiveSupersampling;
 }
 
+bool TraceUI::getProgressive()
+{
+	return this->m_progressive;
+}
+
+RenderSettings TraceUI::getRenderSettings()
+{
+	RenderSettings s;
+	s.depth = m_nDepth;
+	s.background = m_enableBackground;
+	s.antialiasing = m_enableAntialiasing;
+	s.numSubpixels = m_numSubPixels;
+	s.jittering = m_enableJittering;
+	s.adaptiveSupersampling = m_adaptiveSupersampling;
+	s.depthOfField = m_enableDepthofField;
+	s.focalLength = focalLength;
+	s.aperture = aperture;
+	s.softShadow = m_enableSoftShadow;
+	s.softShadowCoeff = softshadowCoeff;
+	s.glossyReflection = m_glossyReflection;
+	s.motionBlur = m_motionBlur;
+	s.textureMapping = m_enableTextureMapping;
+	s.bumpMapping = m_bumpMapping;
+	s.constAttenFactor = m_constAttenFactor;
+	s.linearAttenFactor = m_linearAttenFactor;
+	s.quadAttenFactor = m_quadAttenFactor;
+	s.terminationThreshold = m_terminationIntensity;
+	s.ambientLight = ambientLight;
+	s.accShadowAttenThresh = accShadowAttenThresh;
+	return s;
+}
+
 // menu definition
 Fl_Menu_Item TraceUI::menuitems[] = {
 	{ "&File",		0, 0, 0, FL_SUBMENU },
@@ -652,6 +737,7 @@ TraceUI::TraceUI() {
 	ambientLight = 1.0;
 	accShadowAttenThresh = 0.0;
 	m_adaptiveSupersampling = false;
+	m_progressive = false;
 
 	m_mainWindow = new Fl_Window(100, 40, 400, 500, "Ray <Not Loaded>");
 		m_mainWindow->user_data((void*)(this));	// record self to be used by static callback functions
@@ -893,6 +979,12 @@ TraceUI::TraceUI() {
 		m_adaptiveSupersamplingButton->value(m_adaptiveSupersampling);
 		m_adaptiveSupersamplingButton->callback(cb_enableAdaptiveSupersampling);
 
+		//render a quick preview first, then refine it pass by pass
+		m_progressiveButton = new Fl_Light_Button(10, 435, 180, 25, "&Progressive");
+		m_progressiveButton->user_data((void*)(this));   // record self to be used by static callback functions
+		m_progressiveButton->value(m_progressive);
+		m_progressiveButton->callback(cb_progressive);
+
 		m_renderButton = new Fl_Button(240, 27, 70, 25, "&Render");
 		m_renderButton->user_data((void*)(this));
 		m_renderButton->callback(cb_render);
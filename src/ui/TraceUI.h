@@ -51,6 +51,7 @@ public:
 	Fl_Light_Button*	m_motionBlurButton;
 	Fl_Light_Button*	m_bumpMappingButton;
 	Fl_Light_Button*	m_adaptiveSupersamplingButton;
+	Fl_Light_Button*	m_progressiveButton;
 	Fl_Slider*			m_adaptiveTerminationSlider;
 	Fl_Slider*			m_ambientLightSlider;
 	Fl_Slider*			m_accShadowAttenSlider;
@@ -89,6 +90,10 @@ public:
 	bool		getGlossyReflection();
 	bool		getMotionBlur();
 	bool		getAdaptiveSupersampling();
+	bool		getProgressive();
+
+	// everything the sliders and buttons are set to, for the ray tracer
+	RenderSettings	getRenderSettings();
 private:
 	RayTracer*	raytracer;
 
@@ -109,6 +114,7 @@ private:
 	bool		m_motionBlur;
 	bool		m_bumpMapping;
 	bool		m_adaptiveSupersampling;
+	bool		m_progressive;		// render in passes that refine the image until stopped
 	double		m_terminationIntensity;
 
 	double		focalLength;
@@ -151,6 +157,7 @@ private:
 	static void cb_enableDepthofField(Fl_Widget* o, void* v);
 	static void cb_enableTextureMapping(Fl_Widget* o, void* v);
 	static void cb_enableAdaptiveSupersampling(Fl_Widget* o, void* v);
+	static void cb_progressive(Fl_Widget* o, void* v);
 	static void cb_enableSoftShadow(Fl_Widget* o, void* v);
 	static void cb_numSubPixelsSlides(Fl_Widget* o, void* v);
 	static void cb_focalLengthSlides(Fl_Widget* o, void* v);
@@ -8,6 +8,26 @@
 #include <cmath>
 #include <algorithm>
 
+// Building with RAY_SIMD_VECMATH defined stores the vectors and matrices
+// below in single precision, each row padded to four lanes and 16-byte
+// aligned, and does the arithmetic on them with SSE2.  The interface is
+// the same either way; vreal is the element type.
+//
+// Renders in single precision match double ones except where hit points
+// lose too much to rounding: small objects under long chains of
+// transforms, far from the eye, can catch reflected and shadow rays on
+// the surface they leave, and grazing shadow rays can do the same
+// anywhere.  Either shows as scattered pixels, not as a shift of the
+// whole image.
+#ifdef RAY_SIMD_VECMATH
+#include <emmintrin.h>
+typedef float vreal;
+#define VECMATH_ALIGN alignas( 16 )
+#else
+typedef double vreal;
+#define VECMATH_ALIGN
+#endif
+
 using namespace std;
 
 class vec3f;
@@ -29,11 +49,70 @@ inline double maximum( double a, double b )
 	return a > b ? a : b;
 }
 
+#ifdef RAY_SIMD_VECMATH
+// Lane 0 + 1 + 2 of a; lane 3 is left out.
+inline float sum3( __m128 a )
+{
+	__m128 y = _mm_shuffle_ps( a, a, _MM_SHUFFLE( 1, 1, 1, 1 ) );
+	__m128 z = _mm_shuffle_ps( a, a, _MM_SHUFFLE( 2, 2, 2, 2 ) );
+	return _mm_cvtss_f32( _mm_add_ss( _mm_add_ss( a, y ), z ) );
+}
+
+inline float sum4( __m128 a )
+{
+	__m128 s = _mm_add_ps( a, _mm_movehl_ps( a, a ) );
+	return _mm_cvtss_f32( _mm_add_ss( s, _mm_shuffle_ps( s, s, _MM_SHUFFLE( 1, 1, 1, 1 ) ) ) );
+}
+
+// Lane i of the result is the dot product of ri with v.
+inline __m128 rowDots( __m128 r0, __m128 r1, __m128 r2, __m128 r3, __m128 v )
+{
+	r0 = _mm_mul_ps( r0, v );
+	r1 = _mm_mul_ps( r1, v );
+	r2 = _mm_mul_ps( r2, v );
+	r3 = _mm_mul_ps( r3, v );
+	_MM_TRANSPOSE4_PS( r0, r1, r2, r3 );
+	return _mm_add_ps( _mm_add_ps( r0, r1 ), _mm_add_ps( r2, r3 ) );
+}
+
+// a with lane 3 cleared
+inline __m128 xyzLanes( __m128 a )
+{
+	return _mm_and_ps( a, _mm_castsi128_ps( _mm_set_epi32( 0, -1, -1, -1 ) ) );
+}
+#endif
+
 class vec3f
 {
 public:
 	// Constructors
 
+#ifdef RAY_SIMD_VECMATH
+	// lane 3 is padding.  The constructors clear it, but arithmetic can
+	// leave anything there, so what adds up all four lanes masks it first.
+	vec3f() { _mm_store_ps( n, _mm_setzero_ps() ); }
+	vec3f( const double x, const double y, const double z )
+		{ _mm_store_ps( n, _mm_set_ps( 0.0f, float( z ), float( y ), float( x ) ) ); }
+	vec3f( const vec3f& v )
+		{ _mm_store_ps( n, v.simd() ); }
+	explicit vec3f( __m128 m )
+		{ _mm_store_ps( n, m ); }
+	vec3f( const vec4f& v4 );
+
+	vec3f& operator	=( const vec3f& v )
+		{ _mm_store_ps( n, v.simd() ); return *this; }
+	vec3f& operator +=( const vec3f& v )
+		{ _mm_store_ps( n, _mm_add_ps( simd(), v.simd() ) ); return *this; }
+	vec3f& operator -= ( const vec3f& v )
+		{ _mm_store_ps( n, _mm_sub_ps( simd(), v.simd() ) ); return *this; }
+	vec3f& operator *= ( const double d )
+		{ _mm_store_ps( n, _mm_mul_ps( simd(), _mm_set1_ps( float( d ) ) ) ); return *this; }
+	vec3f& operator /= ( const double d )
+		{ _mm_store_ps( n, _mm_div_ps( simd(), _mm_set1_ps( float( d ) ) ) ); return *this; }
+
+	__m128 simd() const
+		{ return _mm_load_ps( n ); }
+#else
 	vec3f() { n[0] = 0.0; n[1] = 0.0; n[2] = 0.0; }
 	vec3f( const double x, const double y, const double z )
 		{ n[0] = x; n[1] = y; n[2] = z; }
@@ -53,19 +132,28 @@ public:
 		{ n[0] *= d; n[1] *= d; n[2] *= d; return *this; }
 	vec3f& operator /= ( const double d )
 		{ n[0] /= d; n[1] /= d; n[2] /= d; return *this; }
+#endif
 
-	double& operator []( int i )
+	vreal& operator []( int i )
 		{ return n[i]; }
-	double operator []( int i ) const 
+	vreal operator []( int i ) const 
 		{ return n[i]; }
 
 	// Cross product between this and 'b'
 	vec3f cross(const vec3f& b) const
 	{
+#ifdef RAY_SIMD_VECMATH
+		__m128 a = simd(), c = b.simd();
+		__m128 a1 = _mm_shuffle_ps( a, a, _MM_SHUFFLE( 3, 0, 2, 1 ) );
+		__m128 c1 = _mm_shuffle_ps( c, c, _MM_SHUFFLE( 3, 0, 2, 1 ) );
+		__m128 r = _mm_sub_ps( _mm_mul_ps( a, c1 ), _mm_mul_ps( a1, c ) );
+		return vec3f( _mm_shuffle_ps( r, r, _MM_SHUFFLE( 3, 0, 2, 1 ) ) );
+#else
 		return vec3f(
 			n[1]*b.n[2] - n[2]*b.n[1],
 			n[2]*b.n[0] - n[0]*b.n[2],
 			n[0]*b.n[1] - n[1]*b.n[0] );
+#endif
 	}
 
 	// Clamps each component to the range 0.0 <= n <= 1.0
@@ -83,11 +171,15 @@ public:
 	// Dot product of this and 'b'
 	double dot(const vec3f& b) const
 	{
+#ifdef RAY_SIMD_VECMATH
+		return sum3( _mm_mul_ps( simd(), b.simd() ) );
+#else
 		return n[0]*b[0] + n[1]*b[1] + n[2]*b[2];
+#endif
 	}
 
 	double length_squared() const
-		{ return n[0]*n[0] + n[1]*n[1] + n[2]*n[2]; }
+		{ return dot( *this ); }
 	double length() const
 		{ return sqrt( length_squared() ); }
 	vec3f normalize() const
@@ -100,7 +192,11 @@ public:
 	bool iszero() const { return ( (n[0]==0 && n[1]==0 && n[2]==0) ? true : false); };
 
 public:
-	double n[3];
+#ifdef RAY_SIMD_VECMATH
+	VECMATH_ALIGN vreal n[4];
+#else
+	vreal n[3];
+#endif
 };
 
 class vec4f
@@ -108,6 +204,31 @@ class vec4f
 public:
 	// Constructors
 
+#ifdef RAY_SIMD_VECMATH
+	vec4f() { _mm_store_ps( n, _mm_setzero_ps() ); }
+	vec4f( const double x, const double y, const double z, const double w )
+		{ _mm_store_ps( n, _mm_set_ps( float( w ), float( z ), float( y ), float( x ) ) ); }
+	vec4f( const vec4f& v )
+		{ _mm_store_ps( n, v.simd() ); }
+	vec4f( const vec3f& v )
+		{ _mm_store_ps( n, v.simd() ); n[3] = 1.0f; }
+	explicit vec4f( __m128 m )
+		{ _mm_store_ps( n, m ); }
+
+	vec4f& operator =( const vec4f& v )
+		{ _mm_store_ps( n, v.simd() ); return *this; }
+	vec4f& operator +=( const vec4f& v )
+		{ _mm_store_ps( n, _mm_add_ps( simd(), v.simd() ) ); return *this; }
+	vec4f& operator -= ( const vec4f& v )
+		{ _mm_store_ps( n, _mm_sub_ps( simd(), v.simd() ) ); return *this; }
+	vec4f& operator *= ( const double d )
+		{ _mm_store_ps( n, _mm_mul_ps( simd(), _mm_set1_ps( float( d ) ) ) ); return *this; }
+	vec4f& operator /= ( const double d )
+		{ _mm_store_ps( n, _mm_div_ps( simd(), _mm_set1_ps( float( d ) ) ) ); return *this; }
+
+	__m128 simd() const
+		{ return _mm_load_ps( n ); }
+#else
 	vec4f() { n[0] = 0.0; n[1] = 0.0; n[2] = 0.0; n[3] = 0.0; }
 	vec4f( const double x, const double y, const double z, const double w )
 		{ n[0] = x; n[1] = y; n[2] = z; n[3] = w; }
@@ -131,15 +252,20 @@ public:
 		{ n[0] *= d; n[1] *= d; n[2] *= d; n[3] *= d; return *this; }
 	vec4f& operator /= ( const double d )
 		{ n[0] /= d; n[1] /= d; n[2] /= d; n[3] /= d; return *this; }
-	double& operator []( int i )
+#endif
+	vreal& operator []( int i )
 		{ return n[i]; }
-	double operator []( int i ) const 
+	vreal operator []( int i ) const 
 		{ return n[i]; }
 
 	// Dot product of this and 'b'
 	double dot(const vec4f& b) const
 	{
+#ifdef RAY_SIMD_VECMATH
+		return sum4( _mm_mul_ps( simd(), b.simd() ) );
+#else
 		return n[0]*b[0] + n[1]*b[1] + n[2]*b[2] + n[3]*b[3];
+#endif
 	}
 
 	// Clamps each component to the range 0.0 <= n <= 1.0
@@ -157,7 +283,7 @@ public:
 
 
 	double length_squared() const
-		{ return n[0]*n[0] + n[1]*n[1] + n[2]*n[2] + n[3]*n[3]; }
+		{ return dot( *this ); }
 	double length() const
 		{ return sqrt( length_squared() ); }
 	vec4f normalize() const
@@ -169,7 +295,7 @@ public:
 	}
 
 public:
-	double n[4];
+	VECMATH_ALIGN vreal n[4];
 };
 
 class mat3f
@@ -319,16 +445,49 @@ mat4f perspective3D(const double d);			    // perspective 3D
 
 // And now, many inline functions are defined.
 
+#ifdef RAY_SIMD_VECMATH
+// a with its padding lane set to 1, for the vec3f-as-a-point products
+inline __m128 pointLanes( const vec3f& a )
+{
+	return _mm_or_ps( xyzLanes( a.simd() ), _mm_set_ps( 1.0f, 0.0f, 0.0f, 0.0f ) );
+}
+#endif
+
 inline double operator *( const vec3f& a, const vec4f& b )
 {
+#ifdef RAY_SIMD_VECMATH
+	return sum4( _mm_mul_ps( pointLanes( a ), b.simd() ) );
+#else
 	return a[0] * b[0] + a[1] * b[1] + a[2] * b[2] + b[3];
+#endif
 }
 
 inline double operator *( const vec4f& b, const vec3f& a )
 {
-	return a[0] * b[0] + a[1] * b[1] + a[2] * b[2] + b[3];
+	return a * b;
+}
+
+#ifdef RAY_SIMD_VECMATH
+inline vec3f operator -(const vec3f& v)
+{
+	return vec3f( _mm_sub_ps( _mm_setzero_ps(), v.simd() ) );
 }
 
+inline vec3f operator +(const vec3f& a, const vec3f& b)
+{
+	return vec3f( _mm_add_ps( a.simd(), b.simd() ) );
+}
+
+inline vec3f operator -(const vec3f& a, const vec3f& b)
+{
+	return vec3f( _mm_sub_ps( a.simd(), b.simd() ) );
+}
+
+inline vec3f operator *(const vec3f& a, const double d )
+{
+	return vec3f( _mm_mul_ps( a.simd(), _mm_set1_ps( float( d ) ) ) );
+}
+#else
 inline vec3f operator -(const vec3f& v)
 {
 	return vec3f( -v.n[0], -v.n[1], -v.n[2] );
@@ -348,6 +507,7 @@ inline vec3f operator *(const vec3f& a, const double d )
 {
 	return vec3f( a.n[0] * d, a.n[1] * d, a.n[2] * d );
 }
+#endif
 
 inline vec3f operator *(const double d, const vec3f& a)
 {
@@ -356,7 +516,11 @@ inline vec3f operator *(const double d, const vec3f& a)
 
 inline vec3f operator *(const mat4f& a, const vec3f& v)
 {
+#ifdef RAY_SIMD_VECMATH
+	return vec3f( rowDots( a[0].simd(), a[1].simd(), a[2].simd(), a[3].simd(), pointLanes( v ) ) );
+#else
 	return vec3f( a[0] * v, a[1] * v, a[2] * v ); 
+#endif
 }
 
 inline vec3f operator *(const vec3f& v, mat4f& a)
@@ -366,12 +530,17 @@ inline vec3f operator *(const vec3f& v, mat4f& a)
 
 inline double operator *(const vec3f& a, const vec3f& b)
 {
-	return a.n[0]*b.n[0] + a.n[1]*b.n[1] + a.n[2]*b.n[2];
+	return a.dot( b );
 }
 
 inline vec3f operator *( const mat3f& a, const vec3f& b )
 {
+#ifdef RAY_SIMD_VECMATH
+	// b without its padding, so the rows' padding lanes add nothing
+	return vec3f( rowDots( a[0].simd(), a[1].simd(), a[2].simd(), _mm_setzero_ps(), xyzLanes( b.simd() ) ) );
+#else
 	return vec3f( a[0]*b, a[1]*b, a[2]*b );
+#endif
 }
 
 inline vec3f operator *( const vec3f& a, const mat3f& b )
@@ -381,7 +550,11 @@ inline vec3f operator *( const vec3f& a, const mat3f& b )
 
 inline vec3f operator /(const vec3f& a, const double d)
 {
+#ifdef RAY_SIMD_VECMATH
+	return vec3f( _mm_div_ps( a.simd(), _mm_set1_ps( float( d ) ) ) );
+#else
 	return vec3f( a.n[0] / d, a.n[1] / d, a.n[2] / d );
+#endif
 }
 
 /* // the vector cross product
@@ -421,19 +594,33 @@ inline void swap( vec3f& a, vec3f& b )
 	b = t;
 }
 
+// minps/maxps pick b unless a compares strictly less/greater, just as
+// minimum() and maximum() do, NaNs included.
 inline vec3f minimum( const vec3f& a, const vec3f& b )
 {
+#ifdef RAY_SIMD_VECMATH
+	return vec3f( _mm_min_ps( a.simd(), b.simd() ) );
+#else
 	return vec3f( minimum(a.n[0],b.n[0]), minimum(a.n[1],b.n[1]), minimum(a.n[2],b.n[2]) );
+#endif
 }
 
 inline vec3f maximum(const vec3f& a, const vec3f& b)
 {
+#ifdef RAY_SIMD_VECMATH
+	return vec3f( _mm_max_ps( a.simd(), b.simd() ) );
+#else
 	return vec3f( maximum(a.n[0],b.n[0]), maximum(a.n[1],b.n[1]), maximum(a.n[2],b.n[2]) );
+#endif
 }
 
 inline vec3f prod(const vec3f& a, const vec3f& b )
 {
+#ifdef RAY_SIMD_VECMATH
+	return vec3f( _mm_mul_ps( a.simd(), b.simd() ) );
+#else
 	return vec3f( a.n[0]*b.n[0], a.n[1]*b.n[1], a.n[2]*b.n[2] );
+#endif
 }
 
 inline vec4f operator -( const vec4f& v )
@@ -465,12 +652,16 @@ inline vec4f operator *(const double d, const vec4f& a)
 
 inline double operator *(const vec4f& a, const vec4f& b)
 {
-	return a.n[0]*b.n[0] + a.n[1]*b.n[1] + a.n[2]*b.n[2] + a.n[3]*b.n[3];
+	return a.dot( b );
 }
 
 inline vec4f operator *(const mat4f& a, const vec4f& v)
 {
+#ifdef RAY_SIMD_VECMATH
+	return vec4f( rowDots( a[0].simd(), a[1].simd(), a[2].simd(), a[3].simd(), v.simd() ) );
+#else
 	return vec4f( a[0] * v, a[1] * v, a[2] * v, a[3] * v );
+#endif
 }
 
 inline vec4f operator *( const vec4f& v, mat4f& a )
@@ -513,14 +704,22 @@ inline void swap( vec4f& a, vec4f& b )
 
 inline vec4f minimum( const vec4f& a, const vec4f& b )
 {
+#ifdef RAY_SIMD_VECMATH
+	return vec4f( _mm_min_ps( a.simd(), b.simd() ) );
+#else
 	return vec4f( minimum(a.n[0],b.n[0]), minimum(a.n[1],b.n[1]), minimum(a.n[2],b.n[2]),
 	             minimum(a.n[3],b.n[3]) );
+#endif
 }
 
 inline vec4f maximum(const vec4f& a, const vec4f& b)
 {
+#ifdef RAY_SIMD_VECMATH
+	return vec4f( _mm_max_ps( a.simd(), b.simd() ) );
+#else
 	return vec4f( maximum(a.n[0],b.n[0]), maximum(a.n[1],b.n[1]), maximum(a.n[2],b.n[2]),
 	             maximum(a.n[3],b.n[3]) );
+#endif
 }
 
 inline vec4f prod(const vec4f& a, const vec4f& b )
@@ -671,9 +870,13 @@ inline void swap( mat4f& a, mat4f& b )
 
 inline vec3f::vec3f( const vec4f& v ) 
 { 
+#ifdef RAY_SIMD_VECMATH
+	_mm_store_ps( n, xyzLanes( v.simd() ) );
+#else
 	n[0] = v[0]; 
 	n[1] = v[1]; 
 	n[2] = v[2]; 
+#endif
 }
 /*
 inline vec3f clamp( const vec3f& other )